@@ -4,6 +4,7 @@
 #include <math.h>
 #include <vector>
 #include <cassert>
+#include <algorithm>
 #include "util.hpp"
 #pragma once
 
@@ -42,8 +43,8 @@ class ControlBasis {
         /* Evaluate the Basis(alpha, t) at time t using the coefficients coeff. */
         virtual void evaluate(const double t, const std::vector<double>& coeff, int carrier_freq_id, double* Blt1, double*Blt2) = 0;
 
-        /* Evaluates the derivative at time t, multiplied with fbar. */
-        virtual void derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id)= 0;
+        /* Evaluates the derivative at time t, multiplied with fbar. Only parameters with support at t are considered: their indices are appended to 'ids', the derivative values to 'coeff_diff'. */
+        virtual void derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id)= 0;
 };
 
 /* 
@@ -61,6 +62,9 @@ class BSpline2nd : public ControlBasis {
         /* Evaluate the bspline basis functions B_l(tau_l(t)) */
         double basisfunction(int id, double t);
 
+        /* Range [lfirst, llast] of splines that can be nonzero at time t (at most 3) */
+        void activeSplines(double t, int* lfirst, int* llast);
+
     public:
         BSpline2nd(int nsplines, double tstart, double tstop, bool enforceZeroBoundary);
         ~BSpline2nd();
@@ -74,7 +78,7 @@ class BSpline2nd : public ControlBasis {
         void evaluate(const double t, const std::vector<double>& coeff, int carrier_freq_id, double* Blt1_ptr, double* Blt2_ptr);
 
         /* Evaluates the derivative at time t, multiplied with fbar. */
-        void derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
+        void derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
 };
 
 /* 
@@ -94,6 +98,9 @@ class BSpline2ndAmplitude : public ControlBasis {
         /* Evaluate the bspline basis functions B_l(tau_l(t)) */
         double basisfunction(int id, double t);
 
+        /* Range [lfirst, llast] of splines that can be nonzero at time t (at most 3) */
+        void activeSplines(double t, int* lfirst, int* llast);
+
     public:
         BSpline2ndAmplitude(int nsplines, double scaling, double tstart, double tstop, bool enforceZeroBoundary);
         ~BSpline2ndAmplitude();
@@ -107,7 +114,7 @@ class BSpline2ndAmplitude : public ControlBasis {
         void evaluate(const double t, const std::vector<double>& coeff, int carrier_freq_id, double* Blt1_ptr, double* Blt2_ptr);
 
         /* Evaluates the derivative at time t, multiplied with fbar. */
-        void derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
+        void derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
 };
 
 /* 
@@ -127,7 +134,7 @@ class Step : public ControlBasis {
         void evaluate(const double t, const std::vector<double>& coeff, int carrier_freq_id, double* Blt1, double*Blt2);
 
         /* Evaluates the derivative at time t, multiplied with fbar. */
-        void derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
+        void derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
 };
 
 /* 
@@ -162,7 +169,7 @@ class BSpline0 : public ControlBasis {
         void evaluate(const double t, const std::vector<double>& coeff, int carrier_freq_id, double* Blt1_ptr, double* Blt2_ptr);
 
         /* Evaluates the derivative at time t, multiplied with fbar. */
-        void derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
+        void derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id);
 };
 
 /* 
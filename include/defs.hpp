@@ -25,7 +25,8 @@ enum class ObjectiveType {JFROBENIUS,    // weighted Frobenius norm: 1/2 * ||\rh
 /* Linear solver */
 enum class LinearSolverType{
   GMRES,   // uses Petsc's GMRES solver
-  NEUMANN   // uses Neuman power iterations 
+  NEUMANN,  // uses Neuman power iterations 
+  LU        // dense LU factorization, reused while the RHS does not change
 };
 
 /* Solver run type */
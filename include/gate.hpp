@@ -30,7 +30,13 @@ class Gate {
 
 
   private:
-    Mat VxV_re, VxV_im;     /* Real and imaginary part of vectorized Gate G=\bar V \kron V */
+    bool matfree;                   /* Apply V rho V^\dagger on the local state without assembling \bar V \kron V. Requires sequential Petsc vectors. */
+    std::vector<double> Vrot_re, Vrot_im;  /* Rotated gate in essential dimension, row-major dim_ess x dim_ess */
+    std::vector<int> ess2full;      /* Full-dimension index of each essential index */
+    std::vector<int> full2ess;      /* Essential index of each full-dimension index, or -1 if not essential */
+    std::vector<double> work;       /* auxiliary, holds V rho for the Lindblad solver */
+
+    Mat VxV_re, VxV_im;     /* Fallback for parallel Petsc: Real and imaginary part of vectorized Gate G=\bar V \kron V */
     Vec x;                  /* auxiliary */
     IS isu, isv;            /* Vector strides for accessing real and imaginary part of the state */
 
@@ -41,7 +47,7 @@ class Gate {
 
     int getDimRho() { return dim_rho; };
 
-    /* Assemble VxV_re = Re(\bar V \kron V) and VxV_im = Im(\bar V \kron V) */
+    /* Rotate V to the rotational frame. If not matfree, assemble VxV_re = Re(\bar V \kron V) and VxV_im = Im(\bar V \kron V) */
     void assembleGate();
 
     /* apply the gate transformation  VrhoV =  V \rho V^\dagger. The output vector VrhoV must be allocated! */
@@ -3,6 +3,7 @@
 #include "util.hpp"
 #include <petscts.h>
 #include <vector>
+#include <map>
 #include <assert.h>
 #include <iostream> 
 #include "gate.hpp"
@@ -31,8 +32,32 @@ typedef struct {
   std::vector<Mat> Bd_vec;
   Vec *aux;
   double time;
+  const double* dp_xptr;         // If not NULL, the matrix-free transpose kernels also accumulate the control gradient coefficients for this primal state
+  double *dp_coeff_p, *dp_coeff_q;
 } MatShellCtx;
 
+/* Local rows of a sparse control operator in CSR format. Column indices refer to the local part of the vector, followed by its ghost entries. 
+ * If Petsc runs sequentially, rowptr/col/val point into the storage of the Petsc matrix itself (which may be shared on the node), otherwise into the own copies below. 
+ * In the first case, the arrays are held via MatGetRowIJ and MatSeqAIJGetArrayRead on seqmat for the lifetime of the matrix, and released with the matching restore calls in ~MasterEq, before the matrix is destroyed. */
+typedef struct {
+  Mat seqmat;                 // Sequential matrix whose arrays are held, or NULL if rowptr/col/val point to the copies
+  PetscInt nrows;
+  const PetscInt* rowptr;
+  const PetscInt* col;
+  const PetscScalar* val;
+  std::vector<PetscInt> rowptr_copy;
+  std::vector<PetscInt> col_copy;
+  std::vector<PetscScalar> val_copy;
+} LocalCSR;
+
+/* Adjoint coefficients of the control functions p(t), q(t) of one oscillator at one time point, recorded during the adjoint sweep */
+typedef struct {
+  double time;
+  int iosc;
+  double coeff_p;
+  double coeff_q;
+} ControlGradientSample;
+
 
 /* Define the Matrix-Vector products for the RHS MatShell */
 int myMatMult_matfree_1Osc(Mat RHS, Vec x, Vec y);              // Matrix free solver for 2 oscillators 
@@ -66,9 +91,14 @@ class MasterEq{
 
     std::vector<std::vector<Mat>> Ac_vec;  // Vector of vector of constant mats for time-varying control term (real). One vector of mats for each oscillators. 
     std::vector<std::vector<Mat>> Bc_vec;  // Vector of vector of constant mats for time-varying control term (imag). One vector of mats for each oscillators. 
+    std::vector<std::vector<LocalCSR>> Ac_csr;  // Local CSR views (or copies) of Ac_vec and Bc_vec, for evaluating all bilinear forms of the control gradient in one sweep
+    std::vector<std::vector<LocalCSR>> Bc_csr;
+    VecScatter ghost_scatter;                   // Gathers the ghost entries of u, v that are needed by the control operators
+    Vec ughost, vghost;
     Mat  Ad, Bd;  // Real and imaginary part of constant system matrix
     std::vector<Mat> Ad_vec;  // Vector of constant mats for Dipole-Dipole coupling term in drift Hamiltonian (real)
     std::vector<Mat> Bd_vec;  // Vector of constant mats for Dipole-Dipole coupling term in drift Hamiltonian (imag)
+    std::vector<MPI_Win> shared_wins;  // Node-level shared memory windows that hold the above constant mats, see MatShareOnNode
 
     std::vector<double> crosskerr;    // Cross ker coefficients (rad/time) $\xi_{kl} for zz-coupling ak^d ak al^d al
     std::vector<double> Jkl;          // Dipole-Dipole coupling coefficient (rad/time), multiplies ak^d al + ak al^d
@@ -81,14 +111,40 @@ class MasterEq{
     int nparams_max;     // Maximum number of design parameters per oscilator 
     IS isu, isv;         // Vector strides for accessing u=Re(x), v=Im(x) 
 
-    double *dRedp;
-    double *dImdp;
+    std::vector<int> dpids;      // indices of the control parameters with support at the current time
+    std::vector<double> dRedp;   // derivative of the controls wrt those parameters
+    std::vector<double> dImdp;
+    bool dp_record;                                   // If true, control gradient contributions are recorded instead of added to the gradient 
+    std::vector<ControlGradientSample> dp_series;     // Recorded control gradient contributions
+
+    /* Table of control functions and transfer values at the stage times of the uniform time grid, see setControlGrid. Shared by all time steps, stages, initial conditions, the adjoint and the penalty terms. Filled on first use and reset whenever the controls change.
+     * The sample at time (n + c_i)*dt, for time step n = 0,...,ntime and stage fraction c_i, is stored at offset (n*nfrac + i)*control_sample_size, where nfrac is the number of distinct stage fractions of the time stepper (including c=0 for the grid points). 
+     * Memory: (ntime+1) * nfrac * control_sample_size doubles, with control_sample_size = sum over oscillators of (2 + number of control terms), plus two per time-dependent system term. E.g. two oscillators with the GL6 time stepper (nfrac=4) need 4*10 doubles per time step.
+     * Times off this grid (adaptive time stepping, coarse Parareal steps) are evaluated into one scratch sample at the end of the table and are not kept.
+     * Layout of one sample: for each oscillator [p, q, u_0(p),..., v_0(q),...], then the transfer values of the time-dependent system terms (re, then im). */
+    std::vector<double> control_table;
+    std::vector<char> control_filled;                   // flag per sample on the grid
+    int control_ntime;                                  // number of time steps of the grid, 0 if no grid is set
+    double control_dt;                                  // time step size of the grid
+    std::vector<double> control_stagefrac;              // stage fractions c_i in [0,1)
+    std::vector<int> control_sample_offset;             // offset of each oscillator inside a sample
+    int control_sample_size;
+    int getControlSlot(const double t);                 // returns the index of the sample at time t on the grid, or -1 if t is not on the grid
+    int getControlSample(const double t);               // returns the offset of the sample at time t
+    void setControlSample(const double t, const double* p, const double* q, double* sample); // evaluates the sample for given controls p, q of each oscillator
     Vec aux;              // auxiliary vector 
     PetscInt* cols;           // holding columns when evaluating dRHSdp
     PetscScalar* vals;   // holding values when evaluating dRHSdp
 
     bool quietmode;
 
+    /* Apply the dressed basis transformation (transpose=true: to dressed, false: from dressed) */
+    void applyDressedTransform(Vec x, bool transpose);
+    /* Gather the full state onto all processors for the dressed basis transformation. The scatter is created at the first call and reused. */
+    const PetscScalar* gatherDressed(Vec x);
+    VecScatter dressed_scatter;   // Scatter of a state to all processors, NULL until first used
+    Vec dressed_xall;             // Full copy of the state on each processor
+
   public:
     std::vector<int> nlevels;  // Number of levels per oscillator
     std::vector<int> nessential; // Number of essential levels per oscillator
@@ -100,15 +156,19 @@ class MasterEq{
     std::vector<TransferFunction*> transfer_Hdt_re; // Stores the transfer functions for each time-varying system hamiltonian term  
     std::vector<TransferFunction*> transfer_Hdt_im; // Stores the transfer functions for each time-varying system Hamiltonian term  
     std::string hamiltonian_file; // either 'none' or name of file to read Hamiltonian from 
+    bool dressedbasis;            // Flag to propagate in the eigenbasis of the system Hamiltonian read from file
+    std::vector<double> Vdressed; // Eigenvectors of the system Hamiltonian if dressedbasis (columnwise N x N)
 
 
   public:
     MasterEq();
-    MasterEq(std::vector<int> nlevels, std::vector<int> nessential, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_, std::string hamiltonian_file, bool quietmode=false);
+    MasterEq(std::vector<int> nlevels, std::vector<int> nessential, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_, std::string hamiltonian_file, bool dressedbasis_=false, bool quietmode=false);
     ~MasterEq();
 
     /* initialize matrices needed for applying sparse-mat solver */
     void initSparseMatSolver();
+    /* Set up the local CSR views of the control operators and the ghost scatter for computedRHSdp */
+    void setupControlCSR();
 
     /* Pass lists of time points that determin when which transfer functions is active. This is currently set for the rigetti threewave multi gate */
     void setTransferOnOffTimes(std::vector<double> tlist);
@@ -137,11 +197,44 @@ class MasterEq{
     /* Access the right-hand-side matrix */
     Mat getRHS();
 
+    /* Return true if the RHS is piecewise constant in time, i.e. spline0 controls with zero carrier frequencies and no dipole-dipole coupling that rotates in the rotating frame (Jkl with eta != 0). 
+     * Only then can the LU solver reuse its factorizations over many time steps. */
+    bool isPiecewiseConstant();
+
+    /* Get all time-dependent coefficients of the currently assembled RHS (controls, transfer functions, coupling rotations). 
+     * Two assembled RHS act identically if their coefficients coincide. */
+    void getRHSCoefficients(std::vector<double>& coeffs);
+
+    /*
+     * Get the diagonal of the constant drift part of the RHS, stored like a state vector:
+     * diag[2i] = Re, diag[2i+1] = Im of the complex rate of the i-th state element.
+     * Excludes the dipole-dipole coupling, the offdiagonal decay, and the controls.
+     */
+    void getDriftDiagonal(Vec diag);
+
+    /* Transform a state from the bare basis into the dressed basis (V^T x, or V^T x V if Lindblad), or back. In-place. */
+    void transformToDressed(Vec x);
+    void transformFromDressed(Vec x);
+
+    /* For a state x in the dressed basis, compute the entries i of the state vector (Schroedinger) or the diagonal entries (i,i) of the density matrix (Lindblad) in the bare basis, without transforming the full state. Real and imaginary parts, collective. */
+    void bareDiagonal(Vec x, const std::vector<int>& ids, std::vector<double>& re, std::vector<double>& im);
+    /* Derivative of bareDiagonal: xbar += d(re,im)/dx^T (re_bar, im_bar) */
+    void bareDiagonal_diff(Vec xbar, const std::vector<int>& ids, const std::vector<double>& re_bar, const std::vector<double>& im_bar);
+
     /* 
      * Compute gradient of RHS wrt control parameters:
      * grad += alpha * RHS(x)^T * x_bar  
      */
     void computedRHSdp(const double t,const Vec x,const Vec x_bar, const double alpha, Vec grad);
+    /* Same as computedRHSdp, and additionally y = RHS^T x_bar. The matrix-free solver does both in one sweep over the state. RHS must be assembled at time t. */
+    void computedRHSdp_MatMultTranspose(const double t, const Vec x, const Vec x_bar, const double alpha, Vec grad, Vec y);
+
+    /* Add coeff_p * dp/dparams + coeff_q * dq/dparams at time t for oscillator iosc to the gradient (not assembled), or record it if a gradient series is active */
+    void addControlGradient(const double t, int iosc, const double coeff_p, const double coeff_q, Vec grad);
+    /* Start recording control gradient contributions, e.g. for the adjoint sweep */
+    void startGradientSeries();
+    /* Project all recorded contributions onto the control parameters at once, add to grad and stop recording */
+    void finishGradientSeries(Vec grad);
 
     // /* Compute reduced density operator for a sub-system defined by IDs in the oscilIDs vector */
     // void createReducedDensity(const Vec rho, Vec *reduced, const std::vector<int>& oscilIDs);
@@ -151,11 +244,20 @@ class MasterEq{
     /* Set the oscillators control function parameters from global design vector x */
     void setControlAmplitudes(const Vec x);
 
-    // Get expected energy of the full composite system.
-    double expectedEnergy(const Vec x);
+    /* Return the control functions p(t), q(t) of oscillator iosc, using the control table */
+    void getControl(const double t, int iosc, double* p, double* q);
 
-    // Get population of the full composite system.
+    /* Set the time grid of the control table: ntime time steps of size dt, each with stage times tstart + c_i*dt for the given stage fractions c_i. Discards the table if the grid changes. */
+    void setControlGrid(const int ntime, const double dt, const std::vector<double>& stagefrac);
+
+    /* Fill the control table at nt time points times[k] that are spaced by dt, evaluating the carrier waves by recurrence along the series. Does nothing if the first time point is in the table already. */
+    void prefillControlTable(const int nt, const double* times, const double dt);
+
+    // Get population of the full composite system (diagonal of rho, or |psi_i|^2). One sweep over the local part of x, one reduction.
     void population(const Vec x, std::vector<double> &population_com);
+
+    /* Compute all observables from one call to population(): Population of the composite system, populations of the reduced system of each oscillator, expected energy level of each oscillator and of the composite system */
+    void observables(const Vec x, std::vector<double> &pop_comp, std::vector<std::vector<double>> &pop_osc, std::vector<double> &expected_osc, double* expected_comp);
 };
 
 // Mat-free solver inlines for 1 oscillator
@@ -15,6 +15,7 @@
 #define TaoSetObjectiveAndGradient(tao, NULL, TaoEvalObjectiveAndGradient,this) TaoSetObjectiveAndGradientRoutine(tao, TaoEvalObjectiveAndGradient,this)
 #define TaoSetSolution(tao, xinit) TaoSetInitialVector(tao, xinit)
 #define TaoGetSolution(tao, params) TaoGetSolutionVector(tao, params) 
+#define TaoSetHessian TaoSetHessianRoutine
 #endif
 
 class OptimProblem {
@@ -22,6 +23,7 @@ class OptimProblem {
   /* ODE stuff */
   int ninit;                            /* Number of initial conditions to be considered (N^2, N, or 1) */
   int ninit_local;                      /* Local number of initial conditions on this processor */
+  int ninit_offset;                     /* Global index of the first local initial condition */
   Vec rho_t0;                            /* Storage for initial condition of the ODE */
   Vec rho_t0_bar;                        /* Adjoint of ODE initial condition */
   std::vector<Vec> store_finalstates;    /* Storage for last time steps for each initial condition */
@@ -36,11 +38,24 @@ class OptimProblem {
   int mpirank_world, mpisize_world;
   int mpirank_init, mpisize_init;
 
+  /* Dynamic scheduling of initial conditions over the processor groups of comm_init */
+  bool dynamic_init;               /* Flag: Hand out initial conditions to the next free group, instead of fixed blocks */
+  MPI_Win init_win;                /* Window for the shared counter of handed out initial conditions */
+  int* init_counter;               /* Shared counter, located on the first group */
+  int init_epoch;                  /* Number of loops over initial conditions so far */
+  MPI_Comm comm_group;             /* All processors that work on the same initial condition (petsc and time-parallel) */
+  std::vector<int> init_assigned;  /* Global ids of the initial conditions that this group propagated in the current loop */
+  /* Start a new loop over initial conditions */
+  void startInitialConditions();
+  /* Return the global id of the iinit-th initial condition of this group in the current loop, or -1 if there is none left */
+  int nextInitialCondition(int iinit);
+
   bool quietmode;
 
   /* Optimization stuff */
   std::vector<double> obj_weights; /* List of weights for weighting the average objective over initial conditions  */
   int ndesign;                     /* Number of global design parameters */
+  int ncontrol;                    /* Number of control parameters. Equals ndesign, unless multiple shooting adds the window initial states. */
   double objective;                /* Holds current objective function value */
   double obj_cost;                 /* Final-time term J(T) in objective */
   double obj_regul;                /* Regularization term in objective */
@@ -48,6 +63,7 @@ class OptimProblem {
   double obj_penal_dpdm;           /* Penalty term in objective for second order state */
   double obj_penal_variation;      /* Penalty term for variation of control parameters */
   double obj_penal_energy;         /* Energy Penalty term in objective */
+  double obj_penal_shooting;       /* Continuity penalty between time windows (multiple shooting) */
   double fidelity;                 /* Final-time fidelity: 1/ninit \sum_iinit Tr(rhotarget^\dag rho(T)) for Lindblad, or |1/ninit \sum_iinit phitarget^dagger phi |^2 for Schroedinger */
   double gnorm;                    /* Holds current norm of gradient */
   double gamma_tik;                /* Parameter for Tikhonov regularization */
@@ -57,6 +73,9 @@ class OptimProblem {
   double gamma_penalty_energy;     /* Parameter multiplying energy penalty */
   double gamma_penalty_variation;  /* Parameter multiplying the un-divided difference squared regularization term */
   double penalty_param;            /* Parameter inside integral penalty term w(t) (Gaussian variance) */
+  bool multipleshooting;           /* Switch for multiple shooting over the time windows of comm_optim */
+  bool batched;                    /* Switch for batched propagation of the initial conditions (Schroedinger solver with LU) */
+  double gamma_shooting;           /* Parameter multiplying the continuity penalty of multiple shooting */
   double gatol;                    /* Stopping criterion based on absolute gradient norm */
   double fatol;                    /* Stopping criterion based on objective function value */
   double inftol;                   /* Stopping criterion based on infidelity */
@@ -65,8 +84,53 @@ class OptimProblem {
   Tao tao;                         /* Petsc's Optimization solver */
   std::vector<double> initguess_fromfile;      /* Stores the initial guess, if read from file */
   double* mygrad;  /* Auxiliary */
+
+  /* Newton-Krylov optimizers: The Hessian is approximated matrix-free by finite differences of adjoint gradients in the direction of the given vector. This is not an exact second-order adjoint, see evalHessVecFD. */
+  bool newton;                     /* Flag for Newton-Krylov optimizer (optim_type BNLS or BNTR) */
+  double hess_eps;                 /* Relative step size for the finite-difference Hessian-vector products */
+  bool hess_central;               /* Central instead of forward differences */
+  Mat Hess;                        /* MatShell applying the Hessian */
+  Vec hess_x, hess_g;              /* Linearization point of the Hessian and gradient there */
+  Vec hess_xpert, hess_gpert;      /* Auxiliary: perturbed design, and gradient there if central differences */
+  bool hess_set;                   /* Flag whether hess_x, hess_g hold a valid point */
+  bool gaussnewton;                /* Use the Gauss-Newton Hessian of the least-squares objective Jfrobenius instead of the full Hessian */
+  double lm_damping;               /* Levenberg-Marquardt damping added to the Gauss-Newton Hessian */
+  std::vector<Vec> gn_dstates;     /* Final-state sensitivities for the Gauss-Newton Hessian, per local initial condition */
+  Vec gn_finalstate;               /* Final state at the linearization point, allocated with gn_dstates */
+
+  /* Gauss-Newton Hessian-vector product Hv = sum_i w_i J_i^T J_i v + regularization, with the Jacobians J_i of the final states. J_i v is a finite-difference approximation from forward solves with step size h (forward or central, see hess_central), whose accuracy depends on h like evalHessVecFD. J_i^T is applied exactly by the adjoint. 
+   * The Levenberg-Marquardt damping lm_damping is a constant. It is not adapted during the optimization, that role is left to the trust region of BNTR. */
+  void evalGaussNewtonVec(const Vec v, Vec Hv, double h);
     
   Vec xtmp;                        /* Temporary storage */
+
+  /* Cache of the last evaluation, keyed by the design vector. Tao often requests the objective or gradient at the same design more than once. */
+  bool use_cache;                  /* Flag to switch the cache off, e.g. for perturbed evaluations */
+  bool cache_F, cache_G_valid;     /* Flags whether the cache holds the objective terms, and the gradient */
+  Vec cache_x, cache_G;            /* Design vector and gradient of the cached evaluation */
+  std::vector<double> cache_terms; /* Objective terms of the cached evaluation */
+  /* If x is the cached design (and the gradient is cached, if G is not NULL), restore the objective terms and the gradient into G, and return true */
+  bool lookupCache(const Vec x, Vec G);
+  /* Store the current objective terms, and the gradient if G is not NULL, for design x */
+  void storeCache(const Vec x, const Vec G);
+  /* Get or set all objective terms and the gradient norm */
+  void getObjectiveTerms(std::vector<double>& terms);
+  void setObjectiveTerms(const std::vector<double>& terms);
+
+  /* Tikhonov regularization gamma/2 ||x - x0||^2 over the control parameters */
+  double evalTikhonov(const Vec x);
+
+  /* Multiple shooting: The initial state of window w>0 for initial condition iinit is stored in the design vector after the control parameters */
+  int getShootingIndex(int iinit_global, int window);
+  void getShootingState(const Vec x, int iinit_global, int window, Vec state);
+  void addShootingGrad(Vec G, int iinit_global, int window, const Vec state, double alpha);
+  /* Multiple shooting: Evaluate objective, and gradient if G is not NULL */
+  double evalShooting(const Vec x, Vec G);
+  /* Batched propagation: Evaluate objective, and gradient if G is not NULL, propagating all local initial conditions together */
+  double evalBatched(const Vec x, Vec G);
+  void adjointShooting(const Vec x, Vec G, int iinit, int initid, double obj_cost_re, double obj_cost_im);
+  /* Multiple shooting: Set the window initial states from a forward sweep with the current controls */
+  void initShootingStates(Vec x);
   
   public: 
     Output* output;                 /* Store a reference to the output */
@@ -90,6 +154,7 @@ class OptimProblem {
   double getPenaltyDpDm()  { return obj_penal_dpdm; };
   double getPenaltyVariation()  { return obj_penal_variation; };
   double getPenaltyEnergy()  { return obj_penal_energy; };
+  double getPenaltyShooting()  { return obj_penal_shooting; };
   double getFidelity() { return fidelity; };
   double getFaTol()    { return fatol; };
   double getGaTol()    { return gatol; };
@@ -103,6 +168,13 @@ class OptimProblem {
   /* Evaluate gradient \nabla F(x) */
   void evalGradF(const Vec x, Vec G);
 
+  /* Set the linearization point for Hessian-vector products. If G is NULL, the gradient at x is evaluated unless x is the current point. */
+  void setHessianPoint(const Vec x, const Vec G);
+
+  /* Finite-difference approximation of the Hessian-vector product Hv = \nabla^2 F(x) v at the linearization point, using one (forward) or two (central) additional gradient evaluations with step size h = hess_eps * max(1,|x|)/|v|.
+   * The truncation error is O(h) for forward and O(h^2) for central differences, while errors in the gradient (e.g. from the linear solver tolerance) are amplified by 1/h. Too small hess_eps thus gives noisy products, too large ones a biased Hessian. */
+  void evalHessVecFD(const Vec v, Vec Hv);
+
   /* Run optimization solver, starting from initial guess xinit */
   void solve(Vec xinit);
 
@@ -122,5 +194,11 @@ PetscErrorCode TaoEvalObjective(Tao tao, Vec x, PetscReal *f, void*ptr);
 /* Petsc's Tao interface routine for evaluating the gradient g = \nabla f(x) */
 PetscErrorCode TaoEvalGradient(Tao tao, Vec x, Vec G, void*ptr);
 
+/* Petsc's Tao interface routine for setting up the Hessian at x. The Hessian itself is a MatShell. */
+PetscErrorCode TaoEvalHessian(Tao tao, Vec x, Mat H, Mat Hpre, void*ptr);
+
+/* MatShell multiplication with the Hessian */
+PetscErrorCode HessianMult(Mat H, Vec v, Vec Hv);
+
 /* Petsc's Tao interface routine for evaluating the gradient g = \nabla f(x) */
 PetscErrorCode TaoEvalObjectiveAndGradient(Tao tao, Vec x, PetscReal *f, Vec G, void*ptr);
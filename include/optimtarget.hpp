@@ -1,6 +1,7 @@
 #include "defs.hpp"
 #include "gate.hpp"
 #include "mastereq.hpp"
+#include <map>
 #pragma once
 
 /* Collects stuff specifying the optimization target */
@@ -24,6 +25,13 @@ class OptimTarget{
     std::vector<int> initcond_IDs;         /* Integer list for pure-state initialization */
     LindbladType lindbladtype;             /* Type of decoherence (lindblad vs schroedinger) */
 
+    /* Cache of the target states and purities per initial condition. Target states only store the local nonzeros. 
+     * The cache is never cleared: With Lindblad's solver and basis initial conditions, there are N_ess^2 target states with up to N_ess^2 nonzeros each, so memory grows as N_ess^4 (distributed over the processors).
+     * Initial states are not cached: prepareInitialState only sets their few nonzeros directly in the local array, which costs no more than restoring them from a cache. */
+    std::map<int, std::vector<PetscInt>> target_cache_idx;
+    std::map<int, std::vector<double>> target_cache_val;
+    std::map<int, double> purity_cache;
+
     Vec aux;      /* auxiliary vector needed when computing the objective for gate optimization */
     bool quietmode;
 
@@ -37,15 +45,16 @@ class OptimTarget{
     ObjectiveType getObjectiveType(){ return objective_type; };
 
     /* Prepare the initial condition state
-     * In:   iinit -- index in processors range [rank * ninit_local .. (rank+1) * ninit_local - 1]
+     * In:   iinit -- global index of the initial condition in [0 .. ninit - 1]
      *       ninit -- number of initial conditions 
      * Out: initID -- Idenifyier for this initial condition: Element number in matrix vectorization. 
      *       rho0 -- Vector for setting initial condition 
      */
     int prepareInitialState(const int iinit, const int ninit, std::vector<int> nlevels, std::vector<int> nessential,  Vec rho0);
 
-    /* If gate optimization, this routine prepares the rotated target state VrhoV for a given initial state rho. Further, it stores the purity of rho(0) because it will be used to scale the Hilbertschmidt overlap for the JTrace objective function. */
-    void prepareTargetState(const Vec rho);
+    /* If gate optimization, this routine prepares the rotated target state VrhoV for a given initial state rho. Further, it stores the purity of rho(0) because it will be used to scale the Hilbertschmidt overlap for the JTrace objective function. 
+     * If iinit >= 0, the result is cached for the initial condition iinit, since it does not depend on the design. */
+    void prepareTargetState(const Vec rho, const int iinit = -1);
 
     /* Evaluate the objective J. Note that J depends on the target state, which should be stored and ready before calling evalJ. The target state can be set with the 'prepare' routine. */
     /* Output is J_re and J_im. Generally imaginary part will be zero, except for the case of Schroedinger solver with Jtrace. */
@@ -36,6 +36,7 @@ class Oscillator {
     double Tfinal;                 // final time
     std::vector<ControlBasis *> basisfunctions;  // Vector of control parameterization basis functions. One basis for each time segment (default one segment [0,T])
     std::vector<double> carrier_freq; // Frequencies of the carrier waves
+    std::vector<int> ids_aux;         // Auxiliary parameter indices for evaluating the control derivatives
 
     int mpirank_petsc;             // rank of Petsc's communicator
     int mpirank_world;             // rank of MPI_COMM_WORLD
@@ -60,6 +61,7 @@ class Oscillator {
     double getDephaseTime() {return dephase_time; };
     int getNSegments() {return basisfunctions.size(); };
     int getNCarrierfrequencies() {return carrier_freq.size(); };
+    double getCarrierFrequency(int i) {return carrier_freq[i]; };
     ControlType getControlType(int isegment=0) {return basisfunctions[isegment]->getType(); };
     int getNSplines(int isegment=0) {return basisfunctions[isegment]->getNSplines();};
     double getRotFreq() {return (ground_freq - detuning_freq) / (2.0*M_PI); };
@@ -78,8 +80,11 @@ class Oscillator {
 
     /* Evaluates rotating frame control functions Re = p(t), Im = q(t) */
     int evalControl(const double t, double* Re_ptr, double* Im_ptr);
-    /* Compute derivatives of the p(t) and q(t) control function wrt the parameters */
-    int evalControl_diff(const double t, double* dRedp, double* dImdp);
+    /* Compute derivatives of the p(t) and q(t) control function wrt the parameters. Only the parameters with support at t are returned: their indices in 'ids', derivative values in dRedp and dImdp. */
+    int evalControl_diff(const double t, std::vector<int>& ids, std::vector<double>& dRedp, std::vector<double>& dImdp);
+
+    /* Evaluates p(t), q(t) and, if Lab_ptr is not NULL, the lab-frame control f(t) at nt time points times[k] that are spaced by dt. The carrier waves are advanced from one time point to the next by a complex rotation instead of evaluating cos and sin at each time. */
+    int evalControlGrid(const int nt, const double* times, const double dt, double* Re_ptr, double* Im_ptr, double* Lab_ptr=NULL);
 
     /* Evaluates Lab-frame control function f(t) */
     int evalControl_Labframe(const double t, double* f_ptr);
@@ -89,9 +94,6 @@ class Oscillator {
     /* Derivative of expected alrue computation */
     void expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_bar);
 
-    /* Compute population (=diagonal elements) for this oscillators reduced system */
-    void population(const Vec x, std::vector<double> &pop);
-
     /* Evaluate un-divided differences in control vector */
     double evalControlVariation();
     /* Derivative of un-divided differences in control vector */
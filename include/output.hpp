@@ -12,6 +12,7 @@ class Output{
   int mpirank_petsc;  /* Rank of processor for parallelizing Petsc */
   int mpisize_petsc;  /* Size of communicator for parallelizing Petsc */
   int mpirank_init;   /* Rank of processor for parallelizing initial conditions */
+  int mpirank_optim;  /* Rank of processor for parallelizing in time. Only the first one writes data files. */
 
   bool quietmode; /* Reduced screen output */
   
@@ -26,6 +27,7 @@ class Output{
   FILE *expectedfile_comp;    /* File for writing the evolution of the expected energy level of the composite system */
   FILE *populationfile_comp;    /* File for writing the evolution of the population of the composite system */
   std::vector<FILE *>populationfile;  /* Files for writing population over time */
+  bool write_observables;  /* Flag whether any expected energy level or population is written. They are all computed together. */
 
   // VecScatter scat;    /* Petsc's scatter context to communicate a state across petsc's cores */
   // Vec xseq;           /* A sequential vector for IO. */
@@ -36,7 +38,7 @@ class Output{
 
   public:
     Output();
-    Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int noscillators, bool quietmode=false);
+    Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, MPI_Comm comm_optim, int noscillators, bool quietmode=false);
     ~Output();
 
     /* Write to optimization history file in every optim iteration */
@@ -51,6 +53,8 @@ class Output{
     /* Open, write and close files for fullstate and expected energy levels over time */
     void openDataFiles(std::string prefix, int initid);
     void writeDataFiles(int timestep, double time, const Vec state, MasterEq* mastereq);
+    /* Return true if data files are written at this time step (every <output_frequency> steps) */
+    bool isOutputStep(int timestep);
     void closeDataFiles();
 
 };
@@ -17,14 +17,25 @@ class PythonInterface{
     std::string hamiltonian_file; // either 'none' or name of file to read Hamiltonian from 
     int mpirank_world;   // Rank of global communicator
     bool quietmode;
+    bool dressed;                         // Flag to transform all operators to the eigenbasis of Hsys
+    std::vector<double> Vdressed;         // Eigenvectors of Hsys, ordered by bare state (columnwise, N x N)
+    std::vector<double> Edressed;         // Eigenvalues of Hsys, same order
+
+    /* Compute and order the eigenbasis of the real symmetric Hsys (columnwise vectorized) */
+    void diagonalizeHsys(const std::vector<double>& Hsys);
+    /* Transform a real operator (columnwise vectorized) into the dressed basis: H <- V^T H V */
+    void transformToDressed(std::vector<double>& H);
 
 	public:
     PythonInterface();
-    PythonInterface(std::string hamiltonian_file_, LindbladType lindbladtype_, int dim_rho_, bool quietmode_);
+    PythonInterface(std::string hamiltonian_file_, LindbladType lindbladtype_, int dim_rho_, bool quietmode_, bool dressed_=false);
     ~PythonInterface();
 
+  /* Return the eigenvectors of Hsys that define the dressed basis. Empty if not in dressed mode. */
+  const std::vector<double>& getDressedBasis() { return Vdressed; };
+
   /* Read the constant system Hamiltonian from file */
-  // Hd must be REAL valued!
+  // Hd must be REAL valued! If dressed, Bd is set up with the eigenvalues of Hd only.
   void receiveHsys(Mat& Bd);
 
   /* Receive real and imaginary control operators from file */
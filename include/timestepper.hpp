@@ -8,8 +8,37 @@
 #include "output.hpp"
 #include "optimtarget.hpp"
 #include <deque>
+#include <map>
 #pragma once
 
+/* Matshell context for the coupled stage system of the Gauss-Legendre IRK scheme */
+typedef struct {
+  MasterEq* mastereq;
+  int nstages;
+  int nlocal;                   // Local size of one stage vector
+  std::vector<double> a;        // RK matrix, stored row-wise (nstages x nstages)
+  std::vector<double> c;        // RK nodes
+  double tstart;                // Start of the current time step
+  double dt;                    // Current time step size
+  std::vector<Vec> k_in;        // Views onto the stages of the input block vector
+  std::vector<Vec> k_out;       // Views onto the stages of the output block vector
+  std::vector<Vec> aux;         // Auxiliary state vectors, one per stage
+} GLStageCtx;
+
+/* Define the Matrix-Vector products for the stage system MatShell: y_i = k_i - dt*A(t_i) sum_j a_ij k_j */
+int myMatMult_GLstages(Mat M, Vec k, Vec y);
+int myMatMultTranspose_GLstages(Mat M, Vec k, Vec y);
+
+/* Matshell context for the remainder of the drift splitting R = A - D, where D is the diagonal drift */
+typedef struct {
+  MasterEq* mastereq;
+  Vec* drift;                   // Diagonal drift, stored as complex rates (see MasterEq::getDriftDiagonal)
+} SplitCtx;
+
+/* Define the Matrix-Vector products for the remainder MatShell: y = A x - D x */
+int myMatMult_splitremainder(Mat R, Vec x, Vec y);
+int myMatMultTranspose_splitremainder(Mat R, Vec x, Vec y);
+
 
 /* Base class for time steppers */
 class TimeStepper{
@@ -22,12 +51,52 @@ class TimeStepper{
     bool addLeakagePrevent;   /* flag to determine if Leakage preventing term is added to penalty.  */
     int mpirank_world;
 
+    /* Time grid of the current forward solve: tgrid[n] = n*dt, or the recorded schedule if adaptive */
+    std::vector<double> tgrid;
+    std::map<int, std::vector<double>> tgrid_store;  /* Recorded adaptive schedules per initial condition id, reused for the adjoint */
+    double adapt_tol;              /* Tolerance for the local error estimate in adaptive time stepping */
+    double adapt_dtmin;            /* Minimum step size for adaptive time stepping */
+    double adapt_dtmax;            /* Maximum step size for adaptive time stepping */
+    Vec x_coarse, x_fine1, x_fine2;  /* Auxiliary states for the step-doubling error estimate */
+    Vec x_bare, x_bare_bar;          /* Auxiliary states in the bare basis, if propagating in the dressed basis */
+
+    /* Store and write the state at time index n. Output is written in the bare basis. */
+    void recordState(int n, double time, const Vec x, bool store=true);
+    /* Add the penalty terms at the end of time step n of size dt_n */
+    void addPenaltyTerms(int n, double tstop, double dt_n, const Vec x);
+
+    /* Parareal: Time-parallel forward and adjoint solves. Each processor of the time communicator owns the time steps [pr_nfirst, pr_nlast). */
+    bool parareal;                  // Flag to use Parareal, set if the time communicator has more than one processor 
+    MPI_Comm comm_time;             // Time communicator
+    int mpirank_time, mpisize_time;
+    int parareal_maxiter;           // Maximum number of Parareal iterations, at most (and by default) mpisize_time-1
+    double parareal_tol;            // Stopping tolerance on the change of the interval start values
+    int parareal_cfactor;           // Coarsening factor of the time steps for the coarse propagator
+    int pr_nfirst, pr_nlast;        // Time steps owned by this processor
+    Vec pr_U, pr_F, pr_G;           // Interval start value, and fine and coarse propagation of it
+    std::map<int, Vec> pr_chunkend; // Primal state at the end of the own time interval, per initial condition id
+    bool parareal_warned;           // Flag to warn only once if Parareal does not converge
+    bool usePararealNow();          // Check whether the current solve can run time-parallel
+    bool checkPararealConvergence(int iter, double change); // Check whether the Parareal iterations have converged. Warns if not.
+    bool solveODE_parareal(int initid);   // Returns false if not converged, nothing is computed then.
+    bool solveAdjointODE_parareal(int initid, double Jbar_penalty, double Jbar_energy_penalty);  // Returns false if not converged, nothing is computed then.
+    void fineFWD_parareal(int initid);
+    void fineBWD_parareal(int initid, Vec x_adj, double Jbar_penalty, double Jbar_energy_penalty, bool compute_gradient);
+    void coarseFWD_parareal(Vec x);
+    void coarseBWD_parareal(Vec x_adj);
+    void bcastState(Vec x, int root);
+
+    /* Index the control table by time step and stage, and fill it along the uniform time grid before a forward solve, one series per stage */
+    void prefillControls();
+
   public:
     MasterEq* mastereq;  // Lindblad master equation
     int ntime;           // number of time steps
     double total_time;   // final time
     double dt;           // time step size
     bool writeDataFiles;  /* Flag to determine whether or not trajectory data will be written to files during forward simulation */
+    bool adaptive;        /* Flag to switch on adaptive time stepping (step doubling) */
+    bool multipleshooting; /* Flag for multiple shooting: Each time processor only solves its own time window, no Parareal */
 
     Vec redgrad;                   /* Reduced gradient */
 
@@ -56,15 +125,33 @@ class TimeStepper{
     /* Return the state at a certain time index */
     Vec getState(int tindex);
 
+    /* Distribute the time domain over the processors in comm_time_ (Parareal). */
+    void setTimeParallel(MPI_Comm comm_time_);
+
+    /* Send / receive the local part of a state between processors of the time communicator */
+    void sendState(Vec x, int dest);
+    void recvState(Vec x, int src);
+
+    /* Multiple shooting: Solve forward over the own time window starting from x0, return the state at the window end. */
+    Vec solveODEWindow(int initid, Vec x0);
+    /* Multiple shooting: Solve the adjoint over the own time window from terminal condition xbar_end, return the adjoint at the window start. Gradient in redgrad. */
+    Vec solveAdjointODEWindow(int initid, Vec xbar_end, double Jbar_penalty, double Jbar_penalty_energy);
+
+    /* Return the number of time steps taken in the last forward solve */
+    int getNSteps() { return tgrid.size() - 1; };
+
+    /* Return the order of the time-stepping scheme */
+    virtual int getOrder() = 0;
+
     /* Solve the ODE forward in time with initial condition rho_t0. Return state at final time step */
     Vec solveODE(int initid, Vec rho_t0);
 
     /* Solve the adjoint ODE backwards in time from terminal condition rho_t0_bar */
     void solveAdjointODE(int initid, Vec rho_t0_bar, Vec finalstate, double Jbar_penalty, double Jbar_penalty_dpdm, double Jbar_penalty_energy);
 
-    /* evaluate the penalty integral term */
-    double penaltyIntegral(double time, const Vec x);
-    void penaltyIntegral_diff(double time, const Vec x, Vec xbar, double Jbar);
+    /* evaluate the penalty integral term, dt_n is the size of the time step ending at 'time' */
+    double penaltyIntegral(double time, double dt_n, const Vec x);
+    void penaltyIntegral_diff(double time, double dt_n, const Vec x, Vec xbar, double Jbar);
 
 
     /* evaluate the second derivative penalty for the state */
@@ -72,11 +159,13 @@ class TimeStepper{
     void penaltyDpDm_diff(int n, Vec xbar, double Jbar);
     
     /* evaluate the energy penalty integral term */
-    double energyPenaltyIntegral(double time);
-    void energyPenaltyIntegral_diff(double time, double Jbar, Vec redgrad);
+    double energyPenaltyIntegral(double time, double dt_n);
+    void energyPenaltyIntegral_diff(double time, double dt_n, double Jbar, Vec redgrad);
 
     /* Evolve state forward from tstart to tstop */
     virtual void evolveFWD(const double tstart, const double tstop, Vec x) = 0;
+    /* Return the times at which evolveFWD evaluates the controls for the step tstart -> tstop, computed in the same way as in evolveFWD. Empty by default. */
+    virtual void getStageTimes(const double tstart, const double tstop, std::vector<double>& times) { times.clear(); };
     /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
     virtual void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
 };
@@ -87,6 +176,10 @@ class ExplEuler : public TimeStepper {
     ExplEuler(MapParam config, MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_);
     ~ExplEuler();
 
+    int getOrder() { return 1; };
+
+    void getStageTimes(const double tstart, const double tstop, std::vector<double>& times);
+
     /* Evolve state forward from tstart to tstop */
     void evolveFWD(const double tstart, const double tstop, Vec x);
     /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
@@ -115,16 +208,45 @@ class ImplMidpoint : public TimeStepper {
   int linsolve_counter;            // Counting how often a linear solve is performed is called
   Vec tmp, err;                    /* Auxiliary vector for applying the neuman iterations */
 
+  /* LU solver: Cache of factorizations of (I - dt/2 A), reused as long as A and dt do not change */
+  int lu_cachesize;                          // Maximum number of cached factorizations
+  int lu_next;                               // Position of the next cache entry to be replaced
+  int lu_nfactor;                            // Counting the number of factorizations
+  std::vector<std::vector<double>> lu_keys;  // RHS coefficients and step size of each cached factorization
+  std::vector<Mat> lu_mats;                  // Dense assembled (I - dt/2 A)
+  std::vector<KSP> lu_ksps;                  // Direct solvers holding the factorizations
+  std::vector<double> lu_key;                // Auxiliary key of the current step
+
+  /* Return a direct solver for (I - dt/2 A) at the currently assembled RHS. Factorizes only if not cached. */
+  KSP getLUSolver(double dt);
+  /* Midpoint step on all columns of X, using Y as workspace */
+  void evolveFWDBlock(const double tstart, const double tstop, Mat X, Mat Y);
+
+  protected:
+    Mat IMRop;                       /* Operator of the midpoint step. Default: RHS of the master equation */
+
+    /* Replace the operator of the midpoint step, e.g. by a splitting remainder */
+    void setIMROperator(Mat A);
+
   public:
     ImplMidpoint(MapParam config, MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_);
     ~ImplMidpoint();
 
+    virtual int getOrder() { return 2; };
+
+    virtual void getStageTimes(const double tstart, const double tstop, std::vector<double>& times);
 
     /* Evolve state forward from tstart to tstop */
     virtual void evolveFWD(const double tstart, const double tstop, Vec x);
     /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
     virtual void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
 
+    /* Batched propagation for the Schroedinger solver with LU: The states of several initial conditions are the columns of a dense matrix X, and each time step applies one factorization to all of them. */
+    /* Forward solve of all columns of X over the whole time domain. Computes the energy penalty integral. */
+    void solveODEBlock(Mat X);
+    /* Backward solve of the adjoint block Xbar, starting from the final states X, which are recomputed backwards. Sets the reduced gradient summed over all columns. */
+    void solveAdjointODEBlock(Mat X, Mat Xbar, double Jbar_energy_penalty);
+
     /* Solve (I-alpha*A) * x = b using Neumann iterations */
     // bool transpose=true solves the transposed system (I-alpha A^T)x = b
     // Return residual norm ||y-yprev||
@@ -143,6 +265,76 @@ class CompositionalImplMidpoint : public ImplMidpoint {
     CompositionalImplMidpoint(MapParam config, int order_, MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_);
     ~CompositionalImplMidpoint();
 
+    int getOrder() { return order; };
+
+    void getStageTimes(const double tstart, const double tstop, std::vector<double>& times);
+
     void evolveFWD(const double tstart, const double tstop, Vec x);
     void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
 };
+
+
+/* Strang splitting of the drift diagonal D from the remaining RHS R = A - D, second order:
+ *   x <- exp(dt/2 D) x,  one implicit midpoint step with R,  x <- exp(dt/2 D) x
+ * The diagonal drift (detuning, self- and cross-kerr, diagonal of decay and dephasing) is applied exactly 
+ * by a pointwise phase rotation and damping, so that the linear solver only sees the controls and couplings. 
+ */
+class StrangSplitting : public ImplMidpoint {
+
+  Vec drift;          /* Diagonal drift rates */
+  SplitCtx splitctx;  /* Context for the remainder MatShell */
+  Mat R;              /* Remainder MatShell R = A - D */
+  Vec x_mid;          /* Primal state at the start of the midpoint substep */
+
+  /* Apply exp(dt D) x, or exp(dt D)^T x */
+  void applyDrift(Vec x, double dt, bool transpose);
+
+  public:
+    StrangSplitting(MapParam config, MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_);
+    ~StrangSplitting();
+
+    void evolveFWD(const double tstart, const double tstop, Vec x);
+    void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+};
+
+
+/* Implements the s-stage Gauss-Legendre implicit Runge-Kutta scheme of order 2s. Simplectic. 
+ * s=2 (order 4) and s=3 (order 6) are available. All stages are solved for at once from the coupled system
+ *   (I - dt (a \otimes A)) K = [A(t_1) x, ..., A(t_s) x],   t_i = t_n + c_i dt
+ * followed by the update x += dt sum_i b_i k_i. 
+ */
+class GaussLegendre : public TimeStepper {
+
+  int order;
+  int nstages;
+  std::vector<double> b;           /* RK weights */
+  GLStageCtx stagectx;             /* Context for the stage system MatShell */
+  Mat M;                           /* MatShell for the coupled stage system */
+  Vec K, K_adj, rhs_block;         /* Block vectors holding all stages */
+  KSP ksp;                         /* Petsc's linear solver context for running GMRES */
+  PC  preconditioner;              /* Preconditioner for linear solver */
+  LinearSolverType linsolve_type;  // Either GMRES or NEUMANN
+  int linsolve_maxiter;            // Maximum number of linear solver iterations
+  double linsolve_abstol;          // Absolute stopping criteria for linear solver
+  double linsolve_reltol;          // Relative stopping criteria for linear solver
+  Vec tmp, err;                    /* Auxiliary block vectors for applying the neuman iterations */
+  Vec aux;                         /* Auxiliary state vector */
+
+  /* Assemble the right hand side of the stage system [A(t_1) x, ..., A(t_s) x] */
+  void setStageRHS(const Vec x);
+  /* Solve the stage system (or its transpose) for K */
+  void solveStages(Vec rhs, Vec y, bool transpose);
+
+  public:
+    GaussLegendre(MapParam config, int order_, MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_);
+    ~GaussLegendre();
+
+    int getOrder() { return order; };
+
+    void getStageTimes(const double tstart, const double tstop, std::vector<double>& times);
+
+    /* Evolve state forward from tstart to tstop */
+    void evolveFWD(const double tstart, const double tstop, Vec x);
+    /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
+    void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+};
@@ -59,6 +59,12 @@ PetscErrorCode kronI(const Mat A, const int dimI, const double alpha, Mat *Out,
 /* The output matrix has to be allocated before with matching sizes and should to be assembles afterwards, if neccessary. */
 PetscErrorCode AkronB(const Mat A, const Mat B, const double alpha, Mat *Out, InsertMode insert_mode);
 
+/* Move the storage of an assembled, constant sparse matrix into node-level shared memory.
+ * If Petsc runs sequentially, all processors hold identical copies of such matrices. The first processor on each node then copies its matrix into an MPI-3 shared memory window, and each processor replaces its own matrix by one that is built on the shared arrays. The matrix must not be changed afterwards.
+ * Collective over MPI_COMM_WORLD. Returns the window, which must be freed after the matrix is destroyed, or MPI_WIN_NULL if the matrix is not shared.
+ */
+MPI_Win MatShareOnNode(Mat* A);
+
 /* Tests if a matrix A is anti-symmetric (A^T=-A) */
 PetscErrorCode MatIsAntiSymmetric(Mat A, PetscReal tol, PetscBool *flag);
 
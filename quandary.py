@@ -30,6 +30,7 @@ class Quandary:
     Hc_re               # Optional: User specified control Hamiltonian operators for each qubit (real-parts). List of Arrays
     Hc_im               # Optional: User specified control Hamiltonian operators for each qubit (real-parts) List of Arrays
     standardmodel       # Internal: Bool to use standard Hamiltonian model for superconduction qubits. Default: True
+    interaction_picture # Optional: Propagate user-defined Hamiltonians in the eigenbasis of Hsys (use with timestepper "IMRSPLIT"). Default: False
 
     # Time duration and discretization options
     T            # Pulse duration (simulation time). Default: 100ns
@@ -109,6 +110,7 @@ class Quandary:
     Hc_re               : List[List[float]] = field(default_factory=list)
     Hc_im               : List[List[float]] = field(default_factory=list)
     standardmodel       : bool              = True
+    interaction_picture : bool              = False
     # Time duration and discretization options
     T            : float = 100.0
     Pmin         : int   = 150
@@ -680,6 +682,8 @@ class Quandary:
         mystring += "linearsolver_maxiter = 20\n"
         if not self.standardmodel:
             mystring += "hamiltonian_file= "+str(self._hamiltonian_filename)+"\n"
+            if self.interaction_picture:
+                mystring += "hamiltonian_interactionpicture = true\n"
         mystring += "timestepper = "+str(self.timestepper)+ "\n"
         if self.rand_seed is not None and self.rand_seed >= 0:
             mystring += "rand_seed = "+str(int(self.rand_seed))+ "\n"
@@ -49,8 +49,10 @@ void BSpline2nd::evaluate(const double t, const std::vector<double>& coeff, int
 
     double sum1 = 0.0;
     double sum2 = 0.0;
-    /* Sum over basis function */
-    for (int l=0; l<nsplines; l++) {
+    /* Sum over basis functions with support at t */
+    int lfirst, llast;
+    activeSplines(t, &lfirst, &llast);
+    for (int l=lfirst; l<=llast; l++) {
         if (enforceZeroBoundary) {
             if (l<=1 || l >= nsplines- 2) continue; // skip first and last two splines (set to zero) so that spline starts and ends at zero 
         }
@@ -65,19 +67,30 @@ void BSpline2nd::evaluate(const double t, const std::vector<double>& coeff, int
 
 }
 
-void BSpline2nd::derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
+void BSpline2nd::derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
 
-    /* Iterate over basis function */
-    for (int l=0; l<nsplines; l++) {
+    /* Iterate over basis functions with support at t */
+    int lfirst, llast;
+    activeSplines(t, &lfirst, &llast);
+    for (int l=lfirst; l<=llast; l++) {
         if (enforceZeroBoundary){
             if (l<=1 || l >= nsplines- 2) continue; // skip first and last two splines (set to zero) so that spline starts and ends at zero       
         }
         double Blt = basisfunction(l, t); 
-        coeff_diff[skip + carrier_freq_id*nsplines*2 + l]            += Blt * valbar1;
-        coeff_diff[skip + carrier_freq_id*nsplines*2 + l + nsplines] += Blt * valbar2;
+        ids.push_back(skip + carrier_freq_id*nsplines*2 + l);
+        coeff_diff.push_back(Blt * valbar1);
+        ids.push_back(skip + carrier_freq_id*nsplines*2 + l + nsplines);
+        coeff_diff.push_back(Blt * valbar2);
     }
 }
 
+void BSpline2nd::activeSplines(double t, int* lfirst, int* llast){
+    /* Spline l has support [t0 + (l-2)*dtknot, t0 + (l+1)*dtknot). Take one more to the left for round-off. */
+    int l0 = (int) floor((t - tstart) / dtknot);
+    *lfirst = std::max(0, l0 - 1);
+    *llast  = std::min(nsplines - 1, l0 + 2);
+}
+
 double BSpline2nd::basisfunction(int id, double t){
 
     /* compute scaled time tau = (t-tcenter[k])  */
@@ -88,9 +101,9 @@ double BSpline2nd::basisfunction(int id, double t){
 
     /* Evaluate basis function */
     double val = 0.0;
-    if       (-1./2. <= tau && tau < -1./6.) val = 9./8. + 9./2. * tau + 9./2. * pow(tau,2);
-    else if  (-1./6. <= tau && tau <  1./6.) val = 3./4. - 9. * pow(tau,2);
-    else if  ( 1./6. <= tau && tau <  1./2.) val = 9./8. - 9./2. * tau + 9./2. * pow(tau,2);
+    if       (tau < -1./6.) val = 9./8. + 9./2. * tau + 9./2. * tau*tau;
+    else if  (tau <  1./6.) val = 3./4. - 9. * tau*tau;
+    else                    val = 9./8. - 9./2. * tau + 9./2. * tau*tau;
 
     return val;
 }
@@ -127,9 +140,11 @@ void BSpline2ndAmplitude::enforceBoundary(double* x, int carrier_id){
 
 void BSpline2ndAmplitude::evaluate(const double t, const std::vector<double>& coeff, int carrier_freq_id, double* Bl1_ptr, double* Bl2_ptr){
 
-    /* Sum over basis function for amplitudes */
+    /* Sum over basis functions for amplitudes with support at t */
     double ampsum = 0.0;
-    for (int l=0; l<nsplines; l++) {
+    int lfirst, llast;
+    activeSplines(t, &lfirst, &llast);
+    for (int l=lfirst; l<=llast; l++) {
         if (enforceZeroBoundary){
             if (l<=1 || l >= nsplines- 2) continue; // skip first and last two splines (set to zero) so that spline starts and ends at zero       
         }
@@ -142,14 +157,16 @@ void BSpline2ndAmplitude::evaluate(const double t, const std::vector<double>& co
     *Bl2_ptr = scaling*coeff[skip + carrier_freq_id*(nsplines+1) + nsplines];  // last one is the phase
 }
 
-void BSpline2ndAmplitude::derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
+void BSpline2ndAmplitude::derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
     // valbar1 holds the current carrierfrequency. 
     double cos_omt = cos(valbar1*t + scaling * coeff[skip + carrier_freq_id*(nsplines+1) + nsplines]);
     double sin_omt = sin(valbar1*t + scaling * coeff[skip + carrier_freq_id*(nsplines+1) + nsplines]);
 
-    /* Iterate over basis function */
+    /* Iterate over basis functions with support at t */
     double ampsum = 0.0;
-    for (int l=0; l<nsplines; l++) {
+    int lfirst, llast;
+    activeSplines(t, &lfirst, &llast);
+    for (int l=lfirst; l<=llast; l++) {
         if (enforceZeroBoundary){
             if (l<=1 || l >= nsplines- 2) continue; // skip first and last two splines (set to zero) so that spline starts and ends at zero       
         }
@@ -158,12 +175,21 @@ void BSpline2ndAmplitude::derivative(const double t, const std::vector<double>&
         ampsum += alpha1 * Blt;
         // Update derivative for the amplitude splines
         // valbar2 holds the flag whether this is p or q
-        if (valbar2 > 0.0) coeff_diff[skip + carrier_freq_id*(nsplines+1) + l] += Blt * cos_omt;
-        else               coeff_diff[skip + carrier_freq_id*(nsplines+1) + l] += Blt * sin_omt;
+        ids.push_back(skip + carrier_freq_id*(nsplines+1) + l);
+        if (valbar2 > 0.0) coeff_diff.push_back(Blt * cos_omt);
+        else               coeff_diff.push_back(Blt * sin_omt);
     }
     // Update derivate for phase
-    if (valbar2 > 0.0) coeff_diff[skip + carrier_freq_id*(nsplines+1) + nsplines] += -ampsum * scaling * sin_omt;
-    else               coeff_diff[skip + carrier_freq_id*(nsplines+1) + nsplines] +=  ampsum * scaling * cos_omt;
+    ids.push_back(skip + carrier_freq_id*(nsplines+1) + nsplines);
+    if (valbar2 > 0.0) coeff_diff.push_back(-ampsum * scaling * sin_omt);
+    else               coeff_diff.push_back( ampsum * scaling * cos_omt);
+}
+
+void BSpline2ndAmplitude::activeSplines(double t, int* lfirst, int* llast){
+    /* Spline l has support [t0 + (l-2)*dtknot, t0 + (l+1)*dtknot). Take one more to the left for round-off. */
+    int l0 = (int) floor((t - tstart) / dtknot);
+    *lfirst = std::max(0, l0 - 1);
+    *llast  = std::min(nsplines - 1, l0 + 2);
 }
 
 double BSpline2ndAmplitude::basisfunction(int id, double t){
@@ -176,9 +202,9 @@ double BSpline2ndAmplitude::basisfunction(int id, double t){
 
     /* Evaluate basis function */
     double val = 0.0;
-    if       (-1./2. <= tau && tau < -1./6.) val = 9./8. + 9./2. * tau + 9./2. * pow(tau,2);
-    else if  (-1./6. <= tau && tau <  1./6.) val = 3./4. - 9. * pow(tau,2);
-    else if  ( 1./6. <= tau && tau <  1./2.) val = 9./8. - 9./2. * tau + 9./2. * pow(tau,2);
+    if       (tau < -1./6.) val = 9./8. + 9./2. * tau + 9./2. * tau*tau;
+    else if  (tau <  1./6.) val = 3./4. - 9. * tau*tau;
+    else                    val = 9./8. - 9./2. * tau + 9./2. * tau*tau;
 
     return val;
 }
@@ -205,14 +231,14 @@ void Step::evaluate(const double t, const std::vector<double>& coeff, int carrie
     *Blt2 = ramp*step_amp2;
 }
 
-void Step::derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
+void Step::derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
 
     double alpha = coeff[skip + carrier_freq_id*2];    
     double tstepend = tstart + alpha*(tstop - tstart);
 
     double dramp = getRampFactor_diff(t, tstart, tstepend, tramp);
-    coeff_diff[skip + carrier_freq_id*2] += step_amp1*valbar1 * dramp * (tstop - tstart); 
-    coeff_diff[skip + carrier_freq_id*2] += step_amp2*valbar2 * dramp * (tstop - tstart); 
+    ids.push_back(skip + carrier_freq_id*2);
+    coeff_diff.push_back((step_amp1*valbar1 + step_amp2*valbar2) * dramp * (tstop - tstart)); 
 }
 
 // Zeroth order B-splines, i.e., piecewise constant
@@ -242,14 +268,16 @@ void BSpline0::evaluate(const double t, const std::vector<double>& coeff, int ca
     }
 }
 
-void BSpline0::derivative(const double t, const std::vector<double>& coeff, double* coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
+void BSpline0::derivative(const double t, const std::vector<double>& coeff, std::vector<int>& ids, std::vector<double>& coeff_diff, const double valbar1, const double valbar2, int carrier_freq_id) {
 
     // Figure out which basis function is active at this time point 
     int splineID = ceil((t-tstart)/dtknot - 0.5);
 
     if (splineID >= 0 && splineID < nsplines){
-        coeff_diff[skip + carrier_freq_id*nsplines*2 + splineID] += valbar1;
-        coeff_diff[skip + carrier_freq_id*nsplines*2 + splineID + nsplines] += valbar2;
+        ids.push_back(skip + carrier_freq_id*nsplines*2 + splineID);
+        coeff_diff.push_back(valbar1);
+        ids.push_back(skip + carrier_freq_id*nsplines*2 + splineID + nsplines);
+        coeff_diff.push_back(valbar2);
     }
 }
 
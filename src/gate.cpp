@@ -43,6 +43,23 @@ Gate::Gate(std::vector<int> nlevels_, std::vector<int> nessential_, double time_
   MatAssemblyEnd(V_re, MAT_FINAL_ASSEMBLY);
   MatAssemblyEnd(V_im, MAT_FINAL_ASSEMBLY);
 
+  /* Map between essential and full-dimension indices */
+  full2ess.resize(dim_rho, -1);
+  for (int ie = 0; ie < dim_ess; ie++) {
+    int i = mapEssToFull(ie, nlevels, nessential);
+    ess2full.push_back(i);
+    full2ess[i] = ie;
+  }
+
+  /* If the Petsc vectors are sequential, the gate is applied as V rho V^\dagger directly on the state, and the vectorized gate is not needed. */
+  int mpisize_petsc;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+  matfree = mpisize_petsc == 1;
+  if (matfree) {
+    if (lindbladtype != LindbladType::NONE) work.resize(2*dim_rho*dim_rho);
+    return;
+  }
+
   /* Allocate vectorized Gate in full dimensions */
   /* If Lindblad solver: Gate G = V_full x V_full, where V is the full-dimension gate (inserting identities for all non-essential levels) */ 
   /* Else Schroedinger solver: Gate G = V_full */
@@ -76,10 +93,11 @@ Gate::Gate(std::vector<int> nlevels_, std::vector<int> nessential_, double time_
 
 Gate::~Gate(){
   if (dim_rho == 0) return;
-  MatDestroy(&VxV_re);
-  MatDestroy(&VxV_im);
   MatDestroy(&V_re);
   MatDestroy(&V_im);
+  if (matfree) return;
+  MatDestroy(&VxV_re);
+  MatDestroy(&VxV_im);
   VecDestroy(&x);
   ISDestroy(&isu);
   ISDestroy(&isv);
@@ -144,6 +162,23 @@ void Gate::assembleGate(){
   else printf("Rotated Gate is unitary.\n");
 #endif
 
+  /* Store the rotated gate for the matrix-free application */
+  if (matfree) {
+    Vrot_re.resize(dim_ess*dim_ess);
+    Vrot_im.resize(dim_ess*dim_ess);
+    for (PetscInt row=0; row<dim_ess; row++){
+      MatGetRow(V_re, row, NULL, NULL, &vals_vre);
+      MatGetRow(V_im, row, NULL, NULL, &vals_vim);
+      for (int c=0; c<dim_ess; c++){
+        Vrot_re[row*dim_ess + c] = vals_vre[c];
+        Vrot_im[row*dim_ess + c] = vals_vim[c];
+      }
+      MatRestoreRow(V_re, row, NULL, NULL, &vals_vre);
+      MatRestoreRow(V_im, row, NULL, NULL, &vals_vim);
+    }
+    return;
+  }
+
 
  if (lindbladtype != LindbladType::NONE){ // Lindblad solver. Gate is G = V\kron V
   /* Assemble vectorized gate G=V\kron V where V = PV_eP^T for essential dimension gate V_e (user input) and projection P lifting V_e to the full dimension by inserting identity blocks for non-essential levels. */
@@ -261,6 +296,74 @@ void Gate::applyGate(const Vec state, Vec VrhoV){
   /* Exit, if this is a dummy gate */
   if (dim_rho == 0) return;
 
+  if (matfree) {
+    /* Full-dimension gate V acts as V_e on the essential levels and as identity on all others. The state is stored column-wise, with real and imaginary parts co-located. */
+    const PetscScalar* s;
+    PetscScalar* out;
+    VecGetArrayRead(state, &s);
+    VecGetArray(VrhoV, &out);
+
+    /* W = V rho. Schroedinger: rho is a single column, store W in the output. Lindblad: store W in the work array. */
+    int ncols = 1;
+    double* w = out;
+    if (lindbladtype != LindbladType::NONE) {
+      ncols = dim_rho;
+      w = work.data();
+    }
+    for (int j=0; j<ncols; j++){
+      const PetscScalar* sj = s + 2*j*dim_rho;
+      double* wj = w + 2*j*dim_rho;
+      for (int i=0; i<dim_rho; i++){
+        int ie = full2ess[i];
+        if (ie < 0) {
+          wj[2*i]   = sj[2*i];
+          wj[2*i+1] = sj[2*i+1];
+          continue;
+        }
+        double re = 0.0;
+        double im = 0.0;
+        for (int ce=0; ce<dim_ess; ce++){
+          double a = Vrot_re[ie*dim_ess + ce];
+          double b = Vrot_im[ie*dim_ess + ce];
+          int c = ess2full[ce];
+          re += a * sj[2*c]   - b * sj[2*c+1];
+          im += a * sj[2*c+1] + b * sj[2*c];
+        }
+        wj[2*i]   = re;
+        wj[2*i+1] = im;
+      }
+    }
+
+    /* Lindblad: VrhoV = W V^\dagger, column j is sum_k W[:,k] * conj(V[j,k]) */
+    if (lindbladtype != LindbladType::NONE) {
+      for (int j=0; j<dim_rho; j++){
+        double* oj = out + 2*j*dim_rho;
+        int je = full2ess[j];
+        if (je < 0) {
+          for (int i=0; i<2*dim_rho; i++) oj[i] = w[2*j*dim_rho + i];
+          continue;
+        }
+        for (int i=0; i<dim_rho; i++){
+          double re = 0.0;
+          double im = 0.0;
+          for (int ke=0; ke<dim_ess; ke++){
+            double a = Vrot_re[je*dim_ess + ke];
+            double b = Vrot_im[je*dim_ess + ke];
+            const double* wk = w + 2*ess2full[ke]*dim_rho;
+            re += a * wk[2*i]   + b * wk[2*i+1];
+            im += a * wk[2*i+1] - b * wk[2*i];
+          }
+          oj[2*i]   = re;
+          oj[2*i+1] = im;
+        }
+      }
+    }
+
+    VecRestoreArray(VrhoV, &out);
+    VecRestoreArrayRead(state, &s);
+    return;
+  }
+
   /* Get real and imag part of the state q = u + iv */
   Vec u, v;
   VecGetSubVector(state, isu, &u);
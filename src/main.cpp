@@ -151,20 +151,19 @@ int main(int argc,char **argv)
   MPI_Comm comm_optim, comm_init, comm_petsc;
 
   /* Get the size of communicators  */
-  // Number of cores for optimization. Under development, set to 1 for now. 
-  // int np_optim= config.GetIntParam("np_optim", 1);
-  // np_optim= min(np_optim, mpisize_world); 
-  int np_optim= 1;
-  // Number of cores for initial condition distribution. Since this gives perfect speedup, choose maximum.
-  int np_init = std::min(ninit, mpisize_world); 
-  // Number of cores for Petsc: All the remaining ones. 
-  int np_petsc = mpisize_world / (np_init * np_optim);
-
-  /* Sanity check for communicator sizes */ 
-  if (mpisize_world % ninit != 0 && ninit % mpisize_world != 0) {
-    if (mpirank_world == 0) printf("ERROR: Number of threads (%d) must be integer multiplier or divisor of the number of initial conditions (%d)!\n", mpisize_world, ninit);
+  // Number of cores for time-parallel (Parareal) propagation. 
+  int np_optim= config.GetIntParam("np_optim", 1, false);
+  np_optim= std::max(1, std::min(np_optim, mpisize_world)); 
+  if (mpisize_world % np_optim != 0) {
+    if (mpirank_world == 0) printf("ERROR: Number of threads (%d) must be integer multiplier of np_optim (%d)!\n", mpisize_world, np_optim);
     exit(1);
   }
+  int np_rest = mpisize_world / np_optim;
+  // Number of cores for initial condition distribution. Since this gives perfect speedup, choose maximum, such that it divides the remaining cores. Initial conditions are balanced over the groups.
+  int np_init = std::min(ninit, np_rest); 
+  while (np_rest % np_init != 0) np_init--;
+  // Number of cores for Petsc: All the remaining ones. 
+  int np_petsc = np_rest / np_init;
 
   /* Split communicators */
   // Distributed initial conditions 
@@ -188,7 +187,7 @@ int main(int argc,char **argv)
   /* Set Petsc using petsc's communicator */
   PETSC_COMM_WORLD = comm_petsc;
 
-  if (mpirank_world == 0 && !quietmode)  std::cout<< "Parallel distribution: " << mpisize_init << " np_init  X  " << mpisize_petsc<< " np_petsc  " << std::endl;
+  if (mpirank_world == 0 && !quietmode)  std::cout<< "Parallel distribution: " << mpisize_init << " np_init  X  " << mpisize_optim << " np_optim  X  " << mpisize_petsc<< " np_petsc  " << std::endl;
 
 #ifdef WITH_SLEPC
   ierr = SlepcInitialize(&argc, &argv, (char*)0, NULL);if (ierr) return ierr;
@@ -324,12 +323,18 @@ int main(int argc,char **argv)
     if (mpirank_world==0 && !quietmode) printf("# Warning: Matrix-free solver can not be used when Hamiltonian is read fromfile. Switching to sparse-matrix version.\n");
     usematfree = false;
   }
+  // Check if the Hamiltonian from file should be diagonalized and propagated in its eigenbasis
+  bool interactionpicture = config.GetBoolParam("hamiltonian_interactionpicture", false, false);
+  if (interactionpicture && hamiltonian_file.compare("none") == 0) {
+    if (mpirank_world==0 && !quietmode) printf("# Warning: Interaction picture is only available when the Hamiltonian is read from file. Ignoring it.\n");
+    interactionpicture = false;
+  }
   // Initialize Master equation
-  MasterEq* mastereq = new MasterEq(nlevels, nessential, oscil_vec, crosskerr, Jkl, eta, lindbladtype, usematfree, hamiltonian_file, quietmode);
+  MasterEq* mastereq = new MasterEq(nlevels, nessential, oscil_vec, crosskerr, Jkl, eta, lindbladtype, usematfree, hamiltonian_file, interactionpicture, quietmode);
 
 
   /* Output */
-  Output* output = new Output(config, comm_petsc, comm_init, nlevels.size(), quietmode);
+  Output* output = new Output(config, comm_petsc, comm_init, comm_optim, nlevels.size(), quietmode);
 
   // Some screen output 
   if (mpirank_world == 0 && !quietmode) {
@@ -356,14 +361,25 @@ int main(int argc,char **argv)
   int linsolve_maxiter = config.GetIntParam("linearsolver_maxiter", 10);
   if      (linsolvestr.compare("gmres")   == 0) linsolvetype = LinearSolverType::GMRES;
   else if (linsolvestr.compare("neumann") == 0) linsolvetype = LinearSolverType::NEUMANN;
+  else if (linsolvestr.compare("lu")      == 0) linsolvetype = LinearSolverType::LU;
   else {
     printf("\n\n ERROR: Unknown linear solver type: %s.\n\n", linsolvestr.c_str());
     exit(1);
   }
+  if (linsolvetype == LinearSolverType::LU) {
+    /* Petsc has no native LU factorization of distributed dense matrices */
+    if (mpisize_petsc > 1) {
+      if (mpirank_world == 0) printf("ERROR: linearsolver_type lu requires np_petsc = 1. Use fewer cores, or linearsolver_type gmres.\n");
+      exit(1);
+    }
+    /* The factorization can only be reused if the RHS is the same in many time steps, i.e. for piecewise constant controls without carrier waves, and no dipole-dipole coupling that rotates in the rotating frame (Jkl with eta != 0). Otherwise every time step factorizes a new dense matrix. */
+    if (!mastereq->isPiecewiseConstant() && mpirank_world == 0) {
+      printf("# Warning: linearsolver_type lu reuses its factorizations only for spline0 controls with zero carrier frequencies and without time-dependent dipole-dipole coupling (Jkl with different rotation frequencies). Here, each time step computes a new dense LU factorization.\n");
+    }
+  }
 
   /* My time stepper */
   bool storeFWD = false;
-  int ninit_local = ninit / mpisize_init; 
   if (mastereq->lindbladtype != LindbladType::NONE &&   
      (runtype == RunType::GRADIENT || runtype == RunType::OPTIMIZATION) ) storeFWD = true;  // if NOT Schroedinger solver and running gradient optim: store forward states. Otherwise, they will be recomputed during gradient. 
 
@@ -372,11 +388,18 @@ int main(int argc,char **argv)
   if (timesteppertypestr.compare("IMR")==0) mytimestepper = new ImplMidpoint(config, mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
   else if (timesteppertypestr.compare("IMR4")==0) mytimestepper = new CompositionalImplMidpoint(config, 4, mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
   else if (timesteppertypestr.compare("IMR8")==0) mytimestepper = new CompositionalImplMidpoint(config, 8, mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
+  else if (timesteppertypestr.compare("GL4")==0) mytimestepper = new GaussLegendre(config, 4, mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
+  else if (timesteppertypestr.compare("GL6")==0) mytimestepper = new GaussLegendre(config, 6, mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
+  else if (timesteppertypestr.compare("IMRSPLIT")==0) mytimestepper = new StrangSplitting(config, mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
   else if (timesteppertypestr.compare("EE")==0) mytimestepper = new ExplEuler(config, mastereq, ntime, total_time, output, storeFWD);
   else {
     printf("\n\n ERROR: Unknow timestepping type: %s.\n\n", timesteppertypestr.c_str());
     exit(1);
   }
+  if (mpisize_optim > 1) mytimestepper->setTimeParallel(comm_optim);
+  if (interactionpicture && timesteppertypestr.compare("IMRSPLIT") != 0 && mpirank_world == 0 && !quietmode) {
+    printf("# Note: Use timestepper IMRSPLIT to propagate the diagonal system Hamiltonian exactly in the interaction picture.\n");
+  }
 
   /* --- Initialize optimization --- */
   OptimProblem* optimctx = new OptimProblem(config, mytimestepper, comm_init, comm_optim, ninit, output, quietmode);
@@ -6,19 +6,28 @@ MasterEq::MasterEq(){
   RHS = NULL;
   Ad     = NULL;
   Bd     = NULL;
-  dRedp = NULL;
-  dImdp = NULL;
   usematfree = false;
   quietmode = false;
+  dressedbasis = false;
+  dressed_scatter = NULL;
+  dressed_xall = NULL;
+  dp_record = false;
+  control_sample_size = 0;
+  control_ntime = 0;
+  control_dt = 0.0;
 }
 
 
-MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_, std::string hamiltonian_file_, bool quietmode_) {
+MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_, std::string hamiltonian_file_, bool dressedbasis_, bool quietmode_) {
   int ierr;
 
   nlevels = nlevels_;
   nessential = nessential_;
   noscillators = nlevels.size();
+  dp_record = false;
+  control_sample_size = 0;
+  control_ntime = 0;
+  control_dt = 0.0;
   oscil_vec = oscil_vec_;
   crosskerr = crosskerr_;
   Jkl = Jkl_;
@@ -26,6 +35,9 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   usematfree = usematfree_;
   lindbladtype = lindbladtype_;
   hamiltonian_file = hamiltonian_file_;
+  dressedbasis = dressedbasis_ && hamiltonian_file.compare("none") != 0;
+  dressed_scatter = NULL;
+  dressed_xall = NULL;
   quietmode = quietmode_;
 
 
@@ -143,8 +155,6 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   }
 
   /* Allocate some auxiliary vectors */
-  dRedp = new double[nparams_max];
-  dImdp = new double[nparams_max];
   cols = new PetscInt[nparams_max];
   vals = new PetscScalar[nparams_max];
 
@@ -169,6 +179,9 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   RHSctx.nlevels = nlevels;
   RHSctx.oscil_vec = oscil_vec;
   RHSctx.time = 0.0;
+  RHSctx.dp_xptr = NULL;
+  RHSctx.dp_coeff_p = NULL;
+  RHSctx.dp_coeff_q = NULL;
   for (int iosc = 0; iosc < noscillators; iosc++) {
     std::vector<double> controlRek;
     for (int icon=0; icon<transfer_Hc_re[iosc].size(); icon++){ 
@@ -230,6 +243,24 @@ MasterEq::~MasterEq(){
         }
       }
       VecDestroy(&aux);
+      VecDestroy(&ughost);
+      VecDestroy(&vghost);
+      VecScatterDestroy(&ghost_scatter);
+      /* Release the CSR arrays held in setupControlCSR before destroying the control matrices */
+      for (int k=0; k<2; k++) {
+        std::vector<std::vector<LocalCSR>>& csr = k == 0 ? Ac_csr : Bc_csr;
+        for (int i=0; i<csr.size(); i++){
+          for (int icon=0; icon<csr[i].size(); icon++)  {
+            LocalCSR& A = csr[i][icon];
+            if (A.seqmat != NULL) {
+              PetscBool done;
+              MatSeqAIJRestoreArrayRead(A.seqmat, &A.val);
+              MatRestoreRowIJ(A.seqmat, 0, PETSC_FALSE, PETSC_FALSE, &A.nrows, &A.rowptr, &A.col, &done);
+              A.seqmat = NULL;
+            }
+          }
+        }
+      }
       for (int i=0; i<Ac_vec.size(); i++){
         for (int icon=0; icon<Ac_vec[i].size(); icon++)  {
           if (Ac_vec[i][icon] != NULL) {
@@ -244,6 +275,9 @@ MasterEq::~MasterEq(){
           }
         }
       }
+      for (int i=0; i<shared_wins.size(); i++) {
+        if (shared_wins[i] != MPI_WIN_NULL) MPI_Win_free(&(shared_wins[i]));
+      }
     }
     for (int i=0; i<transfer_Hdt_re.size(); i++) delete transfer_Hdt_re[i];
     for (int i=0; i<transfer_Hdt_im.size(); i++) delete transfer_Hdt_im[i];
@@ -253,14 +287,16 @@ MasterEq::~MasterEq(){
     for (int i=0; i<transfer_Hc_im.size(); i++) {
       for (int icon=0; icon<transfer_Hc_im[i].size(); icon++) delete transfer_Hc_im[i][icon];
     }
-    delete [] dRedp;
-    delete [] dImdp;
     delete [] vals;
     delete [] cols;
 
     ISDestroy(&isu);
     ISDestroy(&isv);
 
+    if (dressed_scatter != NULL) {
+      VecScatterDestroy(&dressed_scatter);
+      VecDestroy(&dressed_xall);
+    }
   }
 }
 
@@ -347,9 +383,10 @@ void MasterEq::initSparseMatSolver(){
     if (mpirank_world==0 && !quietmode) printf("\n# Reading Hamiltonian model from file %s.\n\n", hamiltonian_file.c_str());
 
     /* Read Hamiltonians from file */
-    PythonInterface* py = new PythonInterface(hamiltonian_file, lindbladtype, dim_rho, quietmode);
+    PythonInterface* py = new PythonInterface(hamiltonian_file, lindbladtype, dim_rho, quietmode, dressedbasis);
     py->receiveHsys(Bd);
     py->receiveHc(noscillators, Ac_vec, Bc_vec); 
+    if (dressedbasis) Vdressed = py->getDressedBasis();
 
     if (mpirank_world==0&& !quietmode) printf("# Done. \n\n");
 
@@ -711,10 +748,216 @@ void MasterEq::initSparseMatSolver(){
 //  // exit(1);
 
 
+  /* The system matrices are identical on all processors if Petsc runs sequentially. Keep only one copy per node. 
+   * The CSR views of the control operators set up below point into these shared arrays. */
+  shared_wins.push_back(MatShareOnNode(&Ad));
+  shared_wins.push_back(MatShareOnNode(&Bd));
+  for (int k=0; k<noscillators; k++){
+    for (int i=0; i<Ac_vec[k].size(); i++) shared_wins.push_back(MatShareOnNode(&(Ac_vec[k][i])));
+    for (int i=0; i<Bc_vec[k].size(); i++) shared_wins.push_back(MatShareOnNode(&(Bc_vec[k][i])));
+  }
+  for (int kl=0; kl<Ad_vec.size(); kl++) {
+    if (Ad_vec[kl] != NULL) shared_wins.push_back(MatShareOnNode(&(Ad_vec[kl])));
+    if (Bd_vec[kl] != NULL) shared_wins.push_back(MatShareOnNode(&(Bd_vec[kl])));
+  }
+
   /* Allocate some auxiliary vectors */
   MatCreateVecs(Bd, &aux, NULL);
+
+  setupControlCSR();
+}
+
+
+void MasterEq::setupControlCSR(){
+
+  PetscInt cstart, cend;
+  MatGetOwnershipRangeColumn(Bd, &cstart, &cend);
+  int nlocal = cend - cstart;
+
+  int mpisize_petsc;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+
+  /* If Petsc runs sequentially, all columns are local: Use the CSR arrays of the matrices directly (these are node-shared, see initSparseMatSolver). 
+   * Otherwise, copy the local rows of each control operator. Off-processor columns get a ghost index. */
+  std::map<int, int> ghostid;   // global column -> position in the ghost vector
+  std::vector<int> ghostcols;
+  for (int k = 0; k < 2; k++) {
+    std::vector<std::vector<Mat>>& mats = k == 0 ? Ac_vec : Bc_vec;
+    std::vector<std::vector<LocalCSR>>& csr = k == 0 ? Ac_csr : Bc_csr;
+    csr.resize(noscillators);
+    for (int iosc = 0; iosc < noscillators; iosc++) {
+      csr[iosc].resize(mats[iosc].size());
+      for (int icon = 0; icon < mats[iosc].size(); icon++) {
+        LocalCSR& A = csr[iosc][icon];
+        A.seqmat = NULL;
+        if (mpisize_petsc == 1) {
+          /* The matrices are not modified after assembly. Hold the arrays until ~MasterEq, which calls the matching restores. */
+          PetscBool done;
+          MatMPIAIJGetSeqAIJ(mats[iosc][icon], &A.seqmat, NULL, NULL);
+          MatGetRowIJ(A.seqmat, 0, PETSC_FALSE, PETSC_FALSE, &A.nrows, &A.rowptr, &A.col, &done);
+          MatSeqAIJGetArrayRead(A.seqmat, &A.val);
+          continue;
+        }
+        PetscInt ilow, iupp;
+        MatGetOwnershipRange(mats[iosc][icon], &ilow, &iupp);
+        A.rowptr_copy.assign(1, 0);
+        for (int row = ilow; row < iupp; row++) {
+          PetscInt ncols;
+          const PetscInt* cols;
+          const PetscScalar* vals;
+          MatGetRow(mats[iosc][icon], row, &ncols, &cols, &vals);
+          for (int j = 0; j < ncols; j++) {
+            int col = cols[j] - cstart;
+            if (cols[j] < cstart || cols[j] >= cend) {
+              if (ghostid.find(cols[j]) == ghostid.end()) {
+                ghostid[cols[j]] = ghostcols.size();
+                ghostcols.push_back(cols[j]);
+              }
+              col = nlocal + ghostid[cols[j]];
+            }
+            A.col_copy.push_back(col);
+            A.val_copy.push_back(vals[j]);
+          }
+          MatRestoreRow(mats[iosc][icon], row, &ncols, &cols, &vals);
+          A.rowptr_copy.push_back(A.col_copy.size());
+        }
+        A.nrows = iupp - ilow;
+        A.rowptr = A.rowptr_copy.data();
+        A.col = A.col_copy.data();
+        A.val = A.val_copy.data();
+      }
+    }
+  }
+
+  /* Scatter from the distributed u (or v) into the sequential ghost vectors */
+  IS isghost;
+  ISCreateGeneral(PETSC_COMM_SELF, ghostcols.size(), ghostcols.data(), PETSC_COPY_VALUES, &isghost);
+  VecCreateSeq(PETSC_COMM_SELF, ghostcols.size(), &ughost);
+  VecCreateSeq(PETSC_COMM_SELF, ghostcols.size(), &vghost);
+  VecScatterCreate(aux, isghost, ughost, NULL, &ghost_scatter);
+  ISDestroy(&isghost);
+}
+
+void MasterEq::transformToDressed(Vec x){
+  applyDressedTransform(x, true);
+}
+
+void MasterEq::transformFromDressed(Vec x){
+  applyDressedTransform(x, false);
+}
+
+const PetscScalar* MasterEq::gatherDressed(Vec x){
+  if (dressed_scatter == NULL) VecScatterCreateToAll(x, &dressed_scatter, &dressed_xall);
+  VecScatterBegin(dressed_scatter, x, dressed_xall, INSERT_VALUES, SCATTER_FORWARD);
+  VecScatterEnd(dressed_scatter, x, dressed_xall, INSERT_VALUES, SCATTER_FORWARD);
+  const PetscScalar* xptr;
+  VecGetArrayRead(dressed_xall, &xptr);
+  return xptr;
+}
+
+void MasterEq::applyDressedTransform(Vec x, bool transpose){
+  if (!dressedbasis) return;
+  int N = dim_rho;
+
+  /* Gather the full state on all processors */
+  const PetscScalar* xptr = gatherDressed(x);
+
+  /* M = V^T (to dressed) or M = V (from dressed). V is real, so real and imaginary parts transform separately. */
+  std::vector<double> M(N*N);
+  for (int i=0; i<N; i++){
+    for (int k=0; k<N; k++){
+      M[i + N*k] = transpose ? Vdressed[k + N*i] : Vdressed[i + N*k];
+    }
+  }
+
+  std::vector<double> result(2*dim, 0.0);
+  for (int c = 0; c < 2; c++) {  // real and imaginary part
+    if (lindbladtype == LindbladType::NONE) {
+      // x <- M x
+      for (int k=0; k<N; k++){
+        double xk = xptr[2*k + c];
+        for (int i=0; i<N; i++) result[2*i + c] += M[i + N*k] * xk;
+      }
+    } else {
+      // rho <- M rho M^T, with rho_ij stored at getVecID(i,j,N)
+      std::vector<double> W(N*N, 0.0);
+      for (int j=0; j<N; j++){
+        for (int k=0; k<N; k++){
+          double rhokj = xptr[2*getVecID(k,j,N) + c];
+          for (int i=0; i<N; i++) W[i + N*j] += M[i + N*k] * rhokj;
+        }
+      }
+      for (int l=0; l<N; l++){
+        for (int j=0; j<N; j++){
+          double mjl = M[j + N*l];
+          for (int i=0; i<N; i++) result[2*getVecID(i,j,N) + c] += W[i + N*l] * mjl;
+        }
+      }
+    }
+  }
+  VecRestoreArrayRead(dressed_xall, &xptr);
+
+  /* Write back the local part */
+  PetscInt ilow, iupp;
+  VecGetOwnershipRange(x, &ilow, &iupp);
+  PetscScalar* yptr;
+  VecGetArray(x, &yptr);
+  for (int i = ilow; i < iupp; i++) yptr[i-ilow] = result[i];
+  VecRestoreArray(x, &yptr);
+}
+
+
+void MasterEq::bareDiagonal(Vec x, const std::vector<int>& ids, std::vector<double>& re, std::vector<double>& im){
+  int N = dim_rho;
+  re.assign(ids.size(), 0.0);
+  im.assign(ids.size(), 0.0);
+
+  /* Row i of V maps the dressed state to the bare entry i: x_i = sum_k V_ik x~_k, or rho_ii = sum_kl V_ik rho~_kl V_il */
+  const PetscScalar* xptr = gatherDressed(x);
+  for (int j=0; j<ids.size(); j++){
+    int i = ids[j];
+    if (lindbladtype == LindbladType::NONE) {
+      for (int k=0; k<N; k++){
+        re[j] += Vdressed[i + N*k] * xptr[getIndexReal(k)];
+        im[j] += Vdressed[i + N*k] * xptr[getIndexImag(k)];
+      }
+    } else {
+      for (int l=0; l<N; l++){
+        double vil = Vdressed[i + N*l];
+        if (vil == 0.0) continue;
+        for (int k=0; k<N; k++){
+          double vikl = Vdressed[i + N*k] * vil;
+          re[j] += vikl * xptr[getIndexReal(getVecID(k,l,N))];
+          im[j] += vikl * xptr[getIndexImag(getVecID(k,l,N))];
+        }
+      }
+    }
+  }
+  VecRestoreArrayRead(dressed_xall, &xptr);
 }
 
+void MasterEq::bareDiagonal_diff(Vec xbar, const std::vector<int>& ids, const std::vector<double>& re_bar, const std::vector<double>& im_bar){
+  int N = dim_rho;
+  PetscInt ilow, iupp;
+  VecGetOwnershipRange(xbar, &ilow, &iupp);
+  PetscScalar* xbarptr;
+  VecGetArray(xbar, &xbarptr);
+
+  /* Each processor updates its own part of xbar. Storage index id holds the real (even) or imaginary (odd) part of element id/2. */
+  for (int j=0; j<ids.size(); j++){
+    int i = ids[j];
+    for (PetscInt id = ilow; id < iupp; id++) {
+      int vecid = id / 2;
+      double coeff;
+      if (lindbladtype == LindbladType::NONE) coeff = Vdressed[i + N*vecid];
+      else coeff = Vdressed[i + N*(vecid % N)] * Vdressed[i + N*(vecid / N)];  // vecid = k + N*l
+      xbarptr[id - ilow] += coeff * (id % 2 == 0 ? re_bar[j] : im_bar[j]);
+    }
+  }
+  VecRestoreArray(xbar, &xbarptr);
+}
+
+
 int MasterEq::getDim(){ return dim; }
 
 int MasterEq::getDimEss(){ return dim_ess; }
@@ -732,31 +975,19 @@ int MasterEq::assemble_RHS(const double t){
   // Set the time
   RHSctx.time = t;
 
-  // Evaluate and store the controls and transfer for each oscillator and each controlterm
+  // Get the controls and transfer values for each oscillator and each controlterm from the control table
+  int offset = getControlSample(t);
+  const double* sample = control_table.data() + offset;
   for (int iosc = 0; iosc < noscillators; iosc++) {
-
-    double p, q;
-    oscil_vec[iosc]->evalControl(t, &p, &q);  // Evaluates the B-spline basis functions -> p(t,alpha), q(t,alpha)
-
-    // Iterate over control terms for this oscillator
-    for (int icon=0; icon<transfer_Hc_re[iosc].size(); icon++){
-      // Get transfer functions u^k_i(p) (Default: Identity. But could be different if python interface)
-      double ukip = transfer_Hc_re[iosc][icon]->eval(p, t);
-      RHSctx.control_Re[iosc][icon] = ukip; 
-    } 
-    for (int icon=0; icon<transfer_Hc_im[iosc].size(); icon++){
-      double ukiq = transfer_Hc_im[iosc][icon]->eval(q, t);
-      RHSctx.control_Im[iosc][icon] = ukiq;
-    } 
+    const double* s = sample + control_sample_offset[iosc] + 2;
+    for (int icon=0; icon<transfer_Hc_re[iosc].size(); icon++) RHSctx.control_Re[iosc][icon] = *(s++);
+    for (int icon=0; icon<transfer_Hc_im[iosc].size(); icon++) RHSctx.control_Im[iosc][icon] = *(s++);
   } 
 
-  // Evaluate and store transfer for time-dependent system term
-  for (int kl=0; kl<transfer_Hdt_re.size(); kl++)
-    // REAL part: Default trans_re = Jkl*cos(etakl*t) , or from python interface
-    RHSctx.eval_transfer_Hdt_re[kl] = transfer_Hdt_re[kl]->eval(t, t); 
-  for (int kl=0; kl<transfer_Hdt_im.size(); kl++)
-    // IMAG part: Default trans_im = Jkl*sin(etakl*t)
-    RHSctx.eval_transfer_Hdt_im[kl] = transfer_Hdt_im[kl]->eval(t, t); 
+  // Transfer values for time-dependent system terms
+  const double* s = sample + control_sample_size - transfer_Hdt_re.size() - transfer_Hdt_im.size();
+  for (int kl=0; kl<transfer_Hdt_re.size(); kl++) RHSctx.eval_transfer_Hdt_re[kl] = *(s++);
+  for (int kl=0; kl<transfer_Hdt_im.size(); kl++) RHSctx.eval_transfer_Hdt_im[kl] = *(s++);
 
   return 0;
 }
@@ -766,6 +997,120 @@ int MasterEq::assemble_RHS(const double t){
 Mat MasterEq::getRHS() { return RHS; }
 
 
+bool MasterEq::isPiecewiseConstant(){
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    for (int iseg = 0; iseg < oscil_vec[iosc]->getNSegments(); iseg++) {
+      ControlType type = oscil_vec[iosc]->getControlType(iseg);
+      if (type != ControlType::BSPLINE0 && type != ControlType::NONE) return false;
+    }
+    for (int f = 0; f < oscil_vec[iosc]->getNCarrierfrequencies(); f++) {
+      if (fabs(oscil_vec[iosc]->getCarrierFrequency(f)) > 1e-14) return false;
+    }
+  }
+  for (int i = 0; i < Jkl.size(); i++) {
+    if (fabs(Jkl[i]) > 1e-14 && fabs(eta[i]) > 1e-14) return false;
+  }
+  return true;
+}
+
+
+void MasterEq::getRHSCoefficients(std::vector<double>& coeffs){
+  coeffs.clear();
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    for (int icon=0; icon<RHSctx.control_Re[iosc].size(); icon++) coeffs.push_back(RHSctx.control_Re[iosc][icon]);
+    for (int icon=0; icon<RHSctx.control_Im[iosc].size(); icon++) coeffs.push_back(RHSctx.control_Im[iosc][icon]);
+  }
+  for (int kl=0; kl<RHSctx.eval_transfer_Hdt_re.size(); kl++) coeffs.push_back(RHSctx.eval_transfer_Hdt_re[kl]);
+  for (int kl=0; kl<RHSctx.eval_transfer_Hdt_im.size(); kl++) coeffs.push_back(RHSctx.eval_transfer_Hdt_im[kl]);
+  // The matrix-free solver applies the rotation of the dipole-dipole coupling directly
+  if (usematfree) {
+    for (int kl=0; kl<Jkl.size(); kl++) {
+      if (fabs(Jkl[kl]) > 1e-12 && fabs(eta[kl]) > 1e-12) {
+        coeffs.push_back(cos(eta[kl]*RHSctx.time));
+        coeffs.push_back(sin(eta[kl]*RHSctx.time));
+      }
+    }
+  }
+}
+
+
+void MasterEq::getDriftDiagonal(Vec diag){
+
+  PetscInt ilow, iupp;
+  VecGetOwnershipRange(diag, &ilow, &iupp);
+  VecZeroEntries(diag);
+
+  if (!usematfree) {
+    /* Sparse-matrix solver: Extract diagonals of the constant system matrices */
+    Vec u, v;
+    VecGetSubVector(diag, isu, &u);
+    VecGetSubVector(diag, isv, &v);
+    MatGetDiagonal(Ad, u);
+    MatGetDiagonal(Bd, v);
+    VecRestoreSubVector(diag, isu, &u);
+    VecRestoreSubVector(diag, isv, &v);
+    return;
+  }
+
+  /* Matrix-free solver: Evaluate the diagonal of the drift terms, same as in the matfree kernels */
+  double* dptr;
+  VecGetArray(diag, &dptr);
+  for (int it = ilow/2; it < iupp/2; it++) {
+    // Row and column index of the density matrix (column is 0 for Schroedinger)
+    int i  = it;
+    int ip = 0;
+    if (lindbladtype != LindbladType::NONE) {
+      i  = it % dim_rho;
+      ip = it / dim_rho;
+    }
+
+    double hd = 0.0;
+    double hdp = 0.0;
+    double l = 0.0;
+    int coupling_id = 0;
+    for (int iosc = 0; iosc < noscillators; iosc++) {
+      int nk     = oscil_vec[iosc]->getNLevels();
+      int npostk = oscil_vec[iosc]->dim_postOsc;
+      int ik  = (i  / npostk) % nk;
+      int ikp = (ip / npostk) % nk;
+
+      // Detuning and self-kerr
+      double detunek = oscil_vec[iosc]->getDetuning();
+      double xik = oscil_vec[iosc]->getSelfkerr();
+      hd  += H_detune(detunek, ik)  + H_selfkerr(xik, ik);
+      hdp += H_detune(detunek, ikp) + H_selfkerr(xik, ikp);
+
+      // Cross-kerr for all j > k
+      for (int josc = iosc+1; josc < noscillators; josc++) {
+        int nj     = oscil_vec[josc]->getNLevels();
+        int npostj = oscil_vec[josc]->dim_postOsc;
+        int ij  = (i  / npostj) % nj;
+        int ijp = (ip / npostj) % nj;
+        hd  += H_crosskerr(crosskerr[coupling_id], ik, ij);
+        hdp += H_crosskerr(crosskerr[coupling_id], ikp, ijp);
+        coupling_id++;
+      }
+
+      // Diagonal part of decay and dephasing
+      if (lindbladtype != LindbladType::NONE) {
+        double decayk = 0.0;
+        double dephasek = 0.0;
+        if (oscil_vec[iosc]->getDecayTime() > 1e-14 && addT1)
+          decayk = 1./oscil_vec[iosc]->getDecayTime();
+        if (oscil_vec[iosc]->getDephaseTime() > 1e-14 && addT2)
+          dephasek = 1./oscil_vec[iosc]->getDephaseTime();
+        l += L1diag(decayk, ik, ikp) + L2(dephasek, ik, ikp);
+      }
+    }
+    if (lindbladtype == LindbladType::NONE) hdp = 0.0;
+
+    dptr[2*it - ilow]     = l;
+    dptr[2*it + 1 - ilow] = hdp - hd;
+  }
+  VecRestoreArray(diag, &dptr);
+}
+
+
 // void MasterEq::createReducedDensity(const Vec rho, Vec *reduced, const std::vector<int>& oscilIDs) {
 
 //   Vec red;
@@ -1204,27 +1549,15 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
     VecRestoreArrayRead(xbar, &xbarptr);
 
     /* Set the gradient values */
-    int shift = 0;
     for (int iosc = 0; iosc < noscillators; iosc++){
-      // eval control parameters derivatives
-      for (int i=0; i<nparams_max; i++){
-        dRedp[i] = 0.0;
-        dImdp[i] = 0.0;
-      }
-      oscil_vec[iosc]->evalControl_diff(t, dRedp, dImdp);
-
-      PetscInt nparam = getOscillator(iosc)->getNParams();
-      for (int iparam=0; iparam < nparam; iparam++) {
-        vals[iparam] = alpha * (coeff_p[iosc] * dRedp[iparam] + coeff_q[iosc] * dImdp[iparam]);
-        cols[iparam] = iparam + shift;
-      }
-      VecSetValues(grad, nparam, cols, vals, ADD_VALUES);
-      shift += nparam;
+      addControlGradient(t, iosc, alpha * coeff_p[iosc], alpha * coeff_q[iosc], grad);
     }
 
     //Assemble gradient
-    VecAssemblyBegin(grad);
-    VecAssemblyEnd(grad);
+    if (!dp_record) {
+      VecAssemblyBegin(grad);
+      VecAssemblyEnd(grad);
+    }
 
     delete [] coeff_p;
     delete [] coeff_q;
@@ -1238,22 +1571,71 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
   VecGetSubVector(xbar, isu, &ubar);
   VecGetSubVector(xbar, isv, &vbar);
 
-  /* Loop over oscillators */
-  int col_shift = 0;
+  /* Gather the ghost entries of u and v needed by the control operators */
+  VecScatterBegin(ghost_scatter, u, ughost, INSERT_VALUES, SCATTER_FORWARD);
+  VecScatterEnd(ghost_scatter, u, ughost, INSERT_VALUES, SCATTER_FORWARD);
+  VecScatterBegin(ghost_scatter, v, vghost, INSERT_VALUES, SCATTER_FORWARD);
+  VecScatterEnd(ghost_scatter, v, vghost, INSERT_VALUES, SCATTER_FORWARD);
+  const double *uptr, *vptr, *ubarptr, *vbarptr, *ughostptr, *vghostptr;
+  VecGetArrayRead(u, &uptr);
+  VecGetArrayRead(v, &vptr);
+  VecGetArrayRead(ubar, &ubarptr);
+  VecGetArrayRead(vbar, &vbarptr);
+  VecGetArrayRead(ughost, &ughostptr);
+  VecGetArrayRead(vghost, &vghostptr);
+  PetscInt nlocal;
+  VecGetLocalSize(u, &nlocal);
+
+  /* Compute the bilinear forms of all control operators in one sweep over their local rows, followed by one reduction. 
+   * Per oscillator: (ubar^T Ac u, vbar^T Ac v) for each Ac, then (vbar^T Bc u, ubar^T Bc v) for each Bc. */
+  std::vector<double> forms;
   for (int iosc= 0; iosc < noscillators; iosc++){
-
-    /* Evaluate the derivative of the control functions wrt control parameters */
-    for (int i=0; i<nparams_max; i++){
-      dRedp[i] = 0.0;
-      dImdp[i] = 0.0;
+    for (int k = 0; k < 2; k++) {
+      std::vector<LocalCSR>& csr = k == 0 ? Ac_csr[iosc] : Bc_csr[iosc];
+      const double* ubar_row = k == 0 ? ubarptr : vbarptr;
+      const double* vbar_row = k == 0 ? vbarptr : ubarptr;
+      for (int icon=0; icon<csr.size(); icon++){
+        double form_u = 0.0;
+        double form_v = 0.0;
+        for (int i = 0; i < csr[icon].nrows; i++) {
+          double Au = 0.0;
+          double Av = 0.0;
+          for (int j = csr[icon].rowptr[i]; j < csr[icon].rowptr[i+1]; j++) {
+            int col = csr[icon].col[j];
+            double val = csr[icon].val[j];
+            if (col < nlocal) {
+              Au += val * uptr[col];
+              Av += val * vptr[col];
+            } else {
+              Au += val * ughostptr[col - nlocal];
+              Av += val * vghostptr[col - nlocal];
+            }
+          }
+          form_u += ubar_row[i] * Au;
+          form_v += vbar_row[i] * Av;
+        }
+        forms.push_back(form_u);
+        forms.push_back(form_v);
+      }
     }
-    oscil_vec[iosc]->evalControl_diff(t, dRedp, dImdp);
+  }
+  MPI_Allreduce(MPI_IN_PLACE, forms.data(), forms.size(), MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+  VecRestoreArrayRead(u, &uptr);
+  VecRestoreArrayRead(v, &vptr);
+  VecRestoreArrayRead(ubar, &ubarptr);
+  VecRestoreArrayRead(vbar, &vbarptr);
+  VecRestoreArrayRead(ughost, &ughostptr);
+  VecRestoreArrayRead(vghost, &vghostptr);
+
+  /* Loop over oscillators */
+  int iform = 0;
+  for (int iosc= 0; iosc < noscillators; iosc++){
 
     // Derivative of transfer functions u^k_i(p), v^k_i(q) for all control terms i=0,..., ncontrol[k]-1
     std::vector<double> dukidp;
     std::vector<double> dukidq;
     double p, q;
-    oscil_vec[iosc]->evalControl(t, &p, &q);  // Evaluates the B-spline basis functions -> p(t,alpha), q(t,alpha)
+    getControl(t, iosc, &p, &q);  // p(t,alpha), q(t,alpha) from the control table
     for (int icon=0; icon<Bc_vec[iosc].size(); icon++){ // Now evaluate the derivative of transfer functions for each control term
       double dukidp_tmp = transfer_Hc_re[iosc][icon]->der(p, t); // dudp(p)
       dukidp.push_back(dukidp_tmp);
@@ -1269,29 +1651,21 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
     double vBubar = 0.0;
     double uBvbar = 0.0;
     for (int icon=0; icon<Ac_vec[iosc].size(); icon++){
-      double dot;
-      MatMult(Ac_vec[iosc][icon], u, aux); VecDot(aux, ubar, &dot); uAubar += dot * dukidq[icon];
-      MatMult(Ac_vec[iosc][icon], v, aux); VecDot(aux, vbar, &dot); vAvbar += dot * dukidq[icon];
+      uAubar += forms[iform++] * dukidq[icon];
+      vAvbar += forms[iform++] * dukidq[icon];
     }
     for (int icon=0; icon<Bc_vec[iosc].size(); icon++){
-      double dot;
-      MatMult(Bc_vec[iosc][icon], u, aux); VecDot(aux, vbar, &dot); uBvbar += dot * dukidp[icon];
-      MatMult(Bc_vec[iosc][icon], v, aux); VecDot(aux, ubar, &dot); vBubar += dot * dukidp[icon];
+      uBvbar += forms[iform++] * dukidp[icon];
+      vBubar += forms[iform++] * dukidp[icon];
     }
 
-    /* Number of parameters for this oscillator */
-    int nparams_iosc = getOscillator(iosc)->getNParams();
-
-    /* Set gradient terms for each control parameter */
-    for (int iparam=0; iparam < nparams_iosc; iparam++) {
-      vals[iparam] = alpha * ((uAubar + vAvbar) * dImdp[iparam] + ( -vBubar + uBvbar) * dRedp[iparam]);
-      cols[iparam] = col_shift + iparam;
-    }
-    VecSetValues(grad, nparams_iosc, cols, vals, ADD_VALUES);
-    col_shift += nparams_iosc;
+    /* Set gradient terms for each active control parameter */
+    addControlGradient(t, iosc, alpha * ( -vBubar + uBvbar), alpha * (uAubar + vAvbar), grad);
+  }
+  if (!dp_record) {
+    VecAssemblyBegin(grad);
+    VecAssemblyEnd(grad);
   }
-  VecAssemblyBegin(grad);
-  VecAssemblyEnd(grad);
 
   /* Restore x */
   VecRestoreSubVector(x, isu, &u);
@@ -1302,6 +1676,95 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
 
 }
 
+void MasterEq::computedRHSdp_MatMultTranspose(const double t, const Vec x, const Vec xbar, const double alpha, Vec grad, Vec y) {
+
+  /* The sparse-matrix solver has no common sweep */
+  if (!usematfree) {
+    computedRHSdp(t, x, xbar, alpha, grad);
+    MatMultTranspose(RHS, xbar, y);
+    return;
+  }
+
+  /* Let the transpose kernel accumulate the gradient coefficients while it sweeps over xbar */
+  const double* xptr;
+  VecGetArrayRead(x, &xptr);
+  std::vector<double> coeff_p(noscillators, 0.0);
+  std::vector<double> coeff_q(noscillators, 0.0);
+  RHSctx.dp_xptr = xptr;
+  RHSctx.dp_coeff_p = coeff_p.data();
+  RHSctx.dp_coeff_q = coeff_q.data();
+  MatMultTranspose(RHS, xbar, y);
+  RHSctx.dp_xptr = NULL;
+  RHSctx.dp_coeff_p = NULL;
+  RHSctx.dp_coeff_q = NULL;
+  VecRestoreArrayRead(x, &xptr);
+
+  /* Set the gradient values */
+  for (int iosc = 0; iosc < noscillators; iosc++){
+    addControlGradient(t, iosc, alpha * coeff_p[iosc], alpha * coeff_q[iosc], grad);
+  }
+  if (!dp_record) {
+    VecAssemblyBegin(grad);
+    VecAssemblyEnd(grad);
+  }
+}
+
+void MasterEq::addControlGradient(const double t, int iosc, const double coeff_p, const double coeff_q, Vec grad){
+
+  if (dp_record) {
+    ControlGradientSample sample = {t, iosc, coeff_p, coeff_q};
+    dp_series.push_back(sample);
+    return;
+  }
+
+  int shift = 0;
+  for (int i = 0; i < iosc; i++) shift += getOscillator(i)->getNParams();
+
+  oscil_vec[iosc]->evalControl_diff(t, dpids, dRedp, dImdp);
+  PetscInt nactive = dpids.size();
+  for (int i=0; i < nactive; i++) {
+    vals[i] = coeff_p * dRedp[i] + coeff_q * dImdp[i];
+    cols[i] = shift + dpids[i];
+  }
+  VecSetValues(grad, nactive, cols, vals, ADD_VALUES);
+}
+
+void MasterEq::startGradientSeries(){
+  dp_record = true;
+  dp_series.clear();
+}
+
+void MasterEq::finishGradientSeries(Vec grad){
+
+  dp_record = false;
+
+  /* Offsets of the oscillators' parameters */
+  std::vector<int> shift(noscillators, 0);
+  int ntotal = 0;
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    shift[iosc] = ntotal;
+    ntotal += getOscillator(iosc)->getNParams();
+  }
+
+  /* Transposed control basis map applied to the recorded series: grad_j += sum_n coeff_p(t_n) dp/dparam_j(t_n) + coeff_q(t_n) dq/dparam_j(t_n) */
+  std::vector<PetscScalar> gradloc(ntotal, 0.0);
+  for (int n = 0; n < dp_series.size(); n++) {
+    const ControlGradientSample& sample = dp_series[n];
+    oscil_vec[sample.iosc]->evalControl_diff(sample.time, dpids, dRedp, dImdp);
+    for (int i = 0; i < dpids.size(); i++) {
+      gradloc[shift[sample.iosc] + dpids[i]] += sample.coeff_p * dRedp[i] + sample.coeff_q * dImdp[i];
+    }
+  }
+  dp_series.clear();
+
+  std::vector<PetscInt> ids(ntotal);
+  for (int i = 0; i < ntotal; i++) ids[i] = i;
+  VecSetValues(grad, ntotal, ids.data(), gradloc.data(), ADD_VALUES);
+  VecAssemblyBegin(grad);
+  VecAssemblyEnd(grad);
+}
+
+
 void MasterEq::setControlAmplitudes(const Vec x) {
 
   const PetscScalar* ptr;
@@ -1316,6 +1779,134 @@ void MasterEq::setControlAmplitudes(const Vec x) {
     shift += getOscillator(ioscil)->getNParams();
   }
   VecRestoreArrayRead(x, &ptr);
+
+  /* Controls changed, reset the control table */
+  std::fill(control_filled.begin(), control_filled.end(), 0);
+}
+
+
+void MasterEq::setControlGrid(const int ntime, const double dt, const std::vector<double>& stagefrac){
+
+  /* Stage fractions modulo one time step, without duplicates. The grid points (c=0) are always included. */
+  std::vector<double> frac(1, 0.0);
+  for (int i = 0; i < stagefrac.size(); i++) {
+    double c = stagefrac[i] - floor(stagefrac[i]);
+    if (c > 1.0 - 1e-10) c = 0.0;
+    bool found = false;
+    for (int j = 0; j < frac.size(); j++) {
+      if (fabs(frac[j] - c) < 1e-10) found = true;
+    }
+    if (!found) frac.push_back(c);
+  }
+  if (control_table.size() > 0 && ntime == control_ntime && dt == control_dt && frac == control_stagefrac) return;
+
+  /* Set up the sample layout */
+  control_sample_offset.resize(noscillators);
+  control_sample_size = 0;
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    control_sample_offset[iosc] = control_sample_size;
+    control_sample_size += 2 + transfer_Hc_re[iosc].size() + transfer_Hc_im[iosc].size();
+  }
+  control_sample_size += transfer_Hdt_re.size() + transfer_Hdt_im.size();
+
+  /* Allocate the table, plus one scratch sample for times off the grid */
+  control_ntime = ntime;
+  control_dt = dt;
+  control_stagefrac = frac;
+  int nsamples = ntime > 0 ? (ntime+1) * control_stagefrac.size() : 0;
+  control_table.assign((nsamples+1) * control_sample_size, 0.0);
+  control_filled.assign(nsamples, 0);
+}
+
+
+int MasterEq::getControlSlot(const double t){
+  if (control_ntime == 0) return -1;
+
+  /* Find the time step n and stage fraction c_i with t = (n + c_i)*dt */
+  int nfrac = control_stagefrac.size();
+  for (int i = 0; i < nfrac; i++) {
+    double s = t / control_dt - control_stagefrac[i];
+    int n = (int) round(s);
+    if (fabs(s - n) < 1e-8 && n >= 0 && n <= control_ntime) return n*nfrac + i;
+  }
+  return -1;
+}
+
+
+int MasterEq::getControlSample(const double t){
+
+  /* Look up the sample on the grid */
+  int slot = getControlSlot(t);
+  if (slot >= 0 && control_filled[slot]) return slot * control_sample_size;
+
+  /* Evaluate controls at time t */
+  std::vector<double> p(noscillators), q(noscillators);
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    oscil_vec[iosc]->evalControl(t, &p[iosc], &q[iosc]);  // Evaluates the B-spline basis functions -> p(t,alpha), q(t,alpha)
+  }
+
+  /* No grid set: Only the scratch sample */
+  if (control_table.size() == 0) setControlGrid(0, 0.0, std::vector<double>());
+
+  /* Store on the grid, or in the scratch sample at the end of the table if t is off the grid */
+  int offset = slot >= 0 ? slot * control_sample_size : control_table.size() - control_sample_size;
+  setControlSample(t, p.data(), q.data(), control_table.data() + offset);
+  if (slot >= 0) control_filled[slot] = 1;
+  return offset;
+}
+
+
+void MasterEq::setControlSample(const double t, const double* p, const double* q, double* sample){
+
+  /* Store controls and evaluate transfer functions at time t */
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    double* s = sample + control_sample_offset[iosc];
+    s[0] = p[iosc];
+    s[1] = q[iosc];
+    s += 2;
+    // Transfer functions u^k_i(p) (Default: Identity. But could be different if python interface)
+    for (int icon=0; icon<transfer_Hc_re[iosc].size(); icon++) *(s++) = transfer_Hc_re[iosc][icon]->eval(p[iosc], t);
+    for (int icon=0; icon<transfer_Hc_im[iosc].size(); icon++) *(s++) = transfer_Hc_im[iosc][icon]->eval(q[iosc], t);
+  }
+  double* s = sample + control_sample_size - transfer_Hdt_re.size() - transfer_Hdt_im.size();
+  // Default trans_re = Jkl*cos(etakl*t), trans_im = Jkl*sin(etakl*t), or from python interface
+  for (int kl=0; kl<transfer_Hdt_re.size(); kl++) *(s++) = transfer_Hdt_re[kl]->eval(t, t);
+  for (int kl=0; kl<transfer_Hdt_im.size(); kl++) *(s++) = transfer_Hdt_im[kl]->eval(t, t);
+}
+
+
+void MasterEq::prefillControlTable(const int nt, const double* times, const double dt){
+
+  /* Nothing to do if this series is off the grid or has been filled already */
+  if (nt < 1) return;
+  int slot0 = getControlSlot(times[0]);
+  if (slot0 < 0 || control_filled[slot0]) return;
+
+  /* Evaluate the controls of each oscillator along the series */
+  std::vector<double> p(noscillators*nt), q(noscillators*nt);
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    oscil_vec[iosc]->evalControlGrid(nt, times, dt, &p[iosc*nt], &q[iosc*nt]);
+  }
+
+  /* Add the samples that are not yet in the table */
+  std::vector<double> pk(noscillators), qk(noscillators);
+  for (int k = 0; k < nt; k++) {
+    int slot = getControlSlot(times[k]);
+    if (slot < 0 || control_filled[slot]) continue;
+    for (int iosc = 0; iosc < noscillators; iosc++) {
+      pk[iosc] = p[iosc*nt + k];
+      qk[iosc] = q[iosc*nt + k];
+    }
+    setControlSample(times[k], pk.data(), qk.data(), control_table.data() + slot * control_sample_size);
+    control_filled[slot] = 1;
+  }
+}
+
+
+void MasterEq::getControl(const double t, int iosc, double* p, double* q){
+  int offset = getControlSample(t) + control_sample_offset[iosc];
+  *p = control_table[offset];
+  *q = control_table[offset + 1];
 }
 
 
@@ -1561,10 +2152,11 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
     n0p = 1; // Cut down so that below loop has i0p=0 and i1p=0/
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0p; i0p++)  {
       for (int i0 = 0; i0 < n0; i0++)  {
+          int it = TensorGetIndex(n0, i0, i0p);
 
           /* --- Diagonal part ---*/
           //Get input x values
@@ -1605,7 +2197,6 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
           /* Update */
           yptr[2*it]   = yre;
           yptr[2*it+1] = yim;
-          it++;
       }
   }
 
@@ -1630,6 +2221,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
 
+  /* If requested, accumulate the control gradient coefficients in the same sweep, see MasterEq::computedRHSdp_MatMultTranspose. The input x is then the adjoint state xbar. */
+  const double* dpxptr = shellctx->dp_xptr;
+  double* coeff_p = shellctx->dp_coeff_p;
+  double* coeff_q = shellctx->dp_coeff_q;
+  double res_p_re, res_p_im, res_q_re, res_q_im;
+  double dp_p[1] = {0.0};
+  double dp_q[1] = {0.0};
+
   /* Evaluate coefficients */
   double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
   double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
@@ -1652,10 +2251,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
     n0p = 1; // Cut down so that below loop has i0p=0 and i1p=0/
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(2) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:dp_p[:1], dp_q[:1])
   for (int i0p = 0; i0p < n0p; i0p++)  {
       for (int i0 = 0; i0 < n0; i0++)  {
+          int it = TensorGetIndex(n0, i0, i0p);
 
           /* --- Diagonal part ---*/
           //Get input x values
@@ -1694,13 +2294,27 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
           // Oscillator 0
           control_T(it, n0, i0, n0p, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
 
+          /* --- Control gradient coefficients --- */
+          if (dpxptr != NULL) {
+            dRHSdp_getcoeffs(it, n0, n0p, i0, i0p, stridei0, stridei0p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+            dp_p[0] += res_p_re * xre + res_p_im * xim;
+            dp_q[0] += res_q_re * xre + res_q_im * xim;
+          }
+
           /* Update */
           yptr[2*it]   = yre;
           yptr[2*it+1] = yim;
-          it++;
       }
   }
 
+  /* Add the gradient coefficients that were reduced over the threads */
+  if (dpxptr != NULL) {
+    for (int k = 0; k < 1; k++) {
+      coeff_p[k] += dp_p[k];
+      coeff_q[k] += dp_q[k];
+    }
+  }
+
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
@@ -1765,12 +2379,13 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
     n1p = 1;
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(4)
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i0 = 0; i0 < n0; i0++)  {
         for (int i1 = 0; i1 < n1; i1++)  {
+          int it = TensorGetIndex(n0,n1, i0, i1, i0p, i1p);
 
           /* --- Diagonal part ---*/
           //Get input x values
@@ -1820,7 +2435,6 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
           /* Update */
           yptr[2*it]   = yre;
           yptr[2*it+1] = yim;
-          it++;
         }
       }
     }
@@ -1848,6 +2462,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
 
+  /* If requested, accumulate the control gradient coefficients in the same sweep, see MasterEq::computedRHSdp_MatMultTranspose. The input x is then the adjoint state xbar. */
+  const double* dpxptr = shellctx->dp_xptr;
+  double* coeff_p = shellctx->dp_coeff_p;
+  double* coeff_q = shellctx->dp_coeff_q;
+  double res_p_re, res_p_im, res_q_re, res_q_im;
+  double dp_p[2] = {0.0};
+  double dp_q[2] = {0.0};
+
   /* Evaluate coefficients */
   double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
   double xi1  = shellctx->oscil_vec[1]->getSelfkerr();
@@ -1889,12 +2511,13 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
     n1p = 1;
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(4) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:dp_p[:2], dp_q[:2])
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i0 = 0; i0 < n0; i0++)  {
         for (int i1 = 0; i1 < n1; i1++)  {
+          int it = TensorGetIndex(n0,n1, i0, i1, i0p, i1p);
 
           /* --- Diagonal part ---*/
           //Get input x values
@@ -1941,15 +2564,32 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
           // Oscillator 1
           control_T(it, n1, i1, n1p, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
 
+          /* --- Control gradient coefficients --- */
+          if (dpxptr != NULL) {
+            dRHSdp_getcoeffs(it, n0, n0p, i0, i0p, stridei0, stridei0p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+            dp_p[0] += res_p_re * xre + res_p_im * xim;
+            dp_q[0] += res_q_re * xre + res_q_im * xim;
+            dRHSdp_getcoeffs(it, n1, n1p, i1, i1p, stridei1, stridei1p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+            dp_p[1] += res_p_re * xre + res_p_im * xim;
+            dp_q[1] += res_q_re * xre + res_q_im * xim;
+          }
+
           /* Update */
           yptr[2*it]   = yre;
           yptr[2*it+1] = yim;
-          it++;
         }
       }
     }
   }
 
+  /* Add the gradient coefficients that were reduced over the threads */
+  if (dpxptr != NULL) {
+    for (int k = 0; k < 2; k++) {
+      coeff_p[k] += dp_p[k];
+      coeff_q[k] += dp_q[k];
+    }
+  }
+
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
@@ -2030,14 +2670,15 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
     n2p = 1;
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(6)
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i2p = 0; i2p < n2p; i2p++)  {
         for (int i0 = 0; i0 < n0; i0++)  {
           for (int i1 = 0; i1 < n1; i1++)  {
             for (int i2 = 0; i2 < n2; i2++)  {
+              int it = TensorGetIndex(n0,n1,n2, i0, i1, i2, i0p, i1p, i2p);
 
               /* --- Diagonal part ---*/
               //Get input x values
@@ -2095,7 +2736,6 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
               /* --- Update --- */
               yptr[2*it]   = yre;
               yptr[2*it+1] = yim;
-              it++;
             }
           }
         }
@@ -2124,6 +2764,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
 
+  /* If requested, accumulate the control gradient coefficients in the same sweep, see MasterEq::computedRHSdp_MatMultTranspose. The input x is then the adjoint state xbar. */
+  const double* dpxptr = shellctx->dp_xptr;
+  double* coeff_p = shellctx->dp_coeff_p;
+  double* coeff_q = shellctx->dp_coeff_q;
+  double res_p_re, res_p_im, res_q_re, res_q_im;
+  double dp_p[3] = {0.0};
+  double dp_q[3] = {0.0};
+
 
   /* Evaluate coefficients */
   double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
@@ -2184,14 +2832,15 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
     n2p = 1;
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(6) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:dp_p[:3], dp_q[:3])
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i2p = 0; i2p < n2p; i2p++)  {
         for (int i0 = 0; i0 < n0; i0++)  {
           for (int i1 = 0; i1 < n1; i1++)  {
             for (int i2 = 0; i2 < n2; i2++)  {
+              int it = TensorGetIndex(n0,n1,n2, i0, i1, i2, i0p, i1p, i2p);
 
               /* --- Diagonal part ---*/
               //Get input x values
@@ -2247,10 +2896,22 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
               // Oscillator 2
               control_T(it, n2, i2, n2p, i2p, stridei2, stridei2p, xptr, pt2, qt2, &yre, &yim);
 
+              /* --- Control gradient coefficients --- */
+              if (dpxptr != NULL) {
+                dRHSdp_getcoeffs(it, n0, n0p, i0, i0p, stridei0, stridei0p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                dp_p[0] += res_p_re * xre + res_p_im * xim;
+                dp_q[0] += res_q_re * xre + res_q_im * xim;
+                dRHSdp_getcoeffs(it, n1, n1p, i1, i1p, stridei1, stridei1p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                dp_p[1] += res_p_re * xre + res_p_im * xim;
+                dp_q[1] += res_q_re * xre + res_q_im * xim;
+                dRHSdp_getcoeffs(it, n2, n2p, i2, i2p, stridei2, stridei2p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                dp_p[2] += res_p_re * xre + res_p_im * xim;
+                dp_q[2] += res_q_re * xre + res_q_im * xim;
+              }
+
               /* Update */
               yptr[2*it]   = yre;
               yptr[2*it+1] = yim;
-              it++;
             }
           }
         }
@@ -2258,6 +2919,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
     }
   }
 
+  /* Add the gradient coefficients that were reduced over the threads */
+  if (dpxptr != NULL) {
+    for (int k = 0; k < 3; k++) {
+      coeff_p[k] += dp_p[k];
+      coeff_q[k] += dp_q[k];
+    }
+  }
+
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
@@ -2367,8 +3036,8 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
     n3p = 1;
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(8)
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i2p = 0; i2p < n2p; i2p++)  {
@@ -2377,6 +3046,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
             for (int i1 = 0; i1 < n1; i1++)  {
               for (int i2 = 0; i2 < n2; i2++)  {
                 for (int i3 = 0; i3 < n3; i3++)  {
+                  int it = TensorGetIndex(n0,n1,n2,n3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
 
                   /* --- Diagonal part ---*/
                   double xre = xptr[2 * it];
@@ -2443,7 +3113,6 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
                   /* --- Update --- */
                   yptr[2*it]   = yre;
                   yptr[2*it+1] = yim;
-                  it++;
                 }
               }
             }
@@ -2475,6 +3144,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
 
+  /* If requested, accumulate the control gradient coefficients in the same sweep, see MasterEq::computedRHSdp_MatMultTranspose. The input x is then the adjoint state xbar. */
+  const double* dpxptr = shellctx->dp_xptr;
+  double* coeff_p = shellctx->dp_coeff_p;
+  double* coeff_q = shellctx->dp_coeff_q;
+  double res_p_re, res_p_im, res_q_re, res_q_im;
+  double dp_p[4] = {0.0};
+  double dp_q[4] = {0.0};
+
   /* Evaluate coefficients */
   double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
   double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
@@ -2562,8 +3239,8 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   }
 
 
-   /* Iterate over indices of output vector y */
-  int it = 0;
+   /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(8) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:dp_p[:4], dp_q[:4])
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i2p = 0; i2p < n2p; i2p++)  {
@@ -2572,6 +3249,7 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
             for (int i1 = 0; i1 < n1; i1++)  {
               for (int i2 = 0; i2 < n2; i2++)  {
                 for (int i3 = 0; i3 < n3; i3++)  {
+                  int it = TensorGetIndex(n0,n1,n2,n3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
                   double xre = xptr[2 * it];
                   double xim = xptr[2 * it + 1];
 
@@ -2636,10 +3314,25 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
                   // Oscillator 3
                   control_T(it, n3, i3, n3p, i3p, stridei3, stridei3p, xptr, pt3, qt3, &yre, &yim);
 
+                  /* --- Control gradient coefficients --- */
+                  if (dpxptr != NULL) {
+                    dRHSdp_getcoeffs(it, n0, n0p, i0, i0p, stridei0, stridei0p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                    dp_p[0] += res_p_re * xre + res_p_im * xim;
+                    dp_q[0] += res_q_re * xre + res_q_im * xim;
+                    dRHSdp_getcoeffs(it, n1, n1p, i1, i1p, stridei1, stridei1p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                    dp_p[1] += res_p_re * xre + res_p_im * xim;
+                    dp_q[1] += res_q_re * xre + res_q_im * xim;
+                    dRHSdp_getcoeffs(it, n2, n2p, i2, i2p, stridei2, stridei2p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                    dp_p[2] += res_p_re * xre + res_p_im * xim;
+                    dp_q[2] += res_q_re * xre + res_q_im * xim;
+                    dRHSdp_getcoeffs(it, n3, n3p, i3, i3p, stridei3, stridei3p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                    dp_p[3] += res_p_re * xre + res_p_im * xim;
+                    dp_q[3] += res_q_re * xre + res_q_im * xim;
+                  }
+
                   /* Update */
                   yptr[2*it]   = yre;
                   yptr[2*it+1] = yim;
-                  it++;
                 }
               }
             }
@@ -2649,6 +3342,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
     }
   }
 
+  /* Add the gradient coefficients that were reduced over the threads */
+  if (dpxptr != NULL) {
+    for (int k = 0; k < 4; k++) {
+      coeff_p[k] += dp_p[k];
+      coeff_q[k] += dp_q[k];
+    }
+  }
+
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
@@ -2789,8 +3490,8 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
     n4p = 1;
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(10)
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i2p = 0; i2p < n2p; i2p++)  {
@@ -2801,6 +3502,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
                 for (int i2 = 0; i2 < n2; i2++)  {
                   for (int i3 = 0; i3 < n3; i3++)  {
                     for (int i4 = 0; i4 < n4; i4++)  {
+                      int it = TensorGetIndex(n0,n1,n2,n3,n4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
 
                       /* --- Diagonal part ---*/
                       double xre = xptr[2 * it];
@@ -2879,7 +3581,6 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
                       /* --- Update --- */
                       yptr[2*it]   = yre;
                       yptr[2*it+1] = yim;
-                      it++;
                     }
                   }
                 }
@@ -2913,6 +3614,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
 
+  /* If requested, accumulate the control gradient coefficients in the same sweep, see MasterEq::computedRHSdp_MatMultTranspose. The input x is then the adjoint state xbar. */
+  const double* dpxptr = shellctx->dp_xptr;
+  double* coeff_p = shellctx->dp_coeff_p;
+  double* coeff_q = shellctx->dp_coeff_q;
+  double res_p_re, res_p_im, res_q_re, res_q_im;
+  double dp_p[5] = {0.0};
+  double dp_q[5] = {0.0};
+
   /* Evaluate coefficients */
   double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
   double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
@@ -3031,8 +3740,8 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
     n4p = 1;
   }
 
-  /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y. The iterations are independent and may be shared among OpenMP threads. */
+  #pragma omp parallel for collapse(10) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:dp_p[:5], dp_q[:5])
   for (int i0p = 0; i0p < n0p; i0p++)  {
     for (int i1p = 0; i1p < n1p; i1p++)  {
       for (int i2p = 0; i2p < n2p; i2p++)  {
@@ -3043,6 +3752,7 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
                 for (int i2 = 0; i2 < n2; i2++)  {
                   for (int i3 = 0; i3 < n3; i3++)  {
                     for (int i4 = 0; i4 < n4; i4++)  {
+                      int it = TensorGetIndex(n0,n1,n2,n3,n4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
 
                       double xre = xptr[2 * it];
                       double xim = xptr[2 * it + 1];
@@ -3119,10 +3829,28 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
                       // Oscillator 4
                       control_T(it, n4, i4, n4p, i4p, stridei4, stridei4p, xptr, pt4, qt4, &yre, &yim);
 
+                      /* --- Control gradient coefficients --- */
+                      if (dpxptr != NULL) {
+                        dRHSdp_getcoeffs(it, n0, n0p, i0, i0p, stridei0, stridei0p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                        dp_p[0] += res_p_re * xre + res_p_im * xim;
+                        dp_q[0] += res_q_re * xre + res_q_im * xim;
+                        dRHSdp_getcoeffs(it, n1, n1p, i1, i1p, stridei1, stridei1p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                        dp_p[1] += res_p_re * xre + res_p_im * xim;
+                        dp_q[1] += res_q_re * xre + res_q_im * xim;
+                        dRHSdp_getcoeffs(it, n2, n2p, i2, i2p, stridei2, stridei2p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                        dp_p[2] += res_p_re * xre + res_p_im * xim;
+                        dp_q[2] += res_q_re * xre + res_q_im * xim;
+                        dRHSdp_getcoeffs(it, n3, n3p, i3, i3p, stridei3, stridei3p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                        dp_p[3] += res_p_re * xre + res_p_im * xim;
+                        dp_q[3] += res_q_re * xre + res_q_im * xim;
+                        dRHSdp_getcoeffs(it, n4, n4p, i4, i4p, stridei4, stridei4p, dpxptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                        dp_p[4] += res_p_re * xre + res_p_im * xim;
+                        dp_q[4] += res_q_re * xre + res_q_im * xim;
+                      }
+
                       /* Update */
                       yptr[2*it]   = yre;
                       yptr[2*it+1] = yim;
-                      it++;
                     }
                   }
                 }
@@ -3134,6 +3862,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
     }
   }
 
+  /* Add the gradient coefficients that were reduced over the threads */
+  if (dpxptr != NULL) {
+    for (int k = 0; k < 5; k++) {
+      coeff_p[k] += dp_p[k];
+      coeff_q[k] += dp_q[k];
+    }
+  }
+
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
@@ -3143,91 +3879,57 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
 
 
-double MasterEq::expectedEnergy(const Vec x){
- 
-  PetscInt dim;
-  VecGetSize(x, &dim);
-  int dimmat = dim_rho; // N 
-
-  /* Get locally owned portion of x */
-  PetscInt ilow, iupp, idx_diag_re, idx_diag_im;
-  VecGetOwnershipRange(x, &ilow, &iupp);
-  double xdiag;
-
-  /* Iterate over diagonal elements to add up expected energy level */
-  double expected = 0.0;
-  for (int i=0; i<dimmat; i++) {
-    /* Get diagonal element in number operator */
-    int num_diag = i ;
-
-    /* Get diagonal element in rho (real) and sum up */
-    if (lindbladtype != LindbladType::NONE){ // Lindblad solver: += i * rho_ii
-      idx_diag_re = getIndexReal(getVecID(i,i,dimmat));
-      xdiag = 0.0;
-      if (ilow <= idx_diag_re && idx_diag_re < iupp) VecGetValues(x, 1, &idx_diag_re, &xdiag);
-      expected += num_diag * xdiag;
-    }
-    else { // Schoedinger solver: += i * | psi_i |^2
-      idx_diag_re = getIndexReal(i);
-      xdiag = 0.0;
-      if (ilow <= idx_diag_re && idx_diag_re < iupp) VecGetValues(x, 1, &idx_diag_re, &xdiag);
-      expected += num_diag * xdiag * xdiag;
-      idx_diag_im = getIndexImag(i);
-      xdiag = 0.0;
-      if (ilow <= idx_diag_im && idx_diag_im < iupp) VecGetValues(x, 1, &idx_diag_im, &xdiag);
-      expected += num_diag * xdiag * xdiag;
-    }
-  }
-  
-  /* Sum up from all Petsc processors */
-  double myexp = expected;
-  MPI_Allreduce(&myexp, &expected, 1, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
-
-  return expected;
-}
-
-
 void MasterEq::population(const Vec x, std::vector<double> &pop){
 
-  pop.clear();
-  for (int k=0; k<dim_rho; k++){
-    pop.push_back(0.0);
-  }
-  assert (pop.size() == dim_rho);
-
+  pop.assign(dim_rho, 0.0);
   std::vector<double> mypop(dim_rho, 0.0);
 
   /* Get locally owned portion of x */
   PetscInt ilow, iupp;
   VecGetOwnershipRange(x, &ilow, &iupp);
+  const PetscScalar* xptr;
+  VecGetArrayRead(x, &xptr);
 
-  /* Iterate over diagonal elements of the density matrix */
-  for (int idiag=0; idiag < dim_rho; idiag++) {
-    double popi = 0.0;
-    /* Get the diagonal element */
-    if (lindbladtype != LindbladType::NONE) { // Lindblad solver
-      PetscInt diagID = getIndexReal(getVecID(idiag, idiag, dim_rho));  // Position in vectorized rho
-      double val = 0.0;
-      if (ilow <= diagID && diagID < iupp)  VecGetValues(x, 1, &diagID, &val);
-      popi = val;
-    } else {
-      PetscInt diagID_re = getIndexReal(idiag);
-      PetscInt diagID_im = getIndexImag(idiag);
-      double val = 0.0;
-      if (ilow <= diagID_re && diagID_re < iupp)  VecGetValues(x, 1, &diagID_re, &val);
-      popi = val * val;
-      val = 0.0;
-      if (ilow <= diagID_im && diagID_im < iupp)  VecGetValues(x, 1, &diagID_im, &val);
-      popi += val * val;
-    }
-    mypop[idiag] = popi;
-  } 
+  if (lindbladtype != LindbladType::NONE) { // Lindblad solver: Real part of the diagonal elements rho_ii
+    /* Diagonal element i is stored at 2*i*(N+1). Iterate only over the local ones. */
+    PetscInt stride = getIndexReal(getVecID(1, 1, dim_rho));
+    for (PetscInt idiag = (ilow + stride - 1) / stride; idiag < dim_rho; idiag++) {
+      PetscInt diagID = idiag * stride;
+      if (diagID >= iupp) break;
+      mypop[idiag] = xptr[diagID - ilow];
+    }
+  } else { // Schroedinger solver: |psi_i|^2, summing real and imaginary part
+    for (PetscInt i = ilow; i < iupp; i++) {
+      mypop[i / 2] += xptr[i - ilow] * xptr[i - ilow];
+    }
+  }
+  VecRestoreArrayRead(x, &xptr);
 
   /* Gather poppulation from all Petsc processors */
-  for (int i=0; i<mypop.size(); i++) {pop[i] = mypop[i];}
   MPI_Allreduce(mypop.data(), pop.data(), dim_rho, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
 }
 
+
+void MasterEq::observables(const Vec x, std::vector<double> &pop_comp, std::vector<std::vector<double>> &pop_osc, std::vector<double> &expected_osc, double* expected_comp){
+
+  population(x, pop_comp);
+
+  /* Expected energy level of the composite system: sum_i i * p_i */
+  *expected_comp = 0.0;
+  for (int i = 0; i < dim_rho; i++) *expected_comp += i * pop_comp[i];
+
+  /* Reduced system of oscillator k: Level of composite index i is (i / dim_postOsc) % nlevels */
+  pop_osc.resize(noscillators);
+  expected_osc.assign(noscillators, 0.0);
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    int nlev = oscil_vec[iosc]->getNLevels();
+    int dim_post = oscil_vec[iosc]->dim_postOsc;
+    pop_osc[iosc].assign(nlev, 0.0);
+    for (int i = 0; i < dim_rho; i++) pop_osc[iosc][(i / dim_post) % nlev] += pop_comp[i];
+    for (int l = 0; l < nlev; l++) expected_osc[iosc] += l * pop_osc[iosc][l];
+  }
+}
+
 /* --- 1 Oscillator cases --- */
 int myMatMult_matfree_1Osc(Mat RHS, Vec x, Vec y){
   /* Get the shell context */
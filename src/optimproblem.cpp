@@ -21,11 +21,43 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
   MPI_Comm_rank(comm_optim, &mpirank_optim);
   MPI_Comm_size(comm_optim, &mpisize_optim);
 
-  /* Store number of initial conditions per init-processor group */
-  ninit_local = ninit / mpisize_init; 
+  /* Store number of initial conditions per init-processor group. The first ninit % mpisize_init groups own one more. */
+  ninit_local = ninit / mpisize_init + (mpirank_init < ninit % mpisize_init ? 1 : 0);
+  ninit_offset = mpirank_init * (ninit / mpisize_init) + std::min(mpirank_init, ninit % mpisize_init);
+
+  /* Scheduling of the initial conditions in evalF and evalGradF: Fixed blocks per processor group ("static"), or handed out one by one to the next free group ("dynamic") */
+  std::string schedule_str = config.GetStrParam("initcond_schedule", "static", true, false);
+  if      (schedule_str.compare("static") == 0)  dynamic_init = false;
+  else if (schedule_str.compare("dynamic") == 0) dynamic_init = true;
+  else {
+    if (mpirank_world == 0) printf("ERROR: Unknown initial condition schedule %s. Choose 'static' or 'dynamic'.\n", schedule_str.c_str());
+    exit(1);
+  }
+  init_epoch = 0;
+  if (dynamic_init) {
+    /* Shared counter of handed out initial conditions, located on the first processor group. Only the group leaders access it, and broadcast to the members of their group. */
+    MPI_Win_allocate(mpirank_init == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, comm_init, &init_counter, &init_win);
+    if (mpirank_init == 0) {
+      MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, init_win);
+      *init_counter = 0;
+      MPI_Win_unlock(0, init_win);
+    }
+    MPI_Barrier(comm_init);
+    MPI_Comm_split(MPI_COMM_WORLD, mpirank_init, mpirank_world, &comm_group);
+  }
+
+  /* Multiple shooting over the time windows of the time-parallel communicator */
+  multipleshooting = config.GetBoolParam("optim_multipleshooting", false, false);
+  gamma_shooting = config.GetDoubleParam("optim_shooting_penalty", 1.0, false);
+  obj_penal_shooting = 0.0;
+  if (multipleshooting && timestepper->adaptive) {
+    printf("ERROR: Multiple shooting can not be combined with adaptive time stepping.\n");
+    exit(1);
+  }
+  timestepper->multipleshooting = multipleshooting;
 
   /*  If Schroedingers solver, allocate storage for the final states at time T for each initial condition. Schroedinger's solver does not store the time-trajectories during forward ODE solve, but instead recomputes the primal states during the adjoint solve. Therefore we need to store the terminal condition for the backwards primal solve. Be aware that the final states stored here will be overwritten during backwards computation!! */
-  if (timestepper->mastereq->lindbladtype == LindbladType::NONE) {
+  if (timestepper->mastereq->lindbladtype == LindbladType::NONE || multipleshooting) {
     for (int i = 0; i < ninit_local; i++) {
       Vec state;
       VecCreate(PETSC_COMM_WORLD, &state);
@@ -40,8 +72,15 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
   for (int ioscil = 0; ioscil < timestepper->mastereq->getNOscillators(); ioscil++) {
       n += timestepper->mastereq->getOscillator(ioscil)->getNParams(); 
   }
+  ncontrol = n;
   ndesign = n;
-  if (mpirank_world == 0 && !quietmode) std::cout<< "Number of control parameters: " << ndesign << std::endl;
+  if (mpirank_world == 0 && !quietmode) std::cout<< "Number of control parameters: " << ncontrol << std::endl;
+
+  /* Multiple shooting: Append the initial states of the time windows 1,...,W-1 for each initial condition */
+  if (multipleshooting) {
+    ndesign += ninit * (mpisize_optim - 1) * 2*timestepper->mastereq->getDim();
+    if (mpirank_world == 0 && !quietmode) std::cout<< "Number of multiple shooting states: " << ndesign - ncontrol << std::endl;
+  }
 
   /* Allocate the initial condition vector and adjoint terminal state */
   VecCreate(PETSC_COMM_WORLD, &rho_t0); 
@@ -77,15 +116,7 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
   double scaleweights = 0.0;
   for (int i=0; i<ninit; i++) scaleweights += obj_weights[i];
   for (int i=0; i<ninit; i++) obj_weights[i] = obj_weights[i] / scaleweights;
-  // Distribute over mpi_init processes 
-  double sendbuf[obj_weights.size()];
-  double recvbuf[obj_weights.size()];
-  for (int i = 0; i < obj_weights.size(); i++) sendbuf[i] = obj_weights[i];
-  for (int i = 0; i < obj_weights.size(); i++) recvbuf[i] = obj_weights[i];
-  int nscatter = ninit_local;
-  MPI_Scatter(sendbuf, nscatter, MPI_DOUBLE, recvbuf, nscatter,  MPI_DOUBLE, 0, comm_init);
-  for (int i = 0; i < nscatter; i++) obj_weights[i] = recvbuf[i];
-  for (int i=nscatter; i < obj_weights.size(); i++) obj_weights[i] = 0.0;
+  // All processors keep all weights, indexed by the global initial condition id
 
 
   /* Store other optimization parameters */
@@ -109,6 +140,37 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
     }
     gamma_penalty_dpdm = 0.0;
   }
+  if (gamma_penalty_dpdm > 1e-13 && timestepper->adaptive){
+    if (mpirank_world == 0) {
+      printf("Warning: Disabling DpDm penalty term because it is not implemented for adaptive time stepping.\n");
+    }
+    gamma_penalty_dpdm = 0.0;
+  }
+  if (gamma_penalty_dpdm > 1e-13 && multipleshooting){
+    if (mpirank_world == 0) {
+      printf("Warning: Disabling DpDm penalty term because it is not implemented for multiple shooting.\n");
+    }
+    gamma_penalty_dpdm = 0.0;
+  }
+
+  /* Batched propagation: Each processor group propagates all its initial conditions together as columns of one dense matrix, sharing one factorization per time step. */
+  batched = config.GetBoolParam("optim_batched", false, false);
+  if (batched) {
+    std::string err = "";
+    if (timestepper->mastereq->lindbladtype != LindbladType::NONE) err = "the Schroedinger solver";
+    else if (config.GetStrParam("timestepper", "IMR", false, false).compare("IMR") != 0) err = "timestepper IMR";
+    else if (config.GetStrParam("linearsolver_type", "gmres", false, false).compare("lu") != 0) err = "linearsolver_type lu";
+    else if (!timestepper->mastereq->isPiecewiseConstant()) err = "spline0 controls with zero carrier frequencies and no time-dependent dipole-dipole coupling (otherwise each time step factorizes a new dense matrix)";
+    else if (timestepper->adaptive) err = "a fixed time step size";
+    else if (mpisize_optim > 1) err = "no time-parallel processors";
+    else if (dynamic_init) err = "initcond_schedule static";
+    else if (timestepper->mastereq->dressedbasis) err = "propagation in the standard basis";
+    else if (gamma_penalty > 1e-13 || gamma_penalty_dpdm > 1e-13) err = "optim_penalty = 0 and optim_penalty_dpdm = 0";
+    if (err.size() > 0) {
+      if (mpirank_world == 0) printf("ERROR: Batched propagation (optim_batched) requires %s.\n", err.c_str());
+      exit(1);
+    }
+  }
 
   /* Pass information on objective function to the time stepper needed for penalty objective function */
   timestepper->penalty_param = penalty_param;
@@ -148,6 +210,11 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
       col = col + timestepper->mastereq->getOscillator(iosc)->getNSegParams(iseg);
     }
   }
+  // No bounds on the multiple shooting states
+  for (int i = ncontrol; i < ndesign; i++) {
+    VecSetValue(xupper, i, 1e+10, INSERT_VALUES);
+    VecSetValue(xlower, i, -1e+10, INSERT_VALUES);
+  }
   VecAssemblyBegin(xlower); VecAssemblyEnd(xlower);
   VecAssemblyBegin(xupper); VecAssemblyEnd(xupper);
 
@@ -156,15 +223,49 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
   config.GetVecStrParam("control_initialization0", controlinit_str, "constant, 0.0");
   if ( controlinit_str.size() > 0 && controlinit_str[0].compare("file") == 0 ) {
     assert(controlinit_str.size() >=2);
-    for (int i=0; i<ndesign; i++) initguess_fromfile.push_back(0.0);
-    if (mpirank_world == 0) read_vector(controlinit_str[1].c_str(), initguess_fromfile.data(), ndesign, quietmode);
-    MPI_Bcast(initguess_fromfile.data(), ndesign, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    for (int i=0; i<ncontrol; i++) initguess_fromfile.push_back(0.0);
+    if (mpirank_world == 0) read_vector(controlinit_str[1].c_str(), initguess_fromfile.data(), ncontrol, quietmode);
+    MPI_Bcast(initguess_fromfile.data(), ncontrol, MPI_DOUBLE, 0, MPI_COMM_WORLD);
   }
  
+  /* Optimizer type: Quasi-Newton (default), or bounded Newton-Krylov with Hessian-vector products */
+  std::string optim_type = config.GetStrParam("optim_type", "BQNLS", true, false);
+  newton = false;
+  if (optim_type.compare("BNLS") == 0 || optim_type.compare("BNTR") == 0) newton = true;
+  else if (optim_type.compare("BQNLS") != 0) {
+    printf("ERROR: Unknown optimizer type %s. Choose BQNLS, BNLS or BNTR.\n", optim_type.c_str());
+    exit(1);
+  }
+  hess_eps = config.GetDoubleParam("optim_hessian_eps", 1e-6, false);
+  std::string hess_fd = config.GetStrParam("optim_hessian_fd", "forward", true, false);
+  if (hess_fd.compare("central") == 0) hess_central = true;
+  else if (hess_fd.compare("forward") == 0) hess_central = false;
+  else {
+    printf("ERROR: Unknown finite-difference type for the Hessian %s. Choose forward or central.\n", hess_fd.c_str());
+    exit(1);
+  }
+  hess_set = false;
+
+  /* Gauss-Newton / Levenberg-Marquardt Hessian for the least-squares objective Jfrobenius */
+  gaussnewton = config.GetBoolParam("optim_gaussnewton", false, false);
+  lm_damping = config.GetDoubleParam("optim_lm_damping", 0.0, false);
+  if (gaussnewton) {
+    if (!newton) {
+      printf("ERROR: Gauss-Newton requires a Newton-Krylov optimizer. Set optim_type to BNLS or BNTR.\n");
+      exit(1);
+    }
+    if (optim_target->getObjectiveType() != ObjectiveType::JFROBENIUS || multipleshooting) {
+      printf("ERROR: Gauss-Newton is only available for the objective Jfrobenius, without multiple shooting.\n");
+      exit(1);
+    }
+  }
+
   /* Create Petsc's optimization solver */
   TaoCreate(PETSC_COMM_WORLD, &tao);
   /* Set optimization type and parameters */
-  TaoSetType(tao,TAOBQNLS);         // Optim type: taoblmvm vs BQNLS ??
+  if (optim_type.compare("BNLS") == 0)      TaoSetType(tao, TAOBNLS);
+  else if (optim_type.compare("BNTR") == 0) TaoSetType(tao, TAOBNTR);
+  else                                      TaoSetType(tao,TAOBQNLS);         // Optim type: taoblmvm vs BQNLS ??
   TaoSetMaximumIterations(tao, maxiter);
   TaoSetTolerances(tao, gatol, PETSC_DEFAULT, grtol);
   TaoSetMonitor(tao, TaoMonitor, (void*)this, NULL);
@@ -185,6 +286,25 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
   VecCreateSeq(PETSC_COMM_SELF, ndesign, &xtmp);
   VecSetFromOptions(xtmp);
   VecZeroEntries(xtmp);
+
+  /* Cache of the last evaluation */
+  VecDuplicate(xtmp, &cache_x);
+  VecDuplicate(xtmp, &cache_G);
+  use_cache = true;
+  cache_F = false;
+  cache_G_valid = false;
+
+  /* Hessian MatShell for Newton-Krylov optimizers */
+  if (newton) {
+    VecDuplicate(xtmp, &hess_x);
+    VecDuplicate(xtmp, &hess_g);
+    VecDuplicate(xtmp, &hess_xpert);
+    if (hess_central) VecDuplicate(xtmp, &hess_gpert);
+    MatCreateShell(PETSC_COMM_SELF, ndesign, ndesign, ndesign, ndesign, (void*) this, &Hess);
+    MatShellSetOperation(Hess, MATOP_MULT, (void(*)(void)) HessianMult);
+    MatSetOption(Hess, MAT_SYMMETRIC, PETSC_TRUE);
+    TaoSetHessian(tao, Hess, Hess, TaoEvalHessian, (void*) this);
+  }
 }
 
 
@@ -198,10 +318,27 @@ OptimProblem::~OptimProblem() {
   VecDestroy(&xupper);
   VecDestroy(&xinit);
   VecDestroy(&xtmp);
+  VecDestroy(&cache_x);
+  VecDestroy(&cache_G);
 
   for (int i = 0; i < store_finalstates.size(); i++) {
     VecDestroy(&(store_finalstates[i]));
   }
+  if (gn_dstates.size() > 0) VecDestroy(&gn_finalstate);
+  for (int i = 0; i < gn_dstates.size(); i++) {
+    VecDestroy(&(gn_dstates[i]));
+  }
+  if (dynamic_init) {
+    MPI_Win_free(&init_win);
+    MPI_Comm_free(&comm_group);
+  }
+  if (newton) {
+    VecDestroy(&hess_x);
+    VecDestroy(&hess_g);
+    VecDestroy(&hess_xpert);
+    if (hess_central) VecDestroy(&hess_gpert);
+    MatDestroy(&Hess);
+  }
 
   TaoDestroy(&tao);
 }
@@ -212,8 +349,29 @@ double OptimProblem::evalF(const Vec x) {
 
   MasterEq* mastereq = timestepper->mastereq;
 
+  /* Reuse the last evaluation at the same design, unless trajectory data is written */
+  if (!timestepper->writeDataFiles && lookupCache(x, NULL)) return objective;
+
+  /* Multiple shooting. The final evaluation that writes trajectory data solves sequentially in time. */
+  if (multipleshooting && !timestepper->writeDataFiles) {
+    evalShooting(x, NULL);
+    storeCache(x, NULL);
+    return objective;
+  }
+
+  /* Batched propagation. The final evaluation that writes trajectory data propagates one initial condition at a time. */
+  if (batched && !timestepper->writeDataFiles) {
+    evalBatched(x, NULL);
+    storeCache(x, NULL);
+    return objective;
+  }
+
   if (mpirank_world == 0 && !quietmode) printf("EVAL F... \n");
 
+  /* Only the objective is needed, don't store the primal states for the adjoint */
+  bool storeFWD = timestepper->storeFWD;
+  timestepper->storeFWD = false;
+
   /* Pass design vector x to oscillators */
   mastereq->setControlAmplitudes(x); 
 
@@ -229,34 +387,35 @@ double OptimProblem::evalF(const Vec x) {
   double obj_cost_im = 0.0;
   double fidelity_re = 0.0;
   double fidelity_im = 0.0;
-  for (int iinit = 0; iinit < ninit_local; iinit++) {
+  int iinit_global;
+  startInitialConditions();
+  for (int iinit = 0; (iinit_global = nextInitialCondition(iinit)) >= 0; iinit++) {
       
-    /* Prepare the initial condition in [rank * ninit_local, ... , (rank+1) * ninit_local - 1] */
-    int iinit_global = mpirank_init * ninit_local + iinit;
+    /* Prepare the initial condition that is assigned to this processor group */
     int initid = optim_target->prepareInitialState(iinit_global, ninit, timestepper->mastereq->nlevels, timestepper->mastereq->nessential, rho_t0);
     if (mpirank_optim == 0 && !quietmode) printf("%d: Initial condition id=%d ...\n", mpirank_init, initid);
 
     /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
-    optim_target->prepareTargetState(rho_t0);
+    optim_target->prepareTargetState(rho_t0, iinit_global);
 
     /* Run forward with initial condition initid */
     Vec finalstate = timestepper->solveODE(initid, rho_t0);
 
     /* Add to integral penalty term */
-    obj_penal += obj_weights[iinit] * gamma_penalty * timestepper->penalty_integral;
+    obj_penal += obj_weights[iinit_global] * gamma_penalty * timestepper->penalty_integral;
 
     /* Add to second derivative penalty term */
-    obj_penal_dpdm += obj_weights[iinit] * gamma_penalty_dpdm * timestepper->penalty_dpdm;
+    obj_penal_dpdm += obj_weights[iinit_global] * gamma_penalty_dpdm * timestepper->penalty_dpdm;
     
     /* Add to energy integral penalty term */
-    obj_penal_energy += obj_weights[iinit] * gamma_penalty_energy* timestepper->energy_penalty_integral;
+    obj_penal_energy += obj_weights[iinit_global] * gamma_penalty_energy* timestepper->energy_penalty_integral;
 
     /* Evaluate J(finalstate) and add to final-time cost */
     double obj_iinit_re = 0.0;
     double obj_iinit_im = 0.0;
     optim_target->evalJ(finalstate,  &obj_iinit_re, &obj_iinit_im);
-    obj_cost_re += obj_weights[iinit] * obj_iinit_re;
-    obj_cost_im += obj_weights[iinit] * obj_iinit_im;
+    obj_cost_re += obj_weights[iinit_global] * obj_iinit_re;
+    obj_cost_im += obj_weights[iinit_global] * obj_iinit_im;
 
     /* Add to final-time fidelity */
     double fidelity_iinit_re = 0.0;
@@ -265,7 +424,7 @@ double OptimProblem::evalF(const Vec x) {
     fidelity_re += 1./ ninit * fidelity_iinit_re;
     fidelity_im += 1./ ninit * fidelity_iinit_im;
 
-    // printf("%d, %d: iinit obj_iinit: %f * (%1.14e + i %1.14e, Overlap=%1.14e + i %1.14e\n", mpirank_world, mpirank_init, obj_weights[iinit], obj_iinit_re, obj_iinit_im, fidelity_iinit_re, fidelity_iinit_im);
+    // printf("%d, %d: iinit obj_iinit: %f * (%1.14e + i %1.14e, Overlap=%1.14e + i %1.14e\n", mpirank_world, mpirank_init, obj_weights[iinit_global], obj_iinit_re, obj_iinit_im, fidelity_iinit_re, fidelity_iinit_im);
   }
 
   /* Sum up from initial conditions processors */
@@ -295,15 +454,7 @@ double OptimProblem::evalF(const Vec x) {
   obj_cost = optim_target->finalizeJ(obj_cost_re, obj_cost_im);
 
   /* Evaluate Tikhonov regularization term: gamma/2 * ||x-x0||^2*/
-  double xnorm;
-  if (!gamma_tik_interpolate){  // ||x||^2
-    VecNorm(x, NORM_2, &xnorm);
-  } else {
-    VecCopy(x, xtmp);
-    VecAXPY(xtmp, -1.0, xinit);    // xtmp =  x - x_0
-    VecNorm(xtmp, NORM_2, &xnorm);
-  }
-  obj_regul = gamma_tik / 2. * pow(xnorm,2.0);
+  obj_regul = evalTikhonov(x);
 
   /* Evaluate penality term for control variation */
   double var_reg = 0.0;
@@ -321,6 +472,9 @@ double OptimProblem::evalF(const Vec x) {
     std::cout<< "Fidelity = " << fidelity  << std::endl;
   }
 
+  timestepper->storeFWD = storeFWD;
+  storeCache(x, NULL);
+
   return objective;
 }
 
@@ -330,6 +484,21 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
 
   MasterEq* mastereq = timestepper->mastereq;
 
+  /* Reuse the last evaluation at the same design */
+  if (lookupCache(x, G)) return;
+
+  if (multipleshooting) {
+    evalShooting(x, G);
+    storeCache(x, G);
+    return;
+  }
+
+  if (batched) {
+    evalBatched(x, G);
+    storeCache(x, G);
+    return;
+  }
+
   if (mpirank_world == 0 && !quietmode) std::cout<< "EVAL GRAD F... " << std::endl;
 
   /* Pass design vector x to oscillators */
@@ -370,14 +539,15 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   double obj_cost_im = 0.0;
   double fidelity_re = 0.0;
   double fidelity_im = 0.0;
-  for (int iinit = 0; iinit < ninit_local; iinit++) {
+  int iinit_global;
+  startInitialConditions();
+  for (int iinit = 0; (iinit_global = nextInitialCondition(iinit)) >= 0; iinit++) {
 
     /* Prepare the initial condition */
-    int iinit_global = mpirank_init * ninit_local + iinit;
     int initid = optim_target->prepareInitialState(iinit_global, ninit, timestepper->mastereq->nlevels, timestepper->mastereq->nessential, rho_t0);
 
     /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
-    optim_target->prepareTargetState(rho_t0);
+    optim_target->prepareTargetState(rho_t0, iinit_global);
 
     /* --- Solve primal --- */
     // if (mpirank_optim == 0) printf("%d: %d FWD. ", mpirank_init, initid);
@@ -385,23 +555,30 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
     /* Run forward with initial condition rho_t0 */
     Vec finalstate = timestepper->solveODE(initid, rho_t0);
 
-    /* Store the final state for the Schroedinger solver */
-    if (timestepper->mastereq->lindbladtype == LindbladType::NONE) VecCopy(finalstate, store_finalstates[iinit]);
+    /* Store the final state for the Schroedinger solver. With dynamic scheduling, a processor group may get more than ninit_local initial conditions. */
+    if (timestepper->mastereq->lindbladtype == LindbladType::NONE) {
+      if (iinit >= store_finalstates.size()) {
+        Vec state;
+        VecDuplicate(finalstate, &state);
+        store_finalstates.push_back(state);
+      }
+      VecCopy(finalstate, store_finalstates[iinit]);
+    }
 
     /* Add to integral penalty term */
-    obj_penal += obj_weights[iinit] * gamma_penalty * timestepper->penalty_integral;
+    obj_penal += obj_weights[iinit_global] * gamma_penalty * timestepper->penalty_integral;
 
     /* Add to second derivative dpdm integral penalty term */
-    obj_penal_dpdm += obj_weights[iinit] * gamma_penalty_dpdm * timestepper->penalty_dpdm;
+    obj_penal_dpdm += obj_weights[iinit_global] * gamma_penalty_dpdm * timestepper->penalty_dpdm;
     /* Add to energy integral penalty term */
-    obj_penal_energy += obj_weights[iinit] * gamma_penalty_energy * timestepper->energy_penalty_integral;
+    obj_penal_energy += obj_weights[iinit_global] * gamma_penalty_energy * timestepper->energy_penalty_integral;
 
     /* Evaluate J(finalstate) and add to final-time cost */
     double obj_iinit_re = 0.0;
     double obj_iinit_im = 0.0;
     optim_target->evalJ(finalstate,  &obj_iinit_re, &obj_iinit_im);
-    obj_cost_re += obj_weights[iinit] * obj_iinit_re;
-    obj_cost_im += obj_weights[iinit] * obj_iinit_im;
+    obj_cost_re += obj_weights[iinit_global] * obj_iinit_re;
+    obj_cost_im += obj_weights[iinit_global] * obj_iinit_im;
 
     /* Add to final-time fidelity */
     double fidelity_iinit_re = 0.0;
@@ -420,10 +597,10 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
       /* Terminal condition for adjoint variable: Derivative of final time objective J */
       double obj_cost_re_bar, obj_cost_im_bar;
       optim_target->finalizeJ_diff(obj_cost_re, obj_cost_im, &obj_cost_re_bar, &obj_cost_im_bar);
-      optim_target->evalJ_diff(finalstate, rho_t0_bar, obj_weights[iinit]*obj_cost_re_bar, obj_weights[iinit]*obj_cost_im_bar);
+      optim_target->evalJ_diff(finalstate, rho_t0_bar, obj_weights[iinit_global]*obj_cost_re_bar, obj_weights[iinit_global]*obj_cost_im_bar);
 
       /* Derivative of time-stepping */
-      timestepper->solveAdjointODE(initid, rho_t0_bar, finalstate, obj_weights[iinit] * gamma_penalty, obj_weights[iinit]*gamma_penalty_dpdm, obj_weights[iinit]*gamma_penalty_energy);
+      timestepper->solveAdjointODE(initid, rho_t0_bar, finalstate, obj_weights[iinit_global] * gamma_penalty, obj_weights[iinit_global]*gamma_penalty_dpdm, obj_weights[iinit_global]*gamma_penalty_energy);
 
       /* Add to optimizers's gradient */
       VecAXPY(G, 1.0, timestepper->redgrad);
@@ -458,15 +635,7 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   obj_cost = optim_target->finalizeJ(obj_cost_re, obj_cost_im);
 
   /* Evaluate Tikhonov regularization term += gamma/2 * ||x||^2*/
-  double xnorm;
-  if (!gamma_tik_interpolate){  // ||x||^2
-    VecNorm(x, NORM_2, &xnorm);
-  } else {
-    VecCopy(x, xtmp);
-    VecAXPY(xtmp, -1.0, xinit);    // xtmp =  x_k - x_0
-    VecNorm(xtmp, NORM_2, &xnorm);
-  }
-  obj_regul = gamma_tik / 2. * pow(xnorm,2.0);
+  obj_regul = evalTikhonov(x);
 
   /* Evaluate penalty term for control parameter variation */
   double var_reg = 0.0;
@@ -481,13 +650,13 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   /* For Schroedinger solver: Solve adjoint equations for all initial conditions here. */
   if (timestepper->mastereq->lindbladtype == LindbladType::NONE) {
 
-    // Iterate over all initial conditions 
-    for (int iinit = 0; iinit < ninit_local; iinit++) {
-      int iinit_global = mpirank_init * ninit_local + iinit;
+    // Iterate over the initial conditions that this processor group has propagated forward 
+    for (int iinit = 0; iinit < init_assigned.size(); iinit++) {
+      int iinit_global = init_assigned[iinit];
 
       /* Recompute the initial state and target */
       int initid = optim_target->prepareInitialState(iinit_global, ninit, timestepper->mastereq->nlevels, timestepper->mastereq->nessential, rho_t0);
-      optim_target->prepareTargetState(rho_t0);
+      optim_target->prepareTargetState(rho_t0, iinit_global);
      
       /* Reset adjoint */
       VecZeroEntries(rho_t0_bar);
@@ -495,10 +664,10 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
       /* Terminal condition for adjoint variable: Derivative of final time objective J */
       double obj_cost_re_bar, obj_cost_im_bar;
       optim_target->finalizeJ_diff(obj_cost_re, obj_cost_im, &obj_cost_re_bar, &obj_cost_im_bar);
-      optim_target->evalJ_diff(store_finalstates[iinit], rho_t0_bar, obj_weights[iinit]*obj_cost_re_bar, obj_weights[iinit]*obj_cost_im_bar);
+      optim_target->evalJ_diff(store_finalstates[iinit], rho_t0_bar, obj_weights[iinit_global]*obj_cost_re_bar, obj_weights[iinit_global]*obj_cost_im_bar);
 
       /* Derivative of time-stepping */
-      timestepper->solveAdjointODE(initid, rho_t0_bar, store_finalstates[iinit], obj_weights[iinit] * gamma_penalty, obj_weights[iinit]*gamma_penalty_dpdm, obj_weights[iinit]*gamma_penalty_energy);
+      timestepper->solveAdjointODE(initid, rho_t0_bar, store_finalstates[iinit], obj_weights[iinit_global] * gamma_penalty, obj_weights[iinit_global]*gamma_penalty_dpdm, obj_weights[iinit_global]*gamma_penalty_energy);
 
       /* Add to optimizers's gradient */
       VecAXPY(G, 1.0, timestepper->redgrad);
@@ -517,6 +686,8 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   /* Compute and store gradient norm */
   VecNorm(G, NORM_2, &(gnorm));
 
+  storeCache(x, G);
+
   /* Output */
   // if (mpirank_world == 0 && !quietmode) {
   //   std::cout<< "Objective = " << std::scientific<<std::setprecision(14) << obj_cost << " + " << obj_regul << " + " << obj_penal << " + " << obj_penal_dpdm << " + " << obj_penal_energy << " + " << obj_penal_variation << std::endl;
@@ -555,6 +726,9 @@ void OptimProblem::getStartingPoint(Vec xinit){
 
   /* Pass to oscillator */
   timestepper->mastereq->setControlAmplitudes(xinit);
+
+  /* Multiple shooting: Start from a continuous trajectory */
+  if (multipleshooting) initShootingStates(xinit);
   
   /* Write initial control functions to file */
   output->writeControls(xinit, timestepper->mastereq, timestepper->ntime, timestepper->dt);
@@ -570,6 +744,416 @@ void OptimProblem::getSolution(Vec* param_ptr){
   *param_ptr = params;
 }
 
+double OptimProblem::evalTikhonov(const Vec x){
+  const PetscScalar* xptr;
+  const PetscScalar* x0ptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(xinit, &x0ptr);
+  double xnorm2 = 0.0;
+  for (int i=0; i<ncontrol; i++) {
+    double xi = xptr[i];
+    if (gamma_tik_interpolate) xi -= x0ptr[i];  // x - x_0
+    xnorm2 += xi*xi;
+  }
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArrayRead(xinit, &x0ptr);
+
+  return gamma_tik / 2. * xnorm2;
+}
+
+int OptimProblem::getShootingIndex(int iinit_global, int window){
+  int dimstate = 2*timestepper->mastereq->getDim();
+  return ncontrol + (iinit_global * (mpisize_optim-1) + window-1) * dimstate;
+}
+
+void OptimProblem::getShootingState(const Vec x, int iinit_global, int window, Vec state){
+  PetscInt ilow, iupp;
+  const PetscScalar* xptr;
+  PetscScalar* sptr;
+  int shift = getShootingIndex(iinit_global, window);
+  VecGetOwnershipRange(state, &ilow, &iupp);
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(state, &sptr);
+  for (int i=ilow; i<iupp; i++) sptr[i-ilow] = xptr[shift + i];
+  VecRestoreArray(state, &sptr);
+  VecRestoreArrayRead(x, &xptr);
+}
+
+void OptimProblem::addShootingGrad(Vec G, int iinit_global, int window, const Vec state, double alpha){
+  PetscInt ilow, iupp;
+  const PetscScalar* sptr;
+  PetscScalar* gptr;
+  int shift = getShootingIndex(iinit_global, window);
+  VecGetOwnershipRange(state, &ilow, &iupp);
+  VecGetArrayRead(state, &sptr);
+  VecGetArray(G, &gptr);
+  for (int i=ilow; i<iupp; i++) gptr[shift + i] += alpha * sptr[i-ilow];
+  VecRestoreArray(G, &gptr);
+  VecRestoreArrayRead(state, &sptr);
+}
+
+
+void OptimProblem::initShootingStates(Vec x){
+
+  /* Reset the states. Each processor sets the window initial states that it owns, then sum up. */
+  PetscScalar* xptr;
+  VecGetArray(x, &xptr);
+  for (int i=ncontrol; i<ndesign; i++) xptr[i] = 0.0;
+  VecRestoreArray(x, &xptr);
+
+  /* Pipelined forward sweep through the time windows */
+  for (int iinit = 0; iinit < ninit_local; iinit++) {
+    int iinit_global = ninit_offset + iinit;
+    int initid = optim_target->prepareInitialState(iinit_global, ninit, timestepper->mastereq->nlevels, timestepper->mastereq->nessential, rho_t0);
+    if (mpirank_optim > 0) {
+      timestepper->recvState(rho_t0, mpirank_optim-1);
+      addShootingGrad(x, iinit_global, mpirank_optim, rho_t0, 1.0);
+    }
+    Vec endstate = timestepper->solveODEWindow(initid, rho_t0);
+    if (mpirank_optim < mpisize_optim-1) timestepper->sendState(endstate, mpirank_optim+1);
+  }
+
+  VecGetArray(x, &xptr);
+  MPI_Allreduce(MPI_IN_PLACE, xptr + ncontrol, ndesign - ncontrol, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  VecRestoreArray(x, &xptr);
+}
+
+
+double OptimProblem::evalBatched(const Vec x, Vec G){
+
+  MasterEq* mastereq = timestepper->mastereq;
+  ImplMidpoint* imr = (ImplMidpoint*) timestepper;
+  bool compute_gradient = G != NULL;
+
+  if (mpirank_world == 0 && !quietmode) {
+    if (compute_gradient) std::cout<< "EVAL GRAD F (batched)... " << std::endl;
+    else printf("EVAL F (batched)... \n");
+  }
+
+  /* Pass design vector x to oscillators */
+  mastereq->setControlAmplitudes(x); 
+
+  /* Derivative of regularization terms, add on one processor only */
+  if (compute_gradient) {
+    VecZeroEntries(G);
+    if (mpirank_init == 0) {
+      VecAXPY(G, gamma_tik, x);
+      if (gamma_tik_interpolate) VecAXPY(G, -1.0*gamma_tik, xinit);
+      double var_reg_bar = 0.5*gamma_penalty_variation;
+      int skip_to_oscillator = 0;
+      for (int iosc = 0; iosc < mastereq->getNOscillators(); iosc++){
+        Oscillator* osc = mastereq->getOscillator(iosc);
+        osc->evalControlVariationDiff(G, var_reg_bar, skip_to_oscillator);
+        skip_to_oscillator += osc->getNParams();
+      }
+    }
+  }
+
+  /* Initial states of this processor group are the columns of X */
+  PetscInt nlocal;
+  VecGetLocalSize(rho_t0, &nlocal);
+  Mat X;
+  MatCreateDense(PETSC_COMM_WORLD, nlocal, PETSC_DECIDE, 2*mastereq->getDim(), ninit_local, NULL, &X);
+  Vec col;
+  for (int iinit = 0; iinit < ninit_local; iinit++) {
+    optim_target->prepareInitialState(ninit_offset + iinit, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+    MatDenseGetColumnVecWrite(X, iinit, &col);
+    VecCopy(rho_t0, col);
+    MatDenseRestoreColumnVecWrite(X, iinit, &col);
+  }
+  MatAssemblyBegin(X, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(X, MAT_FINAL_ASSEMBLY);
+
+  /* Propagate all initial conditions */
+  imr->solveODEBlock(X);
+
+  /* Evaluate final-time cost and fidelity for each column */
+  obj_cost = 0.0;
+  obj_penal = 0.0;
+  obj_penal_dpdm = 0.0;
+  obj_penal_energy = 0.0;
+  fidelity = 0.0;
+  double obj_cost_re = 0.0;
+  double obj_cost_im = 0.0;
+  double fidelity_re = 0.0;
+  double fidelity_im = 0.0;
+  double wsum = 0.0;
+  for (int iinit = 0; iinit < ninit_local; iinit++) {
+    int iinit_global = ninit_offset + iinit;
+    optim_target->prepareInitialState(iinit_global, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+    optim_target->prepareTargetState(rho_t0, iinit_global);
+    wsum += obj_weights[iinit_global];
+
+    double obj_iinit_re = 0.0;
+    double obj_iinit_im = 0.0;
+    double fidelity_iinit_re = 0.0;
+    double fidelity_iinit_im = 0.0;
+    MatDenseGetColumnVecRead(X, iinit, &col);
+    optim_target->evalJ(col, &obj_iinit_re, &obj_iinit_im);
+    optim_target->HilbertSchmidtOverlap(col, false, &fidelity_iinit_re, &fidelity_iinit_im);
+    MatDenseRestoreColumnVecRead(X, iinit, &col);
+    obj_cost_re += obj_weights[iinit_global] * obj_iinit_re;
+    obj_cost_im += obj_weights[iinit_global] * obj_iinit_im;
+    fidelity_re += 1./ ninit * fidelity_iinit_re;
+    fidelity_im += 1./ ninit * fidelity_iinit_im;
+  }
+  /* The energy penalty only depends on the controls, hence it is the same for all columns */
+  obj_penal_energy = wsum * gamma_penalty_energy * timestepper->energy_penalty_integral;
+
+  /* Sum up from initial conditions processors */
+  double myvals[5] = {obj_penal_energy, obj_cost_re, obj_cost_im, fidelity_re, fidelity_im};
+  double vals[5];
+  MPI_Allreduce(myvals, vals, 5, MPI_DOUBLE, MPI_SUM, comm_init);
+  obj_penal_energy = vals[0];
+  obj_cost_re = vals[1];
+  obj_cost_im = vals[2];
+  fidelity_re = vals[3];
+  fidelity_im = vals[4];
+  fidelity = pow(fidelity_re, 2.0) + pow(fidelity_im, 2.0);
+
+  /* Finalize the objective function */
+  obj_cost = optim_target->finalizeJ(obj_cost_re, obj_cost_im);
+  obj_regul = evalTikhonov(x);
+  double var_reg = 0.0;
+  for (int iosc = 0; iosc < mastereq->getNOscillators(); iosc++){
+    var_reg += mastereq->getOscillator(iosc)->evalControlVariation();
+  }
+  obj_penal_variation = 0.5*gamma_penalty_variation*var_reg; 
+  objective = obj_cost + obj_regul + obj_penal + obj_penal_dpdm + obj_penal_energy + obj_penal_variation;
+
+  if (!compute_gradient && mpirank_world == 0 && !quietmode) {
+    std::cout<< "Objective = " << std::scientific<<std::setprecision(14) << obj_cost << " + " << obj_regul << " + " << obj_penal << " + " << obj_penal_dpdm << " + " << obj_penal_energy << " + " << obj_penal_variation << std::endl;
+    std::cout<< "Fidelity = " << fidelity  << std::endl;
+  }
+
+  /* Adjoint: Terminal conditions are the columns of Xbar, solved backwards together with the primal states */
+  if (compute_gradient) {
+    Mat Xbar;
+    MatDuplicate(X, MAT_DO_NOT_COPY_VALUES, &Xbar);
+    double obj_cost_re_bar, obj_cost_im_bar;
+    optim_target->finalizeJ_diff(obj_cost_re, obj_cost_im, &obj_cost_re_bar, &obj_cost_im_bar);
+    for (int iinit = 0; iinit < ninit_local; iinit++) {
+      int iinit_global = ninit_offset + iinit;
+      optim_target->prepareInitialState(iinit_global, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+      optim_target->prepareTargetState(rho_t0, iinit_global);
+
+      VecZeroEntries(rho_t0_bar);
+      MatDenseGetColumnVecRead(X, iinit, &col);
+      optim_target->evalJ_diff(col, rho_t0_bar, obj_weights[iinit_global]*obj_cost_re_bar, obj_weights[iinit_global]*obj_cost_im_bar);
+      MatDenseRestoreColumnVecRead(X, iinit, &col);
+      MatDenseGetColumnVecWrite(Xbar, iinit, &col);
+      VecCopy(rho_t0_bar, col);
+      MatDenseRestoreColumnVecWrite(Xbar, iinit, &col);
+    }
+    MatAssemblyBegin(Xbar, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(Xbar, MAT_FINAL_ASSEMBLY);
+
+    imr->solveAdjointODEBlock(X, Xbar, wsum*gamma_penalty_energy);
+    VecAXPY(G, 1.0, timestepper->redgrad);
+    MatDestroy(&Xbar);
+
+    /* Sum up the gradient from all initial condition processors */
+    PetscScalar* grad; 
+    VecGetArray(G, &grad);
+    for (int i=0; i<ndesign; i++) {
+      mygrad[i] = grad[i];
+    }
+    MPI_Allreduce(mygrad, grad, ndesign, MPI_DOUBLE, MPI_SUM, comm_init);
+    VecRestoreArray(G, &grad);
+    VecNorm(G, NORM_2, &(gnorm));
+  }
+
+  MatDestroy(&X);
+
+  return objective;
+}
+
+double OptimProblem::evalShooting(const Vec x, Vec G){
+
+  MasterEq* mastereq = timestepper->mastereq;
+  bool compute_gradient = G != NULL;
+  bool lastwindow = mpirank_optim == mpisize_optim-1;
+
+  if (mpirank_world == 0 && !quietmode) {
+    if (compute_gradient) std::cout<< "EVAL GRAD F (multiple shooting)... " << std::endl;
+    else printf("EVAL F (multiple shooting)... \n");
+  }
+
+  /* Pass design vector x to oscillators */
+  mastereq->setControlAmplitudes(x); 
+
+  /* Derivative of regularization terms, add on one processor only */
+  if (compute_gradient) {
+    VecZeroEntries(G);
+    if (mpirank_init == 0 && mpirank_optim == 0) {
+      PetscScalar* gptr;
+      const PetscScalar* xptr;
+      const PetscScalar* x0ptr;
+      VecGetArray(G, &gptr);
+      VecGetArrayRead(x, &xptr);
+      VecGetArrayRead(xinit, &x0ptr);
+      for (int i=0; i<ncontrol; i++) {
+        gptr[i] = gamma_tik * xptr[i];
+        if (gamma_tik_interpolate) gptr[i] -= gamma_tik * x0ptr[i];
+      }
+      VecRestoreArrayRead(xinit, &x0ptr);
+      VecRestoreArrayRead(x, &xptr);
+      VecRestoreArray(G, &gptr);
+
+      double var_reg_bar = 0.5*gamma_penalty_variation;
+      int skip_to_oscillator = 0;
+      for (int iosc = 0; iosc < mastereq->getNOscillators(); iosc++){
+        Oscillator* osc = mastereq->getOscillator(iosc);
+        osc->evalControlVariationDiff(G, var_reg_bar, skip_to_oscillator);
+        skip_to_oscillator += osc->getNParams();
+      }
+    }
+  }
+
+  /* Iterate over initial conditions, solving on the own time window only */
+  obj_cost = 0.0;
+  obj_penal = 0.0;
+  obj_penal_dpdm = 0.0;
+  obj_penal_energy = 0.0;
+  obj_penal_shooting = 0.0;
+  fidelity = 0.0;
+  double obj_cost_re = 0.0;
+  double obj_cost_im = 0.0;
+  double fidelity_re = 0.0;
+  double fidelity_im = 0.0;
+  for (int iinit = 0; iinit < ninit_local; iinit++) {
+    int iinit_global = ninit_offset + iinit;
+    int initid = optim_target->prepareInitialState(iinit_global, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+    optim_target->prepareTargetState(rho_t0, iinit_global);
+
+    /* Initial state of this window: rho(0) for the first window, otherwise an auxiliary design variable */
+    if (mpirank_optim > 0) getShootingState(x, iinit_global, mpirank_optim, rho_t0);
+
+    Vec endstate = timestepper->solveODEWindow(initid, rho_t0);
+    VecCopy(endstate, store_finalstates[iinit]);
+
+    /* Penalty integrals over the window */
+    obj_penal += obj_weights[iinit_global] * gamma_penalty * timestepper->penalty_integral;
+    obj_penal_energy += obj_weights[iinit_global] * gamma_penalty_energy * timestepper->energy_penalty_integral;
+
+    if (lastwindow) {
+      /* Final-time cost and fidelity */
+      double obj_iinit_re = 0.0;
+      double obj_iinit_im = 0.0;
+      optim_target->evalJ(endstate,  &obj_iinit_re, &obj_iinit_im);
+      obj_cost_re += obj_weights[iinit_global] * obj_iinit_re;
+      obj_cost_im += obj_weights[iinit_global] * obj_iinit_im;
+      double fidelity_iinit_re = 0.0;
+      double fidelity_iinit_im = 0.0;
+      optim_target->HilbertSchmidtOverlap(endstate, false, &fidelity_iinit_re, &fidelity_iinit_im);
+      fidelity_re += 1./ ninit * fidelity_iinit_re;
+      fidelity_im += 1./ ninit * fidelity_iinit_im;
+    } else {
+      /* Continuity penalty gamma/2 ||rho_w(T_w) - s_{w+1}||^2 */
+      double gap;
+      getShootingState(x, iinit_global, mpirank_optim+1, rho_t0_bar);
+      VecAYPX(rho_t0_bar, -1.0, endstate);
+      VecNorm(rho_t0_bar, NORM_2, &gap);
+      obj_penal_shooting += obj_weights[iinit_global] * gamma_shooting / 2. * pow(gap, 2.0);
+    }
+
+    /* If Lindblad solver, the adjoint needs the trajectory of this initial condition, so solve it right away */
+    if (compute_gradient && mastereq->lindbladtype != LindbladType::NONE) {
+      adjointShooting(x, G, iinit, initid, obj_cost_re, obj_cost_im);
+    }
+  }
+
+  /* Sum up from initial condition and time window processors */
+  double sendbuf[7] = {obj_penal, obj_penal_energy, obj_penal_shooting, obj_cost_re, obj_cost_im, fidelity_re, fidelity_im};
+  double recvbuf[7];
+  MPI_Allreduce(sendbuf, recvbuf, 7, MPI_DOUBLE, MPI_SUM, comm_init);
+  MPI_Allreduce(recvbuf, sendbuf, 7, MPI_DOUBLE, MPI_SUM, comm_optim);
+  obj_penal = sendbuf[0];
+  obj_penal_energy = sendbuf[1];
+  obj_penal_shooting = sendbuf[2];
+  obj_cost_re = sendbuf[3];
+  obj_cost_im = sendbuf[4];
+  fidelity_re = sendbuf[5];
+  fidelity_im = sendbuf[6];
+
+  if (mastereq->lindbladtype == LindbladType::NONE) {
+    fidelity = pow(fidelity_re, 2.0) + pow(fidelity_im, 2.0);
+  } else {
+    fidelity = fidelity_re; 
+  }
+  obj_cost = optim_target->finalizeJ(obj_cost_re, obj_cost_im);
+  obj_regul = evalTikhonov(x);
+  double var_reg = 0.0;
+  for (int iosc = 0; iosc < mastereq->getNOscillators(); iosc++){
+    var_reg += mastereq->getOscillator(iosc)->evalControlVariation();
+  }
+  obj_penal_variation = 0.5*gamma_penalty_variation*var_reg; 
+
+  objective = obj_cost + obj_regul + obj_penal + obj_penal_dpdm + obj_penal_energy + obj_penal_variation + obj_penal_shooting;
+
+  if (mpirank_world == 0 && !quietmode) {
+    std::cout<< "Objective = " << std::scientific<<std::setprecision(14) << obj_cost << " + " << obj_regul << " + " << obj_penal << " + " << obj_penal_dpdm << " + " << obj_penal_energy << " + " << obj_penal_variation << " + " << obj_penal_shooting << std::endl;
+    std::cout<< "Fidelity = " << fidelity  << std::endl;
+  }
+
+  if (!compute_gradient) return objective;
+
+  /* For Schroedinger solver: Solve the adjoint equations after the final-time cost is known */
+  if (mastereq->lindbladtype == LindbladType::NONE) {
+    for (int iinit = 0; iinit < ninit_local; iinit++) {
+      int iinit_global = ninit_offset + iinit;
+      int initid = optim_target->prepareInitialState(iinit_global, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+      optim_target->prepareTargetState(rho_t0, iinit_global);
+      adjointShooting(x, G, iinit, initid, obj_cost_re, obj_cost_im);
+    }
+  }
+
+  /* Sum up the gradient. The control gradient is replicated across the Petsc processors, the shooting states are distributed over all processors. */
+  PetscScalar* grad; 
+  VecGetArray(G, &grad);
+  MPI_Allreduce(MPI_IN_PLACE, grad, ncontrol, MPI_DOUBLE, MPI_SUM, comm_init);
+  MPI_Allreduce(MPI_IN_PLACE, grad, ncontrol, MPI_DOUBLE, MPI_SUM, comm_optim);
+  MPI_Allreduce(MPI_IN_PLACE, grad + ncontrol, ndesign - ncontrol, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  VecRestoreArray(G, &grad);
+
+  VecNorm(G, NORM_2, &(gnorm));
+
+  return objective;
+}
+
+
+void OptimProblem::adjointShooting(const Vec x, Vec G, int iinit, int initid, double obj_cost_re, double obj_cost_im){
+
+  int iinit_global = ninit_offset + iinit;
+
+  /* Terminal condition of the window adjoint: Derivative of the final-time cost, or of the continuity penalty */
+  VecZeroEntries(rho_t0_bar);
+  if (mpirank_optim == mpisize_optim-1) {
+    double obj_cost_re_bar, obj_cost_im_bar;
+    optim_target->finalizeJ_diff(obj_cost_re, obj_cost_im, &obj_cost_re_bar, &obj_cost_im_bar);
+    optim_target->evalJ_diff(store_finalstates[iinit], rho_t0_bar, obj_weights[iinit_global]*obj_cost_re_bar, obj_weights[iinit_global]*obj_cost_im_bar);
+  } else {
+    getShootingState(x, iinit_global, mpirank_optim+1, rho_t0_bar);
+    VecAYPX(rho_t0_bar, -1.0, store_finalstates[iinit]);
+    VecScale(rho_t0_bar, obj_weights[iinit_global] * gamma_shooting);
+    addShootingGrad(G, iinit_global, mpirank_optim+1, rho_t0_bar, -1.0);
+  }
+
+  /* Adjoint over the window */
+  Vec xbar_start = timestepper->solveAdjointODEWindow(initid, rho_t0_bar, obj_weights[iinit_global] * gamma_penalty, obj_weights[iinit_global]*gamma_penalty_energy);
+
+  /* Add to the control gradient, and to the gradient of the window initial state */
+  PetscScalar* gptr;
+  const PetscScalar* rptr;
+  VecGetArray(G, &gptr);
+  VecGetArrayRead(timestepper->redgrad, &rptr);
+  for (int i=0; i<ncontrol; i++) gptr[i] += rptr[i];
+  VecRestoreArrayRead(timestepper->redgrad, &rptr);
+  VecRestoreArray(G, &gptr);
+  if (mpirank_optim > 0) addShootingGrad(G, iinit_global, mpirank_optim, xbar_start, 1.0);
+}
+
+
 PetscErrorCode TaoMonitor(Tao tao,void*ptr){
   OptimProblem* ctx = (OptimProblem*) ptr;
 
@@ -669,6 +1253,248 @@ PetscErrorCode TaoEvalGradient(Tao tao, Vec x, Vec G, void*ptr){
 
   OptimProblem* ctx = (OptimProblem*) ptr;
   ctx->evalGradF(x, G);
+  ctx->setHessianPoint(x, G);
   
   return 0;
 }
+
+
+PetscErrorCode TaoEvalHessian(Tao tao, Vec x, Mat H, Mat Hpre, void*ptr){
+
+  /* The Hessian is applied matrix-free, only the linearization point is set here. */
+  OptimProblem* ctx = (OptimProblem*) ptr;
+  ctx->setHessianPoint(x, NULL);
+
+  return 0;
+}
+
+
+PetscErrorCode HessianMult(Mat H, Vec v, Vec Hv){
+
+  OptimProblem* ctx;
+  MatShellGetContext(H, (void**) &ctx);
+  ctx->evalHessVecFD(v, Hv);
+
+  return 0;
+}
+
+
+void OptimProblem::startInitialConditions(){
+  init_assigned.clear();
+  init_epoch++;
+}
+
+
+int OptimProblem::nextInitialCondition(int iinit){
+
+  int iinit_global = -1;
+
+  if (!dynamic_init) {
+    if (iinit < ninit_local) iinit_global = ninit_offset + iinit;
+  } else {
+    /* The group leader fetches the next id from the shared counter. Each group reads past the end exactly once per loop, hence the counter advances by ninit + mpisize_init in each loop. */
+    int mpirank_group;
+    MPI_Comm_rank(comm_group, &mpirank_group);
+    if (mpirank_group == 0) {
+      int one = 1;
+      int ticket;
+      MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, init_win);
+      MPI_Fetch_and_op(&one, &ticket, MPI_INT, 0, 0, MPI_SUM, init_win);
+      MPI_Win_unlock(0, init_win);
+      int id = ticket - (init_epoch-1) * (ninit + mpisize_init);
+      if (id < ninit) iinit_global = id;
+    }
+    MPI_Bcast(&iinit_global, 1, MPI_INT, 0, comm_group);
+  }
+
+  if (iinit_global >= 0) init_assigned.push_back(iinit_global);
+  return iinit_global;
+}
+
+
+void OptimProblem::getObjectiveTerms(std::vector<double>& terms){
+  terms = {objective, obj_cost, obj_regul, obj_penal, obj_penal_dpdm, obj_penal_variation, obj_penal_energy, obj_penal_shooting, fidelity, gnorm};
+}
+
+
+void OptimProblem::setObjectiveTerms(const std::vector<double>& terms){
+  objective = terms[0];
+  obj_cost = terms[1];
+  obj_regul = terms[2];
+  obj_penal = terms[3];
+  obj_penal_dpdm = terms[4];
+  obj_penal_variation = terms[5];
+  obj_penal_energy = terms[6];
+  obj_penal_shooting = terms[7];
+  fidelity = terms[8];
+  gnorm = terms[9];
+}
+
+
+bool OptimProblem::lookupCache(const Vec x, Vec G){
+
+  if (!use_cache || !cache_F) return false;
+  if (G != NULL && !cache_G_valid) return false;
+
+  PetscBool same;
+  VecEqual(x, cache_x, &same);
+  if (!same) return false;
+
+  setObjectiveTerms(cache_terms);
+  if (G != NULL) VecCopy(cache_G, G);
+  return true;
+}
+
+
+void OptimProblem::storeCache(const Vec x, const Vec G){
+
+  if (!use_cache) return;
+
+  /* An objective-only evaluation at the cached design keeps the cached gradient */
+  PetscBool same = PETSC_FALSE;
+  if (G == NULL && cache_G_valid) VecEqual(x, cache_x, &same);
+  cache_G_valid = (G != NULL) || same;
+
+  VecCopy(x, cache_x);
+  if (G != NULL) VecCopy(G, cache_G);
+  getObjectiveTerms(cache_terms);
+  cache_F = true;
+}
+
+
+void OptimProblem::setHessianPoint(const Vec x, const Vec G){
+
+  if (!newton) return;
+
+  if (G != NULL) {
+    VecCopy(x, hess_x);
+    VecCopy(G, hess_g);
+    hess_set = true;
+    return;
+  }
+
+  /* Tao usually asks for the Hessian right after the gradient at the same point. Otherwise, evaluate the gradient. */
+  PetscBool same = PETSC_FALSE;
+  if (hess_set) VecEqual(x, hess_x, &same);
+  if (!same) {
+    VecCopy(x, hess_x);
+    evalGradF(hess_x, hess_g);
+    hess_set = true;
+  }
+}
+
+
+void OptimProblem::evalHessVecFD(const Vec v, Vec Hv){
+
+  double vnorm, xnorm;
+  VecNorm(v, NORM_2, &vnorm);
+  if (vnorm < 1e-30) {
+    VecZeroEntries(Hv);
+    return;
+  }
+  VecNorm(hess_x, NORM_2, &xnorm);
+  double h = hess_eps * std::max(1.0, xnorm) / vnorm;
+
+  if (gaussnewton) {
+    evalGaussNewtonVec(v, Hv, h);
+    return;
+  }
+
+  /* Keep the objective terms of the linearization point, they are reported by the monitor. Do not cache the perturbed evaluation. */
+  std::vector<double> terms;
+  getObjectiveTerms(terms);
+  use_cache = false;
+
+  /* Difference of adjoint gradients in direction v: Hv = (G(x + h v) - G(x)) / h, or (G(x + h v) - G(x - h v)) / 2h */
+  VecWAXPY(hess_xpert, h, v, hess_x);
+  evalGradF(hess_xpert, Hv);
+  if (hess_central) {
+    VecWAXPY(hess_xpert, -h, v, hess_x);
+    evalGradF(hess_xpert, hess_gpert);
+    VecAXPY(Hv, -1.0, hess_gpert);
+    VecScale(Hv, 1.0/(2.0*h));
+  } else {
+    VecAXPY(Hv, -1.0, hess_g);
+    VecScale(Hv, 1.0/h);
+  }
+
+  use_cache = true;
+  setObjectiveTerms(terms);
+}
+
+
+void OptimProblem::evalGaussNewtonVec(const Vec v, Vec Hv, double h){
+
+  MasterEq* mastereq = timestepper->mastereq;
+
+  /* Storage for the final-state sensitivities, and for the final state at x, which the adjoint solve needs separately from the time stepper's state vector */
+  if (gn_dstates.size() == 0) VecDuplicate(rho_t0, &gn_finalstate);
+  if (gn_dstates.size() < ninit_local) {
+    for (int iinit = gn_dstates.size(); iinit < ninit_local; iinit++) {
+      Vec state;
+      VecDuplicate(rho_t0, &state);
+      gn_dstates.push_back(state);
+    }
+  }
+
+  /* Hessian of the quadratic regularization terms (ADD ON ONE PROC ONLY!) */
+  VecZeroEntries(Hv);
+  if (mpirank_init == 0) {
+    VecAXPY(Hv, gamma_tik + lm_damping, v);
+    // The variation penalty is quadratic, its Hessian times v is its gradient at v
+    mastereq->setControlAmplitudes(v);
+    double var_reg_bar = 0.5*gamma_penalty_variation;
+    int skip_to_oscillator = 0;
+    for (int iosc = 0; iosc < mastereq->getNOscillators(); iosc++){
+      Oscillator* osc = mastereq->getOscillator(iosc);
+      osc->evalControlVariationDiff(Hv, var_reg_bar, skip_to_oscillator);
+      skip_to_oscillator += osc->getNParams();
+    }
+  }
+
+  /* Forward sensitivities of the final states in direction v. These are finite-difference approximations J_i v = (rho_i(x + h v) - rho_i(x)) / h, or (rho_i(x + h v) - rho_i(x - h v)) / 2h if central, not a linearized forward solve. Run all initial conditions at x + h v first. */
+  VecWAXPY(hess_xpert, h, v, hess_x);
+  mastereq->setControlAmplitudes(hess_xpert);
+  for (int iinit = 0; iinit < ninit_local; iinit++) {
+    int iinit_global = ninit_offset + iinit;
+    int initid = optim_target->prepareInitialState(iinit_global, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+    Vec finalstate = timestepper->solveODE(initid, rho_t0);
+    VecCopy(finalstate, gn_dstates[iinit]);
+  }
+  if (hess_central) {
+    VecWAXPY(hess_xpert, -h, v, hess_x);
+    mastereq->setControlAmplitudes(hess_xpert);
+    for (int iinit = 0; iinit < ninit_local; iinit++) {
+      int iinit_global = ninit_offset + iinit;
+      int initid = optim_target->prepareInitialState(iinit_global, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+      Vec finalstate = timestepper->solveODE(initid, rho_t0);
+      VecAXPY(gn_dstates[iinit], -1.0, finalstate);
+      VecScale(gn_dstates[iinit], obj_weights[iinit_global] / (2.0*h));
+    }
+  }
+
+  /* Then at x, and apply the transposed Jacobian through the adjoint with terminal condition w_i * J_i v */
+  mastereq->setControlAmplitudes(hess_x);
+  for (int iinit = 0; iinit < ninit_local; iinit++) {
+    int iinit_global = ninit_offset + iinit;
+    int initid = optim_target->prepareInitialState(iinit_global, ninit, mastereq->nlevels, mastereq->nessential, rho_t0);
+    Vec finalstate = timestepper->solveODE(initid, rho_t0);
+    VecCopy(finalstate, gn_finalstate);
+    if (!hess_central) {
+      VecAXPY(gn_dstates[iinit], -1.0, gn_finalstate);
+      VecScale(gn_dstates[iinit], obj_weights[iinit_global] / h);
+    }
+
+    timestepper->solveAdjointODE(initid, gn_dstates[iinit], gn_finalstate, 0.0, 0.0, 0.0);
+    VecAXPY(Hv, 1.0, timestepper->redgrad);
+  }
+
+  /* Sum up from all initial condition processors */
+  PetscScalar* hvptr; 
+  VecGetArray(Hv, &hvptr);
+  for (int i=0; i<ndesign; i++) {
+    mygrad[i] = hvptr[i];
+  }
+  MPI_Allreduce(mygrad, hvptr, ndesign, MPI_DOUBLE, MPI_SUM, comm_init);
+  VecRestoreArray(Hv, &hvptr);
+}
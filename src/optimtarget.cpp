@@ -1,5 +1,10 @@
 #include "optimtarget.hpp"
 
+/* Set the element with global storage index id in the local array ptr of a vector with ownership range [ilow, iupp). Elements owned by other processors are skipped. */
+static inline void setLocal(PetscScalar* ptr, PetscInt ilow, PetscInt iupp, PetscInt id, double val) {
+  if (ilow <= id && id < iupp) ptr[id - ilow] = val;
+}
+
 OptimTarget::OptimTarget(){
   dim = 0;
   dim_rho = 0;
@@ -65,6 +70,8 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
   /* Prepare initial state rho_t0 if PURE or FROMFILE or ENSEMBLE initialization. Otherwise they are set within prepareInitialState during evalF. */
   PetscInt ilow, iupp;
   VecGetOwnershipRange(rho_t0, &ilow, &iupp);
+  PetscScalar* ptr;
+  VecGetArray(rho_t0, &ptr);
   if (initcond_type == InitialConditionType::PURE) { 
     /* Initialize with tensor product of unit vectors. */
     if (initcond_IDs.size() != mastereq->getNOscillators()) {
@@ -88,7 +95,7 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
     int vec_id = -1;
     if (lindbladtype != LindbladType::NONE) vec_id = getIndexReal(getVecID( diag_id, diag_id, ndim )); // Real part of x
     else vec_id = getIndexReal(diag_id);
-    if (ilow <= vec_id && vec_id < iupp) VecSetValue(rho_t0, vec_id, 1.0, INSERT_VALUES);
+    setLocal(ptr, ilow, iupp, vec_id, 1.0);
   }
   else if (initcond_type == InitialConditionType::FROMFILE) { 
     /* Read initial condition from file */
@@ -112,8 +119,8 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
         }
         int elemid_re = getIndexReal(getVecID(k,j,dim_rho));
         int elemid_im = getIndexImag(getVecID(k,j,dim_rho));
-        if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, vec[i], INSERT_VALUES);        // RealPart
-        if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, vec[i + dim_ess*dim_ess], INSERT_VALUES); // Imaginary Part
+        setLocal(ptr, ilow, iupp, elemid_re, vec[i]);        // RealPart
+        setLocal(ptr, ilow, iupp, elemid_im, vec[i + dim_ess*dim_ess]); // Imaginary Part
       }
     } else { // Schroedinger solver, fill vector 
       for (int i = 0; i < dim_ess; i++) {
@@ -122,8 +129,8 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
           k = mapEssToFull(i, mastereq->nlevels, mastereq->nessential);
         int elemid_re = getIndexReal(k);
         int elemid_im = getIndexImag(k);
-        if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, vec[i], INSERT_VALUES);        // RealPart
-        if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, vec[i + dim_ess], INSERT_VALUES); // Imaginary Part
+        setLocal(ptr, ilow, iupp, elemid_re, vec[i]);        // RealPart
+        setLocal(ptr, ilow, iupp, elemid_im, vec[i + dim_ess]); // Imaginary Part
       }
     }
     delete [] vec;
@@ -159,23 +166,23 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
         if (i == j) { 
           // diagonal element: 1/N_sub
           int elemid_re = getIndexReal(getVecID(ifull, jfull, dimrho));
-          if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, 1./dimsub, INSERT_VALUES);
+          setLocal(ptr, ilow, iupp, elemid_re, 1./dimsub);
         } else {
           // upper diagonal (0.5 + 0.5*i) / (N_sub^2)
           int elemid_re = getIndexReal(getVecID(ifull, jfull, dimrho));
           int elemid_im = getIndexImag(getVecID(ifull, jfull, dimrho));
-          if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, 0.5/(dimsub*dimsub), INSERT_VALUES);
-          if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, 0.5/(dimsub*dimsub), INSERT_VALUES);
+          setLocal(ptr, ilow, iupp, elemid_re, 0.5/(dimsub*dimsub));
+          setLocal(ptr, ilow, iupp, elemid_im, 0.5/(dimsub*dimsub));
           // lower diagonal (0.5 - 0.5*i) / (N_sub^2)
           elemid_re = getIndexReal(getVecID(jfull, ifull, dimrho));
           elemid_im = getIndexImag(getVecID(jfull, ifull, dimrho));
-          if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re,  0.5/(dimsub*dimsub), INSERT_VALUES);
-          if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, -0.5/(dimsub*dimsub), INSERT_VALUES);
+          setLocal(ptr, ilow, iupp, elemid_re, 0.5/(dimsub*dimsub));
+          setLocal(ptr, ilow, iupp, elemid_im, -0.5/(dimsub*dimsub));
         } 
       }
     }
   }
-  VecAssemblyBegin(rho_t0); VecAssemblyEnd(rho_t0);
+  VecRestoreArray(rho_t0, &ptr);
 
   /* Get target type */  
   purestateID = -1;
@@ -252,6 +259,9 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
     if (mpirank_world == 0) 
       read_vector(target_filename.c_str(), vec, nelems, quietmode);
     MPI_Bcast(vec, nelems, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    PetscScalar* tptr;
+    VecZeroEntries(targetstate);
+    VecGetArray(targetstate, &tptr);
     if (lindbladtype != LindbladType::NONE) { // Lindblad solver, fill density matrix
       for (int i = 0; i < dim_ess*dim_ess; i++) { 
         int k = i % dim_ess;
@@ -262,8 +272,8 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
         }
         int elemid_re = getIndexReal(getVecID(k,j,dim_rho));
         int elemid_im = getIndexImag(getVecID(k,j,dim_rho));
-        if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(targetstate, elemid_re, vec[i],       INSERT_VALUES); // RealPart
-        if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(targetstate, elemid_im, vec[i + dim_ess*dim_ess], INSERT_VALUES); // Imaginary Part
+        setLocal(tptr, ilow, iupp, elemid_re, vec[i]); // RealPart
+        setLocal(tptr, ilow, iupp, elemid_im, vec[i + dim_ess*dim_ess]); // Imaginary Part
       }
     } else {  // Schroedinger solver, fill vector
       for (int i = 0; i < dim_ess; i++) {
@@ -272,11 +282,11 @@ OptimTarget::OptimTarget(std::vector<std::string> target_str, std::string object
           k = mapEssToFull(i, mastereq->nlevels, mastereq->nessential);
         int elemid_re = getIndexReal(k);
         int elemid_im = getIndexImag(k);
-        if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(targetstate, elemid_re, vec[i], INSERT_VALUES);        // RealPart
-        if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(targetstate, elemid_im, vec[i + dim_ess], INSERT_VALUES); // Imaginary Part
+        setLocal(tptr, ilow, iupp, elemid_re, vec[i]);        // RealPart
+        setLocal(tptr, ilow, iupp, elemid_im, vec[i + dim_ess]); // Imaginary Part
       }
     }
-    VecAssemblyBegin(targetstate); VecAssemblyEnd(targetstate);
+    VecRestoreArray(targetstate, &tptr);
     delete [] vec;
   }
 
@@ -434,26 +444,25 @@ int OptimTarget::prepareInitialState(const int iinit, const int ninit, std::vect
   int dim_post;
   int initID = 0;    // Output: ID for this initial condition */
 
+  /* All states are written directly into the locally owned part of rho0, so no assembly is needed. */
+  PetscScalar* ptr;
+  VecGetOwnershipRange(rho0, &ilow, &iupp);
+
   /* Switch over type of initial condition */
   switch (initcond_type) {
 
     case InitialConditionType::PERFORMANCE:
       /* Set up Input state psi = 1/sqrt(2N)*(Ones(N) + im*Ones(N)) or rho = psi*psi^\dag */
       VecZeroEntries(rho0);
-      VecGetOwnershipRange(rho0, &ilow, &iupp);
-      for (int i=0; i<dim_rho; i++){
-        if (lindbladtype == LindbladType::NONE) {
-          int elem_re = getIndexReal(i);
-          int elem_im = getIndexImag(i);
-          double val = 1./ sqrt(2.*dim_rho);
-          if (ilow <= elem_re && elem_re < iupp) VecSetValue(rho0, elem_re, val, INSERT_VALUES);
-          if (ilow <= elem_im && elem_im < iupp) VecSetValue(rho0, elem_im, val, INSERT_VALUES);
-        } else {
-          int elem_re = getIndexReal(getVecID(i, i, dim_rho));
-          double val = 1./ dim_rho;
-          if (ilow <= elem_re && elem_re < iupp) VecSetValue(rho0, elem_re, val, INSERT_VALUES);
-        }
+      VecGetArray(rho0, &ptr);
+      if (lindbladtype == LindbladType::NONE) {
+        val = 1./ sqrt(2.*dim_rho);
+        for (PetscInt i = 0; i < iupp - ilow; i++) ptr[i] = val;
+      } else {
+        val = 1./ dim_rho;
+        for (int i=0; i<dim_rho; i++) setLocal(ptr, ilow, iupp, getIndexReal(getVecID(i, i, dim_rho)), val);
       }
+      VecRestoreArray(rho0, &ptr);
       break;
 
     case InitialConditionType::FROMFILE:
@@ -471,77 +480,65 @@ int OptimTarget::prepareInitialState(const int iinit, const int ninit, std::vect
     case InitialConditionType::THREESTATES:
       assert(lindbladtype != LindbladType::NONE);
       VecZeroEntries(rho0);
-      VecGetOwnershipRange(rho0, &ilow, &iupp);
+      VecGetArray(rho0, &ptr);
 
       /* Set the <iinit>'th initial state */
       if (iinit == 0) {
         // 1st initial state: rho(0)_IJ = 2(N-i)/(N(N+1)) Delta_IJ
         initID = 1;
         for (int i_full = 0; i_full<dim_rho; i_full++) {
-          int diagID = getIndexReal(getVecID(i_full,i_full,dim_rho));
-          double val = 2.*(dim_rho - i_full) / (dim_rho * (dim_rho + 1));
-          if (ilow <= diagID && diagID < iupp) VecSetValue(rho0, diagID, val, INSERT_VALUES);
+          val = 2.*(dim_rho - i_full) / (dim_rho * (dim_rho + 1));
+          setLocal(ptr, ilow, iupp, getIndexReal(getVecID(i_full,i_full,dim_rho)), val);
         }
       } else if (iinit == 1) {
-        // 2nd initial state: rho(0)_IJ = 1/N
+        // 2nd initial state: rho(0)_IJ = 1/N. Set all local real parts.
         initID = 2;
-        for (int i_full = 0; i_full<dim_rho; i_full++) {
-          for (int j_full = 0; j_full<dim_rho; j_full++) {
-            double val = 1./dim_rho;
-            int index = getIndexReal(getVecID(i_full,j_full,dim_rho));   // Re(rho_ij)
-            if (ilow <= index && index < iupp) VecSetValue(rho0, index, val, INSERT_VALUES); 
-          }
+        for (PetscInt i = ilow; i < iupp; i++) {
+          if (i % 2 == 0) ptr[i - ilow] = 1./dim_rho;
         }
       } else if (iinit == 2) {
         // 3rd initial state: rho(0)_IJ = 1/N Delta_IJ
         initID = 3;
         for (int i_full = 0; i_full<dim_rho; i_full++) {
-          int diagID = getIndexReal(getVecID(i_full,i_full,dim_rho));
-          double val = 1./ dim_rho;
-          if (ilow <= diagID && diagID < iupp) VecSetValue(rho0, diagID, val, INSERT_VALUES);
+          setLocal(ptr, ilow, iupp, getIndexReal(getVecID(i_full,i_full,dim_rho)), 1./ dim_rho);
         }
       } else {
         printf("ERROR: Wrong initial condition setting! Should never happen.\n");
         exit(1);
       }
-      VecAssemblyBegin(rho0); VecAssemblyEnd(rho0);
+      VecRestoreArray(rho0, &ptr);
       break;
 
     case InitialConditionType::NPLUSONE:
       assert(lindbladtype != LindbladType::NONE);
-      VecGetOwnershipRange(rho0, &ilow, &iupp);
 
       if (iinit < dim_rho) {// Diagonal e_j e_j^\dag
         VecZeroEntries(rho0);
-        elemID = getIndexReal(getVecID(iinit, iinit, dim_rho));
-        val = 1.0;
-        if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+        VecGetArray(rho0, &ptr);
+        setLocal(ptr, ilow, iupp, getIndexReal(getVecID(iinit, iinit, dim_rho)), 1.0);
+        VecRestoreArray(rho0, &ptr);
       }
-      else if (iinit == dim_rho) { // fully rotated 1/d*Ones(d)
-        for (int i=0; i<dim_rho; i++){
-          for (int j=0; j<dim_rho; j++){
-            elemID = getIndexReal(getVecID(i,j,dim_rho));
-            val = 1.0 / dim_rho;
-            if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
-          }
+      else if (iinit == dim_rho) { // fully rotated 1/d*Ones(d). Set all local real parts.
+        VecGetArray(rho0, &ptr);
+        for (PetscInt i = ilow; i < iupp; i++) {
+          if (i % 2 == 0) ptr[i - ilow] = 1.0 / dim_rho;
         }
+        VecRestoreArray(rho0, &ptr);
       }
       else {
         printf("Wrong initial condition index. Should never happen!\n");
         exit(1);
       }
       initID = iinit;
-      VecAssemblyBegin(rho0); VecAssemblyEnd(rho0);
       break;
 
     case InitialConditionType::DIAGONAL:
-      int row, diagelem;
+      int diagelem;
       VecZeroEntries(rho0);
 
       /* Get dimension of partial system behind last oscillator ID (essential levels only) */
       dim_post = 1;
       for (int k = initcond_IDs[initcond_IDs.size()-1] + 1; k < nessential.size(); k++) {
-        // dim_post *= getOscillator(k)->getNLevels();
         dim_post *= nessential[k];
       }
 
@@ -552,10 +549,9 @@ int OptimTarget::prepareInitialState(const int iinit, const int ninit, std::vect
       /* Set B_{mm} */
       if (lindbladtype != LindbladType::NONE) elemID = getIndexReal(getVecID(diagelem, diagelem, dim_rho)); // density matrix
       else  elemID = getIndexReal(diagelem); 
-      val = 1.0;
-      VecGetOwnershipRange(rho0, &ilow, &iupp);
-      if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
-      VecAssemblyBegin(rho0); VecAssemblyEnd(rho0);
+      VecGetArray(rho0, &ptr);
+      setLocal(ptr, ilow, iupp, elemID, 1.0);
+      VecRestoreArray(rho0, &ptr);
 
       /* Set initial conditon ID */
       if (lindbladtype != LindbladType::NONE) initID = iinit * ninit + iinit;
@@ -569,9 +565,6 @@ int OptimTarget::prepareInitialState(const int iinit, const int ninit, std::vect
       /* Reset the initial conditions */
       VecZeroEntries(rho0);
 
-      /* Get distribution */
-      VecGetOwnershipRange(rho0, &ilow, &iupp);
-
       /* Get dimension of partial system behind last oscillator ID (essential levels only) */
       dim_post = 1;
       for (int k = initcond_IDs[initcond_IDs.size()-1] + 1; k < nessential.size(); k++) {
@@ -594,50 +587,23 @@ int OptimTarget::prepareInitialState(const int iinit, const int ninit, std::vect
         j = mapEssToFull(j, nlevels, nessential);
       }
 
+      VecGetArray(rho0, &ptr);
       if (k == j) {
         /* B_{kk} = E_{kk} -> set only one element at (k,k) */
-        elemID = getIndexReal(getVecID(k, k, dim_rho)); // real part in vectorized system
-        double val = 1.0;
-        if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+        setLocal(ptr, ilow, iupp, getIndexReal(getVecID(k, k, dim_rho)), 1.0);
       } else {
-      //   /* B_{kj} contains four non-zeros, two per row */
-        PetscInt* rows = new PetscInt[4];
-        PetscScalar* vals = new PetscScalar[4];
-
-        /* Get storage index of Re(x) */
-        rows[0] = getIndexReal(getVecID(k, k, dim_rho)); // (k,k)
-        rows[1] = getIndexReal(getVecID(j, j, dim_rho)); // (j,j)
-        rows[2] = getIndexReal(getVecID(k, j, dim_rho)); // (k,j)
-        rows[3] = getIndexReal(getVecID(j, k, dim_rho)); // (j,k)
-
+        /* B_{kj} contains four non-zeros, two per row */
+        setLocal(ptr, ilow, iupp, getIndexReal(getVecID(k, k, dim_rho)), 0.5);
+        setLocal(ptr, ilow, iupp, getIndexReal(getVecID(j, j, dim_rho)), 0.5);
         if (k < j) { // B_{kj} = 1/2(E_kk + E_jj) + 1/2(E_kj + E_jk)
-          vals[0] = 0.5;
-          vals[1] = 0.5;
-          vals[2] = 0.5;
-          vals[3] = 0.5;
-          for (int i=0; i<4; i++) {
-            if (ilow <= rows[i] && rows[i] < iupp) VecSetValues(rho0, 1, &(rows[i]), &(vals[i]), INSERT_VALUES);
-          }
+          setLocal(ptr, ilow, iupp, getIndexReal(getVecID(k, j, dim_rho)), 0.5);
+          setLocal(ptr, ilow, iupp, getIndexReal(getVecID(j, k, dim_rho)), 0.5);
         } else {  // B_{kj} = 1/2(E_kk + E_jj) + i/2(E_jk - E_kj)
-          vals[0] = 0.5;
-          vals[1] = 0.5;
-          for (int i=0; i<2; i++) {
-            if (ilow <= rows[i] && rows[i] < iupp) VecSetValues(rho0, 1, &(rows[i]), &(vals[i]), INSERT_VALUES);
-          }
-          vals[2] = -0.5;
-          vals[3] = 0.5;
-          rows[2] = getIndexImag(getVecID(k, j, dim_rho)); // (k,j)
-          rows[3] = getIndexImag(getVecID(j, k, dim_rho)); // (j,k)
-          for (int i=2; i<4; i++) {
-            if (ilow <= rows[i] && rows[i] < iupp) VecSetValues(rho0, 1, &(rows[i]), &(vals[i]), INSERT_VALUES);
-          }
+          setLocal(ptr, ilow, iupp, getIndexImag(getVecID(k, j, dim_rho)), -0.5);
+          setLocal(ptr, ilow, iupp, getIndexImag(getVecID(j, k, dim_rho)),  0.5);
         }
-        delete [] rows;
-        delete [] vals;
       }
-
-      /* Assemble rho0 */
-      VecAssemblyBegin(rho0); VecAssemblyEnd(rho0);
+      VecRestoreArray(rho0, &ptr);
 
       break;
 
@@ -650,13 +616,49 @@ int OptimTarget::prepareInitialState(const int iinit, const int ninit, std::vect
 }
 
 
-void OptimTarget::prepareTargetState(const Vec rho_t0){
+void OptimTarget::prepareTargetState(const Vec rho_t0, const int iinit){
+
+  /* Restore from the cache, if this initial condition has been seen before */
+  if (iinit >= 0 && purity_cache.count(iinit) > 0) {
+    if (target_type == TargetType::GATE) {
+      const std::vector<PetscInt>& idx = target_cache_idx[iinit];
+      const std::vector<double>& val = target_cache_val[iinit];
+      PetscScalar* ptr;
+      VecZeroEntries(targetstate);
+      VecGetArray(targetstate, &ptr);
+      for (int i = 0; i < idx.size(); i++) ptr[idx[i]] = val[i];
+      VecRestoreArray(targetstate, &ptr);
+    }
+    purity_rho0 = purity_cache[iinit];
+    return;
+  }
+
   // If gate optimization, apply the gate and store targetstate for later use. Else, do nothing.
   if (target_type == TargetType::GATE) targetgate->applyGate(rho_t0, targetstate);
 
   /* Compute and store the purity of rho(0), Tr(rho(0)^2), so that it can be used by JTrace (HS overlap) */
   VecNorm(rho_t0, NORM_2, &purity_rho0);
   purity_rho0 = purity_rho0 * purity_rho0;
+
+  /* Store in the cache */
+  if (iinit >= 0) {
+    purity_cache[iinit] = purity_rho0;
+    if (target_type == TargetType::GATE) {
+      std::vector<PetscInt>& idx = target_cache_idx[iinit];
+      std::vector<double>& val = target_cache_val[iinit];
+      const PetscScalar* ptr;
+      PetscInt nlocal;
+      VecGetLocalSize(targetstate, &nlocal);
+      VecGetArrayRead(targetstate, &ptr);
+      for (PetscInt i = 0; i < nlocal; i++) {
+        if (ptr[i] != 0.0) {
+          idx.push_back(i);
+          val.push_back(ptr[i]);
+        }
+      }
+      VecRestoreArrayRead(targetstate, &ptr);
+    }
+  }
 }
 
 
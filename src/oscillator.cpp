@@ -320,7 +320,7 @@ int Oscillator::evalControl(const double t, double* Re_ptr, double* Im_ptr){
   return 0;
 }
 
-int Oscillator::evalControl_diff(const double t, double* dRedp, double* dImdp) {
+int Oscillator::evalControl_diff(const double t, std::vector<int>& ids, std::vector<double>& dRedp, std::vector<double>& dImdp) {
 
   // Sanity check 
   if ( t > Tfinal ){
@@ -328,23 +328,26 @@ int Oscillator::evalControl_diff(const double t, double* dRedp, double* dImdp) {
     exit(1);
   } 
 
+  ids.clear();
+  dRedp.clear();
+  dImdp.clear();
 
   if (params.size()>0) {
     // Iterate over basis parameterizations
     for (int bs = 0; bs < basisfunctions.size(); bs++){
       if (basisfunctions[bs]->getTstart() <= t && 
           basisfunctions[bs]->getTstop() >= t ) {
-        /* Iterate over carrier frequencies */
+        /* Iterate over carrier frequencies. The Re and Im derivatives are taken wrt the same parameters, in the same order. */
         for (int f=0; f < carrier_freq.size(); f++) {
-
+          ids_aux.clear();
           if (basisfunctions[bs]->getType() == ControlType::BSPLINEAMP) {
-            basisfunctions[bs]->derivative(t, params, dRedp, carrier_freq[f], 1.0, f);  // +/-1.0 is used as a flag inside Bsline2ndAmplitude->evaluate() to determine whether this is for p (1.0) or for q (-1.0)
-            basisfunctions[bs]->derivative(t, params, dImdp, carrier_freq[f], -1.0, f);
+            basisfunctions[bs]->derivative(t, params, ids, dRedp, carrier_freq[f], 1.0, f);  // +/-1.0 is used as a flag inside Bsline2ndAmplitude->evaluate() to determine whether this is for p (1.0) or for q (-1.0)
+            basisfunctions[bs]->derivative(t, params, ids_aux, dImdp, carrier_freq[f], -1.0, f);
           } else {
             double cos_omt = cos(carrier_freq[f]*t);
             double sin_omt = sin(carrier_freq[f]*t);
-            basisfunctions[bs]->derivative(t, params, dRedp, cos_omt, -sin_omt, f);
-            basisfunctions[bs]->derivative(t, params, dImdp, sin_omt, cos_omt, f);
+            basisfunctions[bs]->derivative(t, params, ids, dRedp, cos_omt, -sin_omt, f);
+            basisfunctions[bs]->derivative(t, params, ids_aux, dImdp, sin_omt, cos_omt, f);
           }
         }
         break;
@@ -363,6 +366,93 @@ int Oscillator::evalControl_diff(const double t, double* dRedp, double* dImdp) {
   return 0;
 }
 
+int Oscillator::evalControlGrid(const int nt, const double* times, const double dt, double* Re_ptr, double* Im_ptr, double* Lab_ptr){
+
+  /* The phasors are re-seeded from the exact time every <nreseed> steps, which bounds the rounding drift of the recurrence. */
+  const int nreseed = 64;
+
+  /* Carrier phasors exp(i w t) and their rotation exp(i w dt) per time step. The last entry holds the ground frequency for the lab frame. */
+  int ncarrier = carrier_freq.size();
+  std::vector<double> freq(carrier_freq);
+  freq.push_back(ground_freq);
+  std::vector<double> cos_omt(ncarrier+1), sin_omt(ncarrier+1);
+  std::vector<double> cos_omdt(ncarrier+1), sin_omdt(ncarrier+1);
+  for (int f=0; f <= ncarrier; f++) {
+    cos_omdt[f] = cos(freq[f]*dt);
+    sin_omdt[f] = sin(freq[f]*dt);
+  }
+  /* The phase of the BSPLINEAMP parameterization is constant in time, its phasor is computed once per segment. */
+  std::vector<double> cos_phi(ncarrier), sin_phi(ncarrier);
+  int phase_segment = -1;
+
+  for (int k=0; k<nt; k++) {
+    double t = times[k];
+
+    // Sanity check 
+    if ( t > Tfinal ){
+      printf("ERROR: accessing spline outside of [0,T] at %f. Should never happen! Bug.\n", t);
+      exit(1);
+    }
+
+    if (k % nreseed == 0) {
+      for (int f=0; f <= ncarrier; f++) {
+        cos_omt[f] = cos(freq[f]*t);
+        sin_omt[f] = sin(freq[f]*t);
+      }
+    }
+
+    /* Evaluate p(t) and q(t), same as in evalControl */
+    double sum_p = 0.0;
+    double sum_q = 0.0;
+    if (params.size()>0) {
+      for (int bs = 0; bs < basisfunctions.size(); bs++){
+        if (basisfunctions[bs]->getTstart() <= t && 
+            basisfunctions[bs]->getTstop() >= t ) {
+          for (int f=0; f < ncarrier; f++) {
+            double Blt1 = 0.0; 
+            double Blt2 = 0.0;
+            basisfunctions[bs]->evaluate(t, params, f, &Blt1, &Blt2);
+            if (basisfunctions[bs]->getType() == ControlType::BSPLINEAMP) {
+              if (phase_segment != bs) {
+                cos_phi[f] = cos(Blt2);
+                sin_phi[f] = sin(Blt2);
+              }
+              sum_p += (cos_omt[f] * cos_phi[f] - sin_omt[f] * sin_phi[f]) * Blt1; 
+              sum_q += (sin_omt[f] * cos_phi[f] + cos_omt[f] * sin_phi[f]) * Blt1;
+            } else {
+              sum_p += cos_omt[f] * Blt1 - sin_omt[f] * Blt2; 
+              sum_q += sin_omt[f] * Blt1 + cos_omt[f] * Blt2;
+            }
+          }
+          phase_segment = bs;
+          break;
+        }
+      }
+    }
+
+    /* If pipulse: Overwrite controls by constant amplitude */
+    for (int ipulse=0; ipulse< pipulse.tstart.size(); ipulse++){
+      if (pipulse.tstart[ipulse] <= t && t <= pipulse.tstop[ipulse]) {
+        sum_p = pipulse.amp[ipulse] / sqrt(2.0);
+        sum_q = pipulse.amp[ipulse] / sqrt(2.0);
+      }
+    }
+    Re_ptr[k] = sum_p;
+    Im_ptr[k] = sum_q;
+    if (Lab_ptr != NULL) Lab_ptr[k] = 2.0 * (sum_p * cos_omt[ncarrier] - sum_q * sin_omt[ncarrier]);
+
+    /* Advance the phasors to the next time point */
+    for (int f=0; f <= ncarrier; f++) {
+      double c = cos_omt[f] * cos_omdt[f] - sin_omt[f] * sin_omdt[f];
+      double s = sin_omt[f] * cos_omdt[f] + cos_omt[f] * sin_omdt[f];
+      cos_omt[f] = c;
+      sin_omt[f] = s;
+    }
+  }
+
+  return 0;
+}
+
 int Oscillator::evalControl_Labframe(const double t, double* f){
 
   // Sanity check 
@@ -498,51 +588,3 @@ void Oscillator::expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_ba
 }
 
 
-void Oscillator::population(const Vec x, std::vector<double> &pop) {
-
-  int dimN = dim_preOsc * nlevels * dim_postOsc;
-  double val;
-
-  assert (pop.size() == nlevels);
-
-  std::vector<double> mypop(nlevels, 0.0);
-
-  /* Get locally owned portion of x */
-  PetscInt ilow, iupp;
-  VecGetOwnershipRange(x, &ilow, &iupp);
-
-  /* Iterate over diagonal elements of the reduced density matrix for this oscillator */
-  for (int i=0; i < nlevels; i++) {
-    int identitystartID = i * dim_postOsc;
-    /* Sum up elements from all dim_preOsc blocks of size (n_k * dim_postOsc) */
-    double sum = 0.0;
-    for (int j=0; j < dim_preOsc; j++) {
-      int blockstartID = j * nlevels * dim_postOsc; // Go to the block
-      /* Iterate over identity */
-      for (int l=0; l < dim_postOsc; l++) {
-        /* Get diagonal element */
-        int rhoID = blockstartID + identitystartID + l; // Diagonal element of rho
-        if (lindbladtype != LindbladType::NONE) { // Lindblad solver
-          PetscInt diagID = getIndexReal(getVecID(rhoID, rhoID, dimN));  // Position in vectorized rho
-          double val = 0.0;
-          if (ilow <= diagID && diagID < iupp)  VecGetValues(x, 1, &diagID, &val);
-          sum += val;
-        } else {
-          PetscInt diagID_re = getIndexReal(rhoID);
-          PetscInt diagID_im = getIndexImag(rhoID);
-          val = 0.0;
-          if (ilow <= diagID_re && diagID_re < iupp)  VecGetValues(x, 1, &diagID_re, &val);
-          sum += val * val;
-          val = 0.0;
-          if (ilow <= diagID_im && diagID_im < iupp)  VecGetValues(x, 1, &diagID_im, &val);
-          sum += val * val;
-        }
-      }
-    }
-    mypop[i] = sum;
-  } 
-
-  /* Gather poppulation from all Petsc processors */
-  for (int i=0; i<mypop.size(); i++) {pop[i] = mypop[i];}
-  MPI_Allreduce(mypop.data(), pop.data(), nlevels, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
-}
@@ -4,17 +4,19 @@ Output::Output(){
   mpirank_world = -1;
   mpirank_petsc = -1;
   mpirank_init  = -1;
+  mpirank_optim = -1;
   output_frequency = 0;
   quietmode = false;
 }
 
-Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int noscillators, bool quietmode_) : Output() {
+Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, MPI_Comm comm_optim, int noscillators, bool quietmode_) : Output() {
 
   /* Get communicator ranks */
   MPI_Comm_rank(MPI_COMM_WORLD, &mpirank_world);
   MPI_Comm_rank(comm_petsc, &mpirank_petsc);
   MPI_Comm_size(comm_petsc, &mpisize_petsc);
   MPI_Comm_rank(comm_init, &mpirank_init);
+  MPI_Comm_rank(comm_optim, &mpirank_optim);
 
   /* Reduced output */
   quietmode = quietmode_;
@@ -51,6 +53,17 @@ Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int no
     }
   }
 
+  /* Search for expected energy levels or populations */
+  write_observables = false;
+  for (int i=0; i<outputstr.size(); i++) {
+    for (int j=0; j<outputstr[i].size(); j++) {
+      if (outputstr[i][j].compare("expectedEnergy") == 0 ||
+          outputstr[i][j].compare("expectedEnergyComposite") == 0 ||
+          outputstr[i][j].compare("population") == 0 ||
+          outputstr[i][j].compare("populationComposite") == 0 ) write_observables = true;
+    }
+  }
+
   /* Prepare data output files */
   ufile = NULL;
   vfile = NULL;
@@ -125,20 +138,22 @@ void Output::writeControls(Vec params, MasterEq* mastereq, int ntime, double dt)
 
     /* Print control to file for each oscillator */
     mastereq->setControlAmplitudes(params);
+
+    /* Write every <num> timestep to file */
+    std::vector<double> times;
+    for (int i=0; i<=ntime; i+=output_frequency) times.push_back(i*dt);
+    int nout = times.size();
+    std::vector<double> ReI(nout), ImI(nout), LabI(nout);
+
     for (int ioscil = 0; ioscil < mastereq->getNOscillators(); ioscil++) {
       snprintf(filename, 254, "%s/control%d.dat", datadir.c_str(), ioscil);
       file_c = fopen(filename, "w");
       fprintf(file_c, "# time         p(t) (rotating)          q(t) (rotating)         f(t) (labframe) \n");
 
-      /* Write every <num> timestep to file */
-      for (int i=0; i<=ntime; i+=output_frequency) {
-        double time = i*dt; 
-
-        double ReI, ImI, LabI;
-        mastereq->getOscillator(ioscil)->evalControl(time, &ReI, &ImI);
-        mastereq->getOscillator(ioscil)->evalControl_Labframe(time, &LabI);
+      mastereq->getOscillator(ioscil)->evalControlGrid(nout, times.data(), output_frequency*dt, ReI.data(), ImI.data(), LabI.data());
+      for (int i=0; i<nout; i++) {
         // Write control drives
-        fprintf(file_c, "% 1.8f   % 1.14e   % 1.14e   % 1.14e \n", time, ReI/(2.0*M_PI), ImI/(2.0*M_PI), LabI/(2.0*M_PI));
+        fprintf(file_c, "% 1.8f   % 1.14e   % 1.14e   % 1.14e \n", times[i], ReI[i]/(2.0*M_PI), ImI[i]/(2.0*M_PI), LabI[i]/(2.0*M_PI));
      } // end of time loop 
 
       fclose(file_c);
@@ -154,7 +169,7 @@ void Output::openDataFiles(std::string prefix, int initid){
   /* Flag to determine if this optimization iteration will write data output */
 
   /* Open files for state vector */
-  if (mpirank_petsc == 0 && writefullstate ) {
+  if (mpirank_petsc == 0 && mpirank_optim == 0 && writefullstate ) {
     snprintf(filename, 254, "%s/%s_Re.iinit%04d.dat", datadir.c_str(), prefix.c_str(), initid);
     ufile = fopen(filename, "w");
     snprintf(filename, 254, "%s/%s_Im.iinit%04d.dat", datadir.c_str(), prefix.c_str(), initid);
@@ -164,7 +179,7 @@ void Output::openDataFiles(std::string prefix, int initid){
   /* Open files for expected energy */
   bool writeExpComp = false;
   bool writePopComp = false;
-  if (mpirank_petsc == 0) {
+  if (mpirank_petsc == 0 && mpirank_optim == 0) {
     for (int i=0; i<outputstr.size(); i++) {
       for (int j=0; j<outputstr[i].size(); j++) {
         if (outputstr[i][j].compare("expectedEnergy") == 0) {
@@ -199,42 +214,45 @@ void Output::openDataFiles(std::string prefix, int initid){
 void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq* mastereq){
 
   /* Write output only every <num> time-steps */
-  if (timestep % output_frequency == 0) {
-
-    /* Write expected energy levels to file */
-    for (int iosc = 0; iosc < expectedfile.size(); iosc++) {
-      if (expectedfile[iosc] != NULL) {
-        double expected = mastereq->getOscillator(iosc)->expectedEnergy(state);
-        fprintf(expectedfile[iosc], "%.8f %1.14e\n", time, expected);
+  if (isOutputStep(timestep)) {
+
+    /* Compute all expected energy levels and populations in one sweep over the state. This is collective on the Petsc communicator, only the first Petsc processor writes. */
+    if (write_observables) {
+      std::vector<double> population_comp;
+      std::vector<std::vector<double>> pop;
+      std::vector<double> expected;
+      double expected_comp;
+      mastereq->observables(state, population_comp, pop, expected, &expected_comp);
+
+      /* Write expected energy levels to file */
+      for (int iosc = 0; iosc < expectedfile.size(); iosc++) {
+        if (expectedfile[iosc] != NULL) {
+          fprintf(expectedfile[iosc], "%.8f %1.14e\n", time, expected[iosc]);
+        }
       }
-    }
 
-    if (expectedfile_comp != NULL) {
-      double expected_comp = mastereq->expectedEnergy(state);
-      fprintf(expectedfile_comp, "%.8f %1.14e\n", time, expected_comp);
-    }
+      if (expectedfile_comp != NULL) {
+        fprintf(expectedfile_comp, "%.8f %1.14e\n", time, expected_comp);
+      }
 
-    /* Write population to file */
-    for (int iosc = 0; iosc < populationfile.size(); iosc++) {
-      if (populationfile[iosc] != NULL) {
-        std::vector<double> pop (mastereq->getOscillator(iosc)->getNLevels(), 0.0);
-        mastereq->getOscillator(iosc)->population(state, pop);
-        fprintf(populationfile[iosc], "%.8f ", time);
-        for (int i = 0; i<pop.size(); i++) {
-          fprintf(populationfile[iosc], " %1.14e", pop[i]);
+      /* Write population to file */
+      for (int iosc = 0; iosc < populationfile.size(); iosc++) {
+        if (populationfile[iosc] != NULL) {
+          fprintf(populationfile[iosc], "%.8f ", time);
+          for (int i = 0; i<pop[iosc].size(); i++) {
+            fprintf(populationfile[iosc], " %1.14e", pop[iosc][i]);
+          }
+          fprintf(populationfile[iosc], "\n");
         }
-        fprintf(populationfile[iosc], "\n");
       }
-    }
 
-    if (populationfile_comp != NULL) {
-      std::vector<double> population_comp; 
-      mastereq->population(state, population_comp);
-      fprintf(populationfile_comp, "%.8f  ", time);
-      for (int i=0; i<population_comp.size(); i++){
-        fprintf(populationfile_comp, "%1.14e  ", population_comp[i]);
+      if (populationfile_comp != NULL) {
+        fprintf(populationfile_comp, "%.8f  ", time);
+        for (int i=0; i<population_comp.size(); i++){
+          fprintf(populationfile_comp, "%1.14e  ", population_comp[i]);
+        }
+        fprintf(populationfile_comp, "\n");
       }
-      fprintf(populationfile_comp, "\n");
     }
 
     /* Write full state to file */
@@ -268,6 +286,10 @@ void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq
   }
 }
 
+bool Output::isOutputStep(int timestep){
+  return timestep % output_frequency == 0;
+}
+
 void Output::closeDataFiles(){
 
   /* Close output data files */
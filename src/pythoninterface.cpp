@@ -1,15 +1,20 @@
 #include "pythoninterface.hpp"
+#include <algorithm>
+
+/* LAPACK: Eigenvalues and eigenvectors of a real symmetric matrix */
+extern "C" void dsyev_(const char* jobz, const char* uplo, const int* n, double* a, const int* lda, double* w, double* work, const int* lwork, int* info);
 
 PythonInterface::PythonInterface(){
 }
 
 
-PythonInterface::PythonInterface(std::string hamiltonian_file_, LindbladType lindbladtype_, int dim_rho_, bool quietmode_) {
+PythonInterface::PythonInterface(std::string hamiltonian_file_, LindbladType lindbladtype_, int dim_rho_, bool quietmode_, bool dressed_) {
 
   lindbladtype = lindbladtype_;
   dim_rho = dim_rho_;
   hamiltonian_file = hamiltonian_file_;
   quietmode=quietmode_;
+  dressed = dressed_;
   MPI_Comm_rank(MPI_COMM_WORLD, &mpirank_world);
 }
 
@@ -47,6 +52,13 @@ void PythonInterface::receiveHsys(Mat& Bd){
   }
   MPI_Bcast(vals.data(), nelems, MPI_DOUBLE, 0, MPI_COMM_WORLD);
 
+  /* If dressed, only the eigenvalues of Hsys remain on the diagonal */
+  if (dressed) {
+    diagonalizeHsys(vals);
+    for (int i = 0; i<vals.size(); i++) vals[i] = 0.0;
+    for (int i = 0; i<sqdim; i++) vals[i + sqdim*i] = Edressed[i];
+  }
+
   /* Iterate over all elements*/
   for (int i = 0; i<vals.size(); i++) {
     if (fabs(vals[i])<1e-14) continue; // Skip zeros
@@ -106,6 +118,7 @@ void PythonInterface::receiveHc(int noscillators, std::vector<std::vector<Mat>>&
       if (success==1) skiplines += nelems+1;
     }
     MPI_Bcast(vals.data(), nelems, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (dressed) transformToDressed(vals);
     // printf("Received ioscid %d, Hc_real = \n", k);
     // for (int m=0; m<vals.size(); m++){
     //   printf("%d %f\n", m, vals[m]);
@@ -148,6 +161,7 @@ void PythonInterface::receiveHc(int noscillators, std::vector<std::vector<Mat>>&
       if (success==1) skiplines += nelems+1;
     }
     MPI_Bcast(vals.data(), nelems, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if (dressed) transformToDressed(vals);
     // printf("Received ioscid %d, Hc_imag = \n", k);
     // for (int m=0; m<vals.size(); m++){
     //   printf("%d %f\n", m, vals[m]);
@@ -183,4 +197,85 @@ void PythonInterface::receiveHc(int noscillators, std::vector<std::vector<Mat>>&
       }
     } // end of elements of Hc[k][i] imag
   } // end of k loop for oscillators
-}
\ No newline at end of file
+}
+
+void PythonInterface::diagonalizeHsys(const std::vector<double>& Hsys){
+  int N = dim_rho;
+  Vdressed.assign(N*N, 0.0);
+  Edressed.assign(N, 0.0);
+
+  if (mpirank_world == 0) {
+    /* Check symmetry */
+    for (int i=0; i<N; i++){
+      for (int j=0; j<i; j++){
+        if (fabs(Hsys[i + N*j] - Hsys[j + N*i]) > 1e-12) {
+          printf("# ERROR: Interaction picture requires a symmetric system Hamiltonian, but Hsys(%d,%d) != Hsys(%d,%d).\n", i, j, j, i);
+          exit(1);
+        }
+      }
+    }
+
+    /* Eigendecomposition Hsys = U diag(w) U^T */
+    std::vector<double> U(Hsys);
+    std::vector<double> w(N);
+    int lwork = -1;
+    int info;
+    double worksize;
+    dsyev_("V", "U", &N, U.data(), &N, w.data(), &worksize, &lwork, &info);
+    lwork = (int) worksize;
+    std::vector<double> work(lwork);
+    dsyev_("V", "U", &N, U.data(), &N, w.data(), work.data(), &lwork, &info);
+    if (info != 0) {
+      printf("# ERROR: Diagonalization of the system Hamiltonian failed, LAPACK info = %d\n", info);
+      exit(1);
+    }
+
+    /* Order the eigenvectors such that the k-th dressed state is the one with largest overlap with the k-th bare state. 
+     * Greedy: assign pairs (bare i, eigenvector k) in order of decreasing overlap |U_ik|. */
+    std::vector<std::pair<double,int>> overlaps;
+    for (int idx = 0; idx < N*N; idx++) overlaps.push_back(std::make_pair(fabs(U[idx]), idx));
+    std::sort(overlaps.begin(), overlaps.end(), [](const std::pair<double,int>& a, const std::pair<double,int>& b){ return a.first > b.first; });
+    std::vector<bool> bare_done(N, false);
+    std::vector<bool> eig_done(N, false);
+    for (int m = 0; m < overlaps.size(); m++) {
+      int i = overlaps[m].second % N;
+      int k = overlaps[m].second / N;
+      if (bare_done[i] || eig_done[k]) continue;
+      bare_done[i] = true;
+      eig_done[k] = true;
+      // Fix the sign such that the overlap with the bare state is positive
+      double sign = U[i + N*k] < 0.0 ? -1.0 : 1.0;
+      for (int j = 0; j < N; j++) Vdressed[j + N*i] = sign * U[j + N*k];
+      Edressed[i] = w[k];
+    }
+    if (!quietmode) printf("# Propagating in the dressed basis of the system Hamiltonian.\n");
+  }
+  MPI_Bcast(Vdressed.data(), N*N, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(Edressed.data(), N, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+}
+
+
+void PythonInterface::transformToDressed(std::vector<double>& H){
+  int N = dim_rho;
+  if (Vdressed.size() != N*N) {
+    printf("# ERROR: Dressed basis is not available. Read the system Hamiltonian first.\n");
+    exit(1);
+  }
+
+  /* W = H V, then H = V^T W */
+  std::vector<double> W(N*N, 0.0);
+  for (int j=0; j<N; j++){
+    for (int k=0; k<N; k++){
+      double vkj = Vdressed[k + N*j];
+      if (fabs(vkj) < 1e-15) continue;
+      for (int i=0; i<N; i++) W[i + N*j] += H[i + N*k] * vkj;
+    }
+  }
+  for (int j=0; j<N; j++){
+    for (int i=0; i<N; i++){
+      double val = 0.0;
+      for (int k=0; k<N; k++) val += Vdressed[k + N*i] * W[k + N*j];
+      H[i + N*j] = val;
+    }
+  }
+}
@@ -10,6 +10,15 @@ TimeStepper::TimeStepper() {
   storeFWD = false;
   MPI_Comm_rank(MPI_COMM_WORLD, &mpirank_world);
   writeDataFiles = false;
+  adaptive = false;
+  multipleshooting = false;
+  parareal = false;
+  parareal_warned = false;
+  comm_time = MPI_COMM_SELF;
+  mpirank_time = 0;
+  mpisize_time = 1;
+  pr_nfirst = 0;
+  pr_nlast = 0;
 }
 
 TimeStepper::TimeStepper(MapParam config, MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_) : TimeStepper() {
@@ -29,7 +38,22 @@ TimeStepper::TimeStepper(MapParam config, MasterEq* mastereq_, int ntime_, doubl
   /* Set the time-step size */
   dt = total_time / ntime;
 
-  /* Allocate storage of primal state */
+  /* Set the uniform time grid */
+  for (int n = 0; n <= ntime; n++) tgrid.push_back(n * dt);
+
+  /* Adaptive time stepping. Initial step size is dt. */
+  adaptive = config.GetBoolParam("timestepper_adaptive", false, false);
+  adapt_tol = config.GetDoubleParam("timestepper_adaptive_tol", 1e-6, false);
+  adapt_dtmin = config.GetDoubleParam("timestepper_adaptive_dtmin", 1e-3*dt, false);
+  adapt_dtmax = config.GetDoubleParam("timestepper_adaptive_dtmax", total_time, false);
+
+  /* Parareal options, used only if the time domain is distributed (np_optim > 1) */
+  parareal_maxiter = config.GetIntParam("parareal_maxiter", -1, false);  // Default: np_optim-1 iterations, set in setTimeParallel
+  parareal_tol = config.GetDoubleParam("parareal_tol", 1e-8, false);
+  parareal_cfactor = config.GetIntParam("parareal_cfactor", 10, false);
+  pr_nlast = ntime;
+
+  /* Allocate storage of primal state. If adaptive, storage grows with the number of steps taken. */
   if (storeFWD) { 
     for (int n = 0; n <=ntime; n++) {
       Vec state;
@@ -46,6 +70,15 @@ TimeStepper::TimeStepper(MapParam config, MasterEq* mastereq_, int ntime_, doubl
   VecSetFromOptions(x);
   VecZeroEntries(x);
   VecDuplicate(x, &xprimal);
+  if (adaptive) {
+    VecDuplicate(x, &x_coarse);
+    VecDuplicate(x, &x_fine1);
+    VecDuplicate(x, &x_fine2);
+  }
+  if (mastereq->dressedbasis) {
+    VecDuplicate(x, &x_bare);
+    VecDuplicate(x, &x_bare_bar);
+  }
 
   /* Allocate the reduced gradient */
   int ndesign = 0;
@@ -67,6 +100,68 @@ TimeStepper::~TimeStepper() {
   VecDestroy(&x);
   VecDestroy(&xprimal);
   VecDestroy(&redgrad);
+  if (adaptive) {
+    VecDestroy(&x_coarse);
+    VecDestroy(&x_fine1);
+    VecDestroy(&x_fine2);
+  }
+  if (mastereq->dressedbasis) {
+    VecDestroy(&x_bare);
+    VecDestroy(&x_bare_bar);
+  }
+  if (parareal) {
+    VecDestroy(&pr_U);
+    VecDestroy(&pr_F);
+    VecDestroy(&pr_G);
+    for (auto it = pr_chunkend.begin(); it != pr_chunkend.end(); ++it) VecDestroy(&(it->second));
+  }
+}
+
+
+void TimeStepper::setTimeParallel(MPI_Comm comm_time_){
+
+  if (adaptive) {
+    printf("ERROR: Adaptive time stepping can not be combined with time-parallel propagation (np_optim > 1).\n");
+    exit(1);
+  }
+
+  comm_time = comm_time_;
+  MPI_Comm_rank(comm_time, &mpirank_time);
+  MPI_Comm_size(comm_time, &mpisize_time);
+  if (mpisize_time > ntime) {
+    printf("ERROR: Number of time-parallel processors (%d) exceeds the number of time steps (%d).\n", mpisize_time, ntime);
+    exit(1);
+  }
+  parareal = mpisize_time > 1;
+  if (!parareal) return;
+
+  /* Distribute the time steps evenly */
+  pr_nfirst = mpirank_time * ntime / mpisize_time;
+  pr_nlast = (mpirank_time+1) * ntime / mpisize_time;
+
+  /* Parareal is exact after np_optim-1 iterations, more are never needed */
+  if (parareal_maxiter < 0 || parareal_maxiter > mpisize_time-1) parareal_maxiter = mpisize_time-1;
+
+  VecDuplicate(x, &pr_U);
+  VecDuplicate(x, &pr_F);
+  VecDuplicate(x, &pr_G);
+}
+
+
+bool TimeStepper::checkPararealConvergence(int iter, double change){
+  /* After np_optim-1 iterations, all interval start values are exact */
+  if (iter >= mpisize_time-1 || change < parareal_tol) return true;
+  if (!parareal_warned && mpirank_world == 0) {
+    printf("# Warning: Parareal did not converge in parareal_maxiter=%d iterations (change %1.4e > parareal_tol=%1.4e). Falling back to sequential time stepping. Increase parareal_maxiter (at most np_optim-1=%d).\n", parareal_maxiter, change, parareal_tol, mpisize_time-1);
+  }
+  parareal_warned = true;
+  return false;
+}
+
+
+bool TimeStepper::usePararealNow(){
+  /* The dpdm penalty couples neighboring time steps across interval boundaries, fall back to sequential propagation. */
+  return parareal && !multipleshooting && gamma_penalty_dpdm <= 1e-13;
 }
 
 
@@ -90,6 +185,7 @@ Vec TimeStepper::solveODE(int initid, Vec rho_t0){
 
   /* Set initial condition  */
   VecCopy(rho_t0, x);
+  if (mastereq->dressedbasis) mastereq->transformToDressed(x);
 
 
   /* Store initial state for dpdm penalty */
@@ -108,45 +204,99 @@ Vec TimeStepper::solveODE(int initid, Vec rho_t0){
   penalty_integral = 0.0;
   penalty_dpdm = 0.0;
   energy_penalty_integral = 0.0;
-  for (int n = 0; n < ntime; n++){
-
-    /* current time */
-    double tstart = n * dt;
-    double tstop  = (n+1) * dt;
-
-    /* store and write current state. */
-    if (storeFWD) VecCopy(x, store_states[n]);
-    if (writeDataFiles) {
-      output->writeDataFiles(n, tstart, x, mastereq);
+  bool pr_done = false;
+  if (!adaptive) prefillControls();
+  if (usePararealNow() && !writeDataFiles) {
+    pr_done = solveODE_parareal(initid);
+    /* Not converged: Restart and solve sequentially, so that objective and gradient stay exact */
+    if (!pr_done) {
+      VecCopy(rho_t0, x);
+      if (mastereq->dressedbasis) mastereq->transformToDressed(x);
     }
+  }
+  if (pr_done) {
+    /* Final state and penalty terms are set by the Parareal solve */
+  } else if (!adaptive) {
+    for (int n = 0; n < ntime; n++){
 
-    /* Take one time step */
-    evolveFWD(tstart, tstop, x);
+      /* current time */
+      double tstart = tgrid[n];
+      double tstop  = tgrid[n+1];
 
-    /* Add to penalty objective term */
-    if (gamma_penalty > 1e-13) penalty_integral += penaltyIntegral(tstop, x);
+      /* store and write current state. */
+      recordState(n, tstart, x);
 
-    /* Add to penalty for second derivative */
-    if (gamma_penalty_dpdm > 1e-13) {
-      // printf("DPDM Forward, f(%d %d %d) \n", n+1, n, n-1);
-      if (n > 0) penalty_dpdm += penaltyDpDm(x, dpdm_states[n%2], dpdm_states[(n+1)%2]);  // uses x, x_n, x_n-1
+      /* Take one time step */
+      evolveFWD(tstart, tstop, x);
 
-      // Update storage of primal states. Should build a history of 3 states.
-      VecCopy(x, dpdm_states[(n+1)%2]);
-      
+      /* Add to penalty objective terms */
+      addPenaltyTerms(n, tstop, dt, x);
+
+      /* Keep the primal state at the end of this processor's time interval for a time-parallel adjoint */
+      if (parareal && n+1 == pr_nlast) {
+        if (pr_chunkend.find(initid) == pr_chunkend.end()) VecDuplicate(x, &pr_chunkend[initid]);
+        VecCopy(x, pr_chunkend[initid]);
+      }
     }
+  } else {
+    /* Adaptive time stepping by step doubling: One step of size h is compared to two steps of size h/2. If accepted, the two half-steps are recorded in the time grid, so that the adjoint sweep replays the exact same discrete scheme. */
+    tgrid.assign(1, 0.0);
+    double h = dt;
+    int n = 0;
+    while (tgrid[n] < total_time) {
+      double tstart = tgrid[n];
+      double tstop  = tstart + h;
+      if (tstop > total_time - 1e-12*total_time) tstop = total_time;
+      h = tstop - tstart;
+      double tmid = tstart + h/2.0;
+
+      VecCopy(x, x_coarse);
+      evolveFWD(tstart, tstop, x_coarse);
+      VecCopy(x, x_fine1);
+      evolveFWD(tstart, tmid, x_fine1);
+      VecCopy(x_fine1, x_fine2);
+      evolveFWD(tmid, tstop, x_fine2);
+
+      /* Richardson estimate of the local error of the fine solution */
+      double err;
+      VecAXPY(x_coarse, -1.0, x_fine2);
+      VecNorm(x_coarse, NORM_2, &err);
+      err = err / (pow(2.0, getOrder()) - 1.0);
+
+      /* Accept and record the two half steps */
+      if (err <= adapt_tol || h <= adapt_dtmin) {
+        tgrid.push_back(tmid);
+        tgrid.push_back(tstop);
+        recordState(n, tstart, x);
+        VecCopy(x_fine1, x);
+        addPenaltyTerms(n, tmid, h/2.0, x);
+        recordState(n+1, tmid, x);
+        VecCopy(x_fine2, x);
+        addPenaltyTerms(n+1, tstop, h/2.0, x);
+        n += 2;
+      }
 
-    /* Add to energy penalty objective term */
-    if (gamma_penalty_energy > 1e-13) energy_penalty_integral += energyPenaltyIntegral(tstop);
+      /* Update the step size */
+      double fac = 0.9 * pow(adapt_tol / std::max(err, 1e-16), 1.0 / (getOrder() + 1.0));
+      h = h * std::min(5.0, std::max(0.2, fac));
+      h = std::min(std::max(h, adapt_dtmin), adapt_dtmax);
+    }
 
-#ifdef SANITY_CHECK
-    SanityTests(x, tstart);
-#endif
+    /* Record the schedule for the adjoint */
+    tgrid_store[initid] = tgrid;
   }
+  int nsteps = tgrid.size() - 1;
   penalty_dpdm = penalty_dpdm/ntime;
 
   /* Store last time step */
-  if (storeFWD) VecCopy(x, store_states[ntime]);
+  if (storeFWD) {
+    if (store_states.size() <= nsteps) {
+      Vec state;
+      VecDuplicate(x, &state);
+      store_states.push_back(state);
+    }
+    VecCopy(x, store_states[nsteps]);
+  }
 
   /* Clear out dpdm storage */
   if (gamma_penalty_dpdm > 1e-13) {
@@ -158,19 +308,92 @@ Vec TimeStepper::solveODE(int initid, Vec rho_t0){
 
   /* Write last time step and close files */
   if (writeDataFiles) {
-    output->writeDataFiles(ntime, ntime*dt, x, mastereq);
+    recordState(nsteps, tgrid[nsteps], x, false);
     output->closeDataFiles();
   }
-  
+
+  /* Return the final state in the bare basis */
+  if (mastereq->dressedbasis) mastereq->transformFromDressed(x);
 
   return x;
 }
 
 
+void TimeStepper::prefillControls(){
+
+  std::vector<double> stagetimes;
+  getStageTimes(tgrid[0], tgrid[1], stagetimes);
+  int nstages = stagetimes.size();
+
+  /* Index the control table by time step and stage */
+  std::vector<double> stagefrac(nstages);
+  for (int i = 0; i < nstages; i++) stagefrac[i] = (stagetimes[i] - tgrid[0]) / dt;
+  mastereq->setControlGrid(ntime, dt, stagefrac);
+  if (nstages == 0) return;
+
+  /* Gather the times of each stage over all time steps. Each series is spaced by dt. */
+  std::vector<double> times(nstages*ntime);
+  for (int n = 0; n < ntime; n++) {
+    getStageTimes(tgrid[n], tgrid[n+1], stagetimes);
+    for (int i = 0; i < nstages; i++) times[i*ntime + n] = stagetimes[i];
+  }
+  for (int i = 0; i < nstages; i++) {
+    mastereq->prefillControlTable(ntime, times.data() + i*ntime, dt);
+  }
+}
+
+
+void TimeStepper::recordState(int n, double time, const Vec x, bool store){
+
+  if (store && storeFWD) {
+    /* Grow the storage if adaptive time stepping takes more steps than anticipated */
+    if (store_states.size() <= n) {
+      Vec state;
+      VecDuplicate(x, &state);
+      store_states.push_back(state);
+    }
+    VecCopy(x, store_states[n]);
+  }
+  /* Transform back to the bare basis only at the time steps that are written */
+  if (writeDataFiles && output->isOutputStep(n)) {
+    if (mastereq->dressedbasis) {
+      VecCopy(x, x_bare);
+      mastereq->transformFromDressed(x_bare);
+      output->writeDataFiles(n, time, x_bare, mastereq);
+    }
+    else output->writeDataFiles(n, time, x, mastereq);
+  }
+}
+
+
+void TimeStepper::addPenaltyTerms(int n, double tstop, double dt_n, const Vec x){
+
+  /* Add to penalty objective term */
+  if (gamma_penalty > 1e-13) penalty_integral += penaltyIntegral(tstop, dt_n, x);
+
+  /* Add to penalty for second derivative */
+  if (gamma_penalty_dpdm > 1e-13) {
+    // printf("DPDM Forward, f(%d %d %d) \n", n+1, n, n-1);
+    if (n > 0) penalty_dpdm += penaltyDpDm(x, dpdm_states[n%2], dpdm_states[(n+1)%2]);  // uses x, x_n, x_n-1
+
+    // Update storage of primal states. Should build a history of 3 states.
+    VecCopy(x, dpdm_states[(n+1)%2]);
+  }
+
+  /* Add to energy penalty objective term */
+  if (gamma_penalty_energy > 1e-13) energy_penalty_integral += energyPenaltyIntegral(tstop, dt_n);
+
+#ifdef SANITY_CHECK
+  SanityTests(x, tstop);
+#endif
+}
+
+
 void TimeStepper::solveAdjointODE(int initid, Vec rho_t0_bar, Vec finalstate, double Jbar_penalty, double Jbar_penalty_dpdm, double Jbar_energy_penalty) {
 
-  /* Reset gradient */
+  /* Reset gradient. Control gradient contributions are recorded during the sweep and projected onto the parameters at the end. */
   VecZeroEntries(redgrad);
+  mastereq->startGradientSeries();
 
   /* Set terminal adjoint condition */
   VecCopy(rho_t0_bar, x);
@@ -178,6 +401,22 @@ void TimeStepper::solveAdjointODE(int initid, Vec rho_t0_bar, Vec finalstate, do
   /* Set terminal primal state */
   VecCopy(finalstate, xprimal);
 
+  /* Move terminal conditions into the dressed basis. The transformation is orthogonal, so the adjoint transforms the same way. */
+  if (mastereq->dressedbasis) {
+    mastereq->transformToDressed(x);
+    mastereq->transformToDressed(xprimal);
+  }
+
+  /* If adaptive, replay the time grid that was recorded during the forward solve for this initial condition */
+  if (adaptive) {
+    if (tgrid_store.find(initid) == tgrid_store.end()) {
+      printf("ERROR: No adaptive time grid recorded for initial condition %d.\n", initid);
+      exit(1);
+    }
+    tgrid = tgrid_store[initid];
+  }
+  int nsteps = tgrid.size() - 1;
+
   /* Store states at N, N-1, N-2 for dpdm penalty */
   if (gamma_penalty_dpdm > 1e-13){
     for (int i = 0; i < 5; i++) {
@@ -195,20 +434,46 @@ void TimeStepper::solveAdjointODE(int initid, Vec rho_t0_bar, Vec finalstate, do
   }
  
 
+  /* Time-parallel adjoint. Requires the primal state at the end of the own time interval. */
+  if (usePararealNow() && (storeFWD || pr_chunkend.find(initid) != pr_chunkend.end())) {
+    if (solveAdjointODE_parareal(initid, Jbar_penalty, Jbar_energy_penalty)) {
+      if (mastereq->dressedbasis) mastereq->transformFromDressed(x);
+      return;
+    }
+    /* Not converged: Restart and solve sequentially. The Parareal forward solve only stored the states of the own time interval, so first recompute all of them, starting from the initial state on the first time processor. */
+    if (storeFWD) {
+      VecCopy(getState(0), xprimal);
+      bcastState(xprimal, 0);
+      for (int n = 0; n < ntime; n++) {
+        VecCopy(xprimal, store_states[n]);
+        evolveFWD(tgrid[n], tgrid[n+1], xprimal);
+      }
+      VecCopy(xprimal, store_states[ntime]);
+    }
+    VecCopy(rho_t0_bar, x);
+    VecCopy(finalstate, xprimal);
+    if (mastereq->dressedbasis) {
+      mastereq->transformToDressed(x);
+      mastereq->transformToDressed(xprimal);
+    }
+    mastereq->startGradientSeries();
+  }
+
   /* Loop over time interval */
-  for (int n = ntime; n > 0; n--){
-    double tstop  = n * dt;
-    double tstart = (n-1) * dt;
+  for (int n = nsteps; n > 0; n--){
+    double tstop  = tgrid[n];
+    double tstart = tgrid[n-1];
+    double dt_n = adaptive ? tstop - tstart : dt;
     // printf("Backwards %d -> %d ... ", n, n-1);
 
     /* Derivative of energy penalty objective term */
-    if (gamma_penalty_energy > 1e-13) energyPenaltyIntegral_diff(tstop, Jbar_energy_penalty, redgrad);
+    if (gamma_penalty_energy > 1e-13) energyPenaltyIntegral_diff(tstop, dt_n, Jbar_energy_penalty, redgrad);
 
     /* Derivative of penalty term */
     if (gamma_penalty_dpdm > 1e-13) penaltyDpDm_diff(n, x, Jbar_penalty_dpdm/ntime);
 
     /* Derivative of penalty objective term */
-    if (gamma_penalty > 1e-13) penaltyIntegral_diff(tstop, xprimal, x, Jbar_penalty);
+    if (gamma_penalty > 1e-13) penaltyIntegral_diff(tstop, dt_n, xprimal, x, Jbar_penalty);
 
     /* Get the state at n-1. If Schroedinger solver, recompute it by taking a step backwards with the forward solver, otherwise get it from storage. */
     if (storeFWD) VecCopy(getState(n-1), xprimal);
@@ -236,10 +501,226 @@ void TimeStepper::solveAdjointODE(int initid, Vec rho_t0_bar, Vec finalstate, do
     }
     dpdm_states.clear();
   }
+
+  mastereq->finishGradientSeries(redgrad);
+
+  /* Return the adjoint initial state in the bare basis */
+  if (mastereq->dressedbasis) mastereq->transformFromDressed(x);
 }
 
 
-double TimeStepper::penaltyIntegral(double time, const Vec x){
+void TimeStepper::sendState(Vec x, int dest){
+  PetscInt nlocal;
+  const PetscScalar* xptr;
+  VecGetLocalSize(x, &nlocal);
+  VecGetArrayRead(x, &xptr);
+  MPI_Send(xptr, nlocal, MPI_DOUBLE, dest, 0, comm_time);
+  VecRestoreArrayRead(x, &xptr);
+}
+
+void TimeStepper::recvState(Vec x, int src){
+  PetscInt nlocal;
+  PetscScalar* xptr;
+  VecGetLocalSize(x, &nlocal);
+  VecGetArray(x, &xptr);
+  MPI_Recv(xptr, nlocal, MPI_DOUBLE, src, 0, comm_time, MPI_STATUS_IGNORE);
+  VecRestoreArray(x, &xptr);
+}
+
+void TimeStepper::bcastState(Vec x, int root){
+  PetscInt nlocal;
+  PetscScalar* xptr;
+  VecGetLocalSize(x, &nlocal);
+  VecGetArray(x, &xptr);
+  MPI_Bcast(xptr, nlocal, MPI_DOUBLE, root, comm_time);
+  VecRestoreArray(x, &xptr);
+}
+
+
+void TimeStepper::coarseFWD_parareal(Vec x){
+  /* Coarse propagator: Few large steps of the same scheme over the own time interval */
+  int ncoarse = std::max(1, (pr_nlast - pr_nfirst) / parareal_cfactor);
+  double H = (tgrid[pr_nlast] - tgrid[pr_nfirst]) / ncoarse;
+  for (int i = 0; i < ncoarse; i++) {
+    evolveFWD(tgrid[pr_nfirst] + i*H, tgrid[pr_nfirst] + (i+1)*H, x);
+  }
+}
+
+void TimeStepper::coarseBWD_parareal(Vec x_adj){
+  /* Coarse adjoint propagator. Without gradient, the adjoint step does not depend on the primal state. */
+  int ncoarse = std::max(1, (pr_nlast - pr_nfirst) / parareal_cfactor);
+  double H = (tgrid[pr_nlast] - tgrid[pr_nfirst]) / ncoarse;
+  for (int i = ncoarse; i > 0; i--) {
+    evolveBWD(tgrid[pr_nfirst] + i*H, tgrid[pr_nfirst] + (i-1)*H, xprimal, x_adj, redgrad, false);
+  }
+}
+
+void TimeStepper::fineFWD_parareal(int initid){
+
+  /* Fine propagation of x over the own time interval: store states and evaluate penalty terms */
+  for (int n = pr_nfirst; n < pr_nlast; n++){
+    recordState(n, tgrid[n], x);
+    evolveFWD(tgrid[n], tgrid[n+1], x);
+    addPenaltyTerms(n, tgrid[n+1], dt, x);
+  }
+  recordState(pr_nlast, tgrid[pr_nlast], x);
+  if (pr_chunkend.find(initid) == pr_chunkend.end()) VecDuplicate(x, &pr_chunkend[initid]);
+  VecCopy(x, pr_chunkend[initid]);
+}
+
+void TimeStepper::fineBWD_parareal(int initid, Vec x_adj, double Jbar_penalty, double Jbar_energy_penalty, bool compute_gradient){
+
+  /* Primal state at the end of the own time interval */
+  if (storeFWD) VecCopy(getState(pr_nlast), xprimal);
+  else VecCopy(pr_chunkend[initid], xprimal);
+
+  for (int n = pr_nlast; n > pr_nfirst; n--){
+    double tstop  = tgrid[n];
+    double tstart = tgrid[n-1];
+
+    /* Derivative of energy penalty objective term. Only contributes to the gradient. */
+    if (compute_gradient && gamma_penalty_energy > 1e-13) energyPenaltyIntegral_diff(tstop, dt, Jbar_energy_penalty, redgrad);
+
+    /* Derivative of penalty objective term */
+    if (gamma_penalty > 1e-13) penaltyIntegral_diff(tstop, dt, xprimal, x_adj, Jbar_penalty);
+
+    /* Get the primal state at n-1 */
+    if (storeFWD) VecCopy(getState(n-1), xprimal);
+    else evolveFWD(tstop, tstart, xprimal);
+
+    evolveBWD(tstop, tstart, xprimal, x_adj, redgrad, compute_gradient);
+  }
+}
+
+
+bool TimeStepper::solveODE_parareal(int initid){
+
+  /* Initial coarse sweep, pipelined through the time processors */
+  if (mpirank_time > 0) recvState(x, mpirank_time-1);
+  VecCopy(x, pr_U);
+  VecCopy(x, pr_G);
+  coarseFWD_parareal(pr_G);
+  if (mpirank_time < mpisize_time-1) sendState(pr_G, mpirank_time+1);
+
+  /* Parareal iterations U_{p+1} = G(U_p^new) + F(U_p^old) - G(U_p^old). After k iterations, the first k+1 intervals are exact. */
+  double change = 0.0;
+  int iter = 0;
+  for (iter = 0; iter < parareal_maxiter; iter++) {
+    VecCopy(pr_U, pr_F);
+    for (int n = pr_nfirst; n < pr_nlast; n++) evolveFWD(tgrid[n], tgrid[n+1], pr_F);
+
+    change = 0.0;
+    if (mpirank_time > 0) {
+      recvState(x, mpirank_time-1);
+      VecAXPY(pr_U, -1.0, x);
+      VecNorm(pr_U, NORM_2, &change);
+      VecCopy(x, pr_U);
+    }
+    VecAXPY(pr_F, -1.0, pr_G);
+    VecCopy(pr_U, pr_G);
+    coarseFWD_parareal(pr_G);
+    VecAXPY(pr_F, 1.0, pr_G);
+    if (mpirank_time < mpisize_time-1) sendState(pr_F, mpirank_time+1);
+
+    MPI_Allreduce(MPI_IN_PLACE, &change, 1, MPI_DOUBLE, MPI_MAX, comm_time);
+    if (change < parareal_tol) break;
+  }
+  if (!checkPararealConvergence(iter, change)) return false;
+
+  /* Final fine sweep over the own interval */
+  VecCopy(pr_U, x);
+  fineFWD_parareal(initid);
+
+  /* Sum up penalty terms and distribute the final state */
+  MPI_Allreduce(MPI_IN_PLACE, &penalty_integral, 1, MPI_DOUBLE, MPI_SUM, comm_time);
+  MPI_Allreduce(MPI_IN_PLACE, &energy_penalty_integral, 1, MPI_DOUBLE, MPI_SUM, comm_time);
+  bcastState(x, mpisize_time-1);
+  return true;
+}
+
+
+bool TimeStepper::solveAdjointODE_parareal(int initid, double Jbar_penalty, double Jbar_energy_penalty){
+
+  /* Initial coarse sweep, pipelined backwards through the time processors */
+  if (mpirank_time < mpisize_time-1) recvState(x, mpirank_time+1);
+  VecCopy(x, pr_U);
+  VecCopy(x, pr_G);
+  coarseBWD_parareal(pr_G);
+  if (mpirank_time > 0) sendState(pr_G, mpirank_time-1);
+
+  /* Parareal iterations for the adjoint, without gradient */
+  double change = 0.0;
+  int iter = 0;
+  for (iter = 0; iter < parareal_maxiter; iter++) {
+    VecCopy(pr_U, pr_F);
+    fineBWD_parareal(initid, pr_F, Jbar_penalty, Jbar_energy_penalty, false);
+
+    change = 0.0;
+    if (mpirank_time < mpisize_time-1) {
+      recvState(x, mpirank_time+1);
+      VecAXPY(pr_U, -1.0, x);
+      VecNorm(pr_U, NORM_2, &change);
+      VecCopy(x, pr_U);
+    }
+    VecAXPY(pr_F, -1.0, pr_G);
+    VecCopy(pr_U, pr_G);
+    coarseBWD_parareal(pr_G);
+    VecAXPY(pr_F, 1.0, pr_G);
+    if (mpirank_time > 0) sendState(pr_F, mpirank_time-1);
+
+    MPI_Allreduce(MPI_IN_PLACE, &change, 1, MPI_DOUBLE, MPI_MAX, comm_time);
+    if (change < parareal_tol) break;
+  }
+  if (!checkPararealConvergence(iter, change)) return false;
+
+  /* Final fine sweep over the own interval with gradient */
+  VecCopy(pr_U, x);
+  fineBWD_parareal(initid, x, Jbar_penalty, Jbar_energy_penalty, true);
+
+  /* Sum up the gradient contributions and distribute the adjoint initial state */
+  mastereq->finishGradientSeries(redgrad);
+  PetscInt ngrad;
+  PetscScalar* gptr;
+  VecGetSize(redgrad, &ngrad);
+  VecGetArray(redgrad, &gptr);
+  MPI_Allreduce(MPI_IN_PLACE, gptr, ngrad, MPI_DOUBLE, MPI_SUM, comm_time);
+  VecRestoreArray(redgrad, &gptr);
+  bcastState(x, 0);
+  return true;
+}
+
+
+Vec TimeStepper::solveODEWindow(int initid, Vec x0){
+
+  VecCopy(x0, x);
+  if (mastereq->dressedbasis) mastereq->transformToDressed(x);
+
+  penalty_integral = 0.0;
+  penalty_dpdm = 0.0;
+  energy_penalty_integral = 0.0;
+  fineFWD_parareal(initid);
+
+  if (mastereq->dressedbasis) mastereq->transformFromDressed(x);
+  return x;
+}
+
+
+Vec TimeStepper::solveAdjointODEWindow(int initid, Vec xbar_end, double Jbar_penalty, double Jbar_energy_penalty){
+
+  VecZeroEntries(redgrad);
+  VecCopy(xbar_end, x);
+  if (mastereq->dressedbasis) mastereq->transformToDressed(x);
+
+  mastereq->startGradientSeries();
+  fineBWD_parareal(initid, x, Jbar_penalty, Jbar_energy_penalty, true);
+  mastereq->finishGradientSeries(redgrad);
+
+  if (mastereq->dressedbasis) mastereq->transformFromDressed(x);
+  return x;
+}
+
+
+double TimeStepper::penaltyIntegral(double time, double dt_n, const Vec x){
   double penalty = 0.0;
   int dim_rho = mastereq->getDimRho(); // N
   double x_re, x_im;
@@ -251,13 +732,30 @@ double TimeStepper::penaltyIntegral(double time, const Vec x){
 
     double obj_re = 0.0;
     double obj_im = 0.0;
-    optim_target->evalJ(x, &obj_re, &obj_im);
+    if (mastereq->dressedbasis) {
+      VecCopy(x, x_bare);
+      mastereq->transformFromDressed(x_bare);
+      optim_target->evalJ(x_bare, &obj_re, &obj_im);
+    }
+    else optim_target->evalJ(x, &obj_re, &obj_im);
     double obj_cost = optim_target->finalizeJ(obj_re, obj_im);
-    penalty = weight * obj_cost * dt;
+    penalty = weight * obj_cost * dt_n;
   }
 
   /* Add guard-level occupation to prevent leakage. A guard level is the LAST NON-ESSENTIAL energy level of an oscillator */
-  if (addLeakagePrevent) {
+  if (addLeakagePrevent && mastereq->dressedbasis) {
+    /* Guard-level occupation in the bare basis. Each processor holds the full result. */
+    std::vector<int> guardids;
+    for (int i=0; i<dim_rho; i++) {
+      if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) guardids.push_back(i);
+    }
+    std::vector<double> g_re, g_im;
+    mastereq->bareDiagonal(x, guardids, g_re, g_im);
+    double leakage = 0.0;
+    for (int j=0; j<guardids.size(); j++) leakage += (g_re[j] * g_re[j] + g_im[j] * g_im[j]) / (dt*ntime);
+    penalty += dt_n * leakage;
+  }
+  else if (addLeakagePrevent) {
     double leakage = 0.0;
     PetscInt ilow, iupp;
     VecGetOwnershipRange(x, &ilow, &iupp);
@@ -280,13 +778,13 @@ double TimeStepper::penaltyIntegral(double time, const Vec x){
     }
     double mine = leakage;
     MPI_Allreduce(&mine, &leakage, 1, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
-    penalty += dt * leakage;
+    penalty += dt_n * leakage;
   }
 
   return penalty;
 }
 
-void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, double penaltybar){
+void TimeStepper::penaltyIntegral_diff(double time, double dt_n, const Vec x, Vec xbar, double penaltybar){
   int dim_rho = mastereq->getDimRho();  // N
   PetscInt vecID_re, vecID_im;
 
@@ -296,16 +794,41 @@ void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, doubl
     
     double obj_cost_re = 0.0;
     double obj_cost_im = 0.0;
-    optim_target->evalJ(x, &obj_cost_re, &obj_cost_im);
+    Vec xJ = x;
+    if (mastereq->dressedbasis) {
+      VecCopy(x, x_bare);
+      mastereq->transformFromDressed(x_bare);
+      xJ = x_bare;
+    }
+    optim_target->evalJ(xJ, &obj_cost_re, &obj_cost_im);
 
     double obj_cost_re_bar = 0.0; 
     double obj_cost_im_bar = 0.0;
     optim_target->finalizeJ_diff(obj_cost_re, obj_cost_im, &obj_cost_re_bar, &obj_cost_im_bar);
-    optim_target->evalJ_diff(x, xbar, weight*obj_cost_re_bar*penaltybar*dt, weight*obj_cost_im_bar*penaltybar*dt);
+    if (mastereq->dressedbasis) {
+      VecZeroEntries(x_bare_bar);
+      optim_target->evalJ_diff(xJ, x_bare_bar, weight*obj_cost_re_bar*penaltybar*dt_n, weight*obj_cost_im_bar*penaltybar*dt_n);
+      mastereq->transformToDressed(x_bare_bar);
+      VecAXPY(xbar, 1.0, x_bare_bar);
+    }
+    else optim_target->evalJ_diff(x, xbar, weight*obj_cost_re_bar*penaltybar*dt_n, weight*obj_cost_im_bar*penaltybar*dt_n);
   }
 
   /* If gate optimization: Derivative of adding guard-level occupation */
-  if (addLeakagePrevent) {
+  if (addLeakagePrevent && mastereq->dressedbasis) {
+    std::vector<int> guardids;
+    for (int i=0; i<dim_rho; i++) {
+      if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) guardids.push_back(i);
+    }
+    std::vector<double> g_re, g_im;
+    mastereq->bareDiagonal(x, guardids, g_re, g_im);
+    for (int j=0; j<guardids.size(); j++) {
+      g_re[j] *= 2.*penaltybar/ntime * dt_n/dt;
+      g_im[j] *= 2.*penaltybar/ntime * dt_n/dt;
+    }
+    mastereq->bareDiagonal_diff(xbar, guardids, g_re, g_im);
+  }
+  else if (addLeakagePrevent) {
     PetscInt ilow, iupp;
     VecGetOwnershipRange(x, &ilow, &iupp);
     double x_re, x_im;
@@ -322,8 +845,8 @@ void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, doubl
         if (ilow <= vecID_re && vecID_re < iupp) VecGetValues(x, 1, &vecID_re, &x_re);
         if (ilow <= vecID_im && vecID_im < iupp) VecGetValues(x, 1, &vecID_im, &x_im);
         // Derivative: 2 * rho(i,i) * weights * penalbar * dt
-        if (ilow <= vecID_re && vecID_re < iupp) VecSetValue(xbar, vecID_re, 2.*x_re*penaltybar/ntime, ADD_VALUES);
-        if (ilow <= vecID_im && vecID_im < iupp) VecSetValue(xbar, vecID_im, 2.*x_im*penaltybar/ntime, ADD_VALUES);
+        if (ilow <= vecID_re && vecID_re < iupp) VecSetValue(xbar, vecID_re, 2.*x_re*penaltybar/ntime * dt_n/dt, ADD_VALUES);
+        if (ilow <= vecID_im && vecID_im < iupp) VecSetValue(xbar, vecID_im, 2.*x_im*penaltybar/ntime * dt_n/dt, ADD_VALUES);
       }
     }
     VecAssemblyBegin(xbar);
@@ -462,61 +985,31 @@ void TimeStepper::penaltyDpDm_diff(int n, Vec xbar, double Jbar){
  
 }
 
-double TimeStepper::energyPenaltyIntegral(double time){
+double TimeStepper::energyPenaltyIntegral(double time, double dt_n){
   double pen = 0.0;
 
   /* Loop over oscillators */
   for (int iosc = 0; iosc < mastereq->getNOscillators(); iosc++) {
     double p,q;
-    mastereq->getOscillator(iosc)->evalControl(time, &p, &q); 
-    pen += (p*p + q*q) / ntime;
+    mastereq->getControl(time, iosc, &p, &q); 
+    pen += (p*p + q*q) / ntime * dt_n/dt;
   }
 
   return pen;
 }
 
 
-void TimeStepper::energyPenaltyIntegral_diff(double time, double penaltybar, Vec redgrad){
+void TimeStepper::energyPenaltyIntegral_diff(double time, double dt_n, double penaltybar, Vec redgrad){
 
-  int nparams_max = 0;
-  for (int ioscil = 0; ioscil < mastereq->getNOscillators(); ioscil++) {
-      int n = mastereq->getOscillator(ioscil)->getNParams();
-      if (n > nparams_max) nparams_max = n;
-  }
-  double* dRedp = new double[nparams_max];
-  double* dImdp = new double[nparams_max];
-
-  PetscInt* cols = new PetscInt[nparams_max];
-  PetscScalar* vals = new PetscScalar[nparams_max];
-
-  int shift = 0;
   for (int iosc = 0; iosc < mastereq->getNOscillators(); iosc++){
 
     /* Reevaluate the controls */
     double p,q;
-    mastereq->getOscillator(iosc)->evalControl(time, &p, &q); 
+    mastereq->getControl(time, iosc, &p, &q); 
 
-    /* Initialize derivative */
-    for (int i=0; i<nparams_max; i++){
-      dRedp[i] = 0.0;
-      dImdp[i] = 0.0;
-    }
-    mastereq->getOscillator(iosc)->evalControl_diff(time, dRedp, dImdp);
-
-    PetscInt nparam = mastereq->getOscillator(iosc)->getNParams();
-    for (int iparam=0; iparam < nparam; iparam++) {
-      vals[iparam] = penaltybar / ntime * 2.0 * ( p * dRedp[iparam] + q * dImdp[iparam]);
-      cols[iparam] = iparam + shift;
-    }
-    VecSetValues(redgrad, nparam, cols, vals, ADD_VALUES);
-    shift += nparam;
+    double fact = penaltybar / ntime * dt_n/dt * 2.0;
+    mastereq->addControlGradient(time, iosc, fact * p, fact * q, redgrad);
   } 
-
-
-  delete [] dRedp;
-  delete [] dImdp;
-  delete [] vals;
-  delete [] cols;
 }
 
 void TimeStepper::evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient){}
@@ -530,6 +1023,10 @@ ExplEuler::~ExplEuler() {
   VecDestroy(&stage);
 }
 
+void ExplEuler::getStageTimes(const double tstart, const double tstop, std::vector<double>& times) {
+  times.assign(1, tstart);
+}
+
 void ExplEuler::evolveFWD(const double tstart,const  double tstop, Vec x) {
 
   double dt = tstop - tstart;
@@ -547,15 +1044,14 @@ void ExplEuler::evolveFWD(const double tstart,const  double tstop, Vec x) {
 void ExplEuler::evolveBWD(const double tstop,const  double tstart,const  Vec x, Vec x_adj, Vec grad, bool compute_gradient){
   double dt = tstop - tstart;
 
-  /* Add to reduced gradient */
-  if (compute_gradient) {
-    mastereq->computedRHSdp(tstop, x, x_adj, dt, grad);
-  }
-
-  /* update x_adj = x_adj + hA^Tx_adj */
+  /* update x_adj = x_adj + hA^Tx_adj, and add to reduced gradient in the same sweep */
   mastereq->assemble_RHS(tstop);
   Mat A = mastereq->getRHS(); 
-  MatMultTranspose(A, x_adj, stage);
+  if (compute_gradient) {
+    mastereq->computedRHSdp_MatMultTranspose(tstop, x, x_adj, dt, grad, stage);
+  } else {
+    MatMultTranspose(A, x_adj, stage);
+  }
   VecAXPY(x_adj, dt, stage);
 
 }
@@ -578,6 +1074,10 @@ ImplMidpoint::ImplMidpoint(MapParam config,MasterEq* mastereq_, int ntime_, doub
   linsolve_iterstaken_avg = 0;
   linsolve_counter = 0;
   linsolve_error_avg = 0.0;
+  IMRop = mastereq->getRHS();
+  lu_cachesize = config.GetIntParam("linearsolver_lu_cachesize", 16, false);
+  lu_next = 0;
+  lu_nfactor = 0;
 
   if (linsolve_type == LinearSolverType::GMRES) {
     /* Create Petsc's linear solver */
@@ -586,16 +1086,21 @@ ImplMidpoint::ImplMidpoint(MapParam config,MasterEq* mastereq_, int ntime_, doub
     PCSetType(preconditioner, PCNONE);
     KSPSetTolerances(ksp, linsolve_reltol, linsolve_abstol, PETSC_DEFAULT, linsolve_maxiter);
     KSPSetType(ksp, KSPGMRES);
-    KSPSetOperators(ksp, mastereq->getRHS(), mastereq->getRHS());
+    KSPSetOperators(ksp, IMRop, IMRop);
     KSPSetFromOptions(ksp);
   }
-  else {
+  else if (linsolve_type == LinearSolverType::NEUMANN) {
     /* For Neumann iterations, allocate a temporary vector */
     MatCreateVecs(mastereq->getRHS(), &tmp, NULL);
     MatCreateVecs(mastereq->getRHS(), &err, NULL);
   }
 }
 
+void ImplMidpoint::setIMROperator(Mat A){
+  IMRop = A;
+  if (linsolve_type == LinearSolverType::GMRES) KSPSetOperators(ksp, IMRop, IMRop);
+}
+
 
 ImplMidpoint::~ImplMidpoint(){
 
@@ -610,10 +1115,14 @@ ImplMidpoint::~ImplMidpoint(){
   /* Free up Petsc's linear solver */
   if (linsolve_type == LinearSolverType::GMRES) {
     KSPDestroy(&ksp);
-  } else {
+  } else if (linsolve_type == LinearSolverType::NEUMANN) {
     VecDestroy(&tmp);
     VecDestroy(&err);
   }
+  for (int i = 0; i < lu_ksps.size(); i++) {
+    KSPDestroy(&(lu_ksps[i]));
+    MatDestroy(&(lu_mats[i]));
+  }
 
   /* Free up intermediate vectors */
   VecDestroy(&stage_adj);
@@ -623,6 +1132,10 @@ ImplMidpoint::~ImplMidpoint(){
 
 }
 
+void ImplMidpoint::getStageTimes(const double tstart, const double tstop, std::vector<double>& times) {
+  times.assign(1, (tstart + tstop) / 2.0);
+}
+
 void ImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
 
   /* Compute time step size */
@@ -630,7 +1143,7 @@ void ImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
 
   /* Compute A(t_n+h/2) */
   mastereq->assemble_RHS( (tstart + tstop) / 2.0);
-  Mat A = mastereq->getRHS(); 
+  Mat A = IMRop; 
 
   /* Compute rhs = A x */
   MatMult(A, x, rhs);
@@ -663,6 +1176,10 @@ void ImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
     case LinearSolverType::NEUMANN:
       linsolve_iterstaken_avg += NeumannSolve(A, rhs, stage, dt/2.0, false);
       break;
+
+    case LinearSolverType::LU:
+      KSPSolve(getLUSolver(dt), rhs, stage);
+      break;
   }
   linsolve_counter++;
 
@@ -679,7 +1196,7 @@ void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec
 
   /* Assemble RHS(t_1/2) */
   mastereq->assemble_RHS( (tstart + tstop) / 2.0);
-  A = mastereq->getRHS();
+  A = IMRop;
 
   /* Get Ax_n for use in gradient */
   if (compute_gradient) {
@@ -704,6 +1221,10 @@ void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec
     case LinearSolverType::NEUMANN: 
       NeumannSolve(A, x_adj, stage_adj, dt/2.0, true);
       break;
+
+    case LinearSolverType::LU:
+      KSPSolveTranspose(getLUSolver(dt), x_adj, stage_adj);
+      break;
   }
 
   // k_bar = h*k_bar 
@@ -718,21 +1239,181 @@ void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec
       case LinearSolverType::NEUMANN:
         NeumannSolve(A, rhs, stage, dt/2.0, false);
         break;
+      case LinearSolverType::LU:
+        KSPSolve(getLUSolver(dt), rhs, stage);
+        break;
     }
     VecAYPX(stage, dt / 2.0, x);
-    mastereq->computedRHSdp(thalf, stage, stage_adj, 1.0, grad);
   }
 
   /* Revert changes to RHS from above, if gmres solver */
-  A = mastereq->getRHS();
+  A = IMRop;
   if (linsolve_type == LinearSolverType::GMRES) {
     MatAssemblyBegin(A, MAT_FINAL_ASSEMBLY);
     MatAssemblyEnd(A, MAT_FINAL_ASSEMBLY);
   }
 
   /* Update adjoint state x_adj += dt * A^Tstage_adj --- */
-  MatMultTransposeAdd(A, stage_adj, x_adj, x_adj);
+  if (compute_gradient && A == mastereq->getRHS()) {
+    /* Add to reduced gradient in the same sweep */
+    mastereq->computedRHSdp_MatMultTranspose(thalf, stage, stage_adj, 1.0, grad, rhs);
+    VecAXPY(x_adj, 1.0, rhs);
+  } else {
+    if (compute_gradient) mastereq->computedRHSdp(thalf, stage, stage_adj, 1.0, grad);
+    MatMultTransposeAdd(A, stage_adj, x_adj, x_adj);
+  }
+
+}
+
+
+KSP ImplMidpoint::getLUSolver(double dt){
+
+  /* The RHS is uniquely determined by its time-dependent coefficients. Look up the factorization. */
+  mastereq->getRHSCoefficients(lu_key);
+  lu_key.push_back(dt);
+  for (int i = 0; i < lu_keys.size(); i++) {
+    if (lu_keys[i] == lu_key) return lu_ksps[i];
+  }
+
+  /* Assemble (I - dt/2 A) densely. This applies A to all unit vectors, hence only feasible for small and medium systems. */
+  Mat M;
+  MatComputeOperator(IMRop, MATDENSE, &M);
+  MatScale(M, -dt/2.0);
+  MatShift(M, 1.0);
+
+  /* Factorize */
+  KSP lu;
+  PC pc;
+  KSPCreate(PETSC_COMM_WORLD, &lu);
+  KSPSetType(lu, KSPPREONLY);
+  KSPGetPC(lu, &pc);
+  PCSetType(pc, PCLU);
+  KSPSetOperators(lu, M, M);
+  KSPSetOptionsPrefix(lu, "lu_");
+  KSPSetFromOptions(lu);
+  KSPSetUp(lu);
+  lu_nfactor++;
+
+  /* Store in the cache, replace the oldest entry if full */
+  if (lu_keys.size() < lu_cachesize) {
+    lu_keys.push_back(lu_key);
+    lu_mats.push_back(M);
+    lu_ksps.push_back(lu);
+  } else {
+    KSPDestroy(&(lu_ksps[lu_next]));
+    MatDestroy(&(lu_mats[lu_next]));
+    lu_keys[lu_next] = lu_key;
+    lu_mats[lu_next] = M;
+    lu_ksps[lu_next] = lu;
+    lu_next = (lu_next + 1) % lu_cachesize;
+  }
+
+  return lu;
+}
 
+
+/* Copy ncols columns of the dense matrix A, starting at column a0, into the dense matrix B, starting at column b0 */
+static void copyDenseColumns(Mat A, int a0, Mat B, int b0, int ncols){
+  Vec a, b;
+  for (int j = 0; j < ncols; j++) {
+    MatDenseGetColumnVecRead(A, a0 + j, &a);
+    MatDenseGetColumnVecWrite(B, b0 + j, &b);
+    VecCopy(a, b);
+    MatDenseRestoreColumnVecWrite(B, b0 + j, &b);
+    MatDenseRestoreColumnVecRead(A, a0 + j, &a);
+  }
+}
+
+
+void ImplMidpoint::evolveFWDBlock(const double tstart, const double tstop, Mat X, Mat Y){
+
+  /* With M = I - dt/2 A, the midpoint step x + dt M^{-1} A x equals 2 M^{-1} x - x. 
+   * The factorization is looked up with the fixed step size dt rather than tstop - tstart, which differs by round-off between the steps, such that all steps (and the adjoint) share it. */
+  mastereq->assemble_RHS( (tstart + tstop) / 2.0);
+  KSPMatSolve(getLUSolver(dt), X, Y);
+  linsolve_counter++;
+  MatScale(Y, 2.0);
+  MatAYPX(X, -1.0, Y, SAME_NONZERO_PATTERN);
+}
+
+
+void ImplMidpoint::solveODEBlock(Mat X){
+
+  if (linsolve_type != LinearSolverType::LU || adaptive) {
+    printf("ERROR: Batched propagation requires the LU solver and a fixed time step size.\n");
+    exit(1);
+  }
+
+  Mat Y;
+  MatDuplicate(X, MAT_DO_NOT_COPY_VALUES, &Y);
+
+  penalty_integral = 0.0;
+  penalty_dpdm = 0.0;
+  energy_penalty_integral = 0.0;
+  prefillControls();
+  for (int n = 0; n < ntime; n++) {
+    evolveFWDBlock(tgrid[n], tgrid[n+1], X, Y);
+    if (gamma_penalty_energy > 1e-13) energy_penalty_integral += energyPenaltyIntegral(tgrid[n+1], dt);
+  }
+
+  MatDestroy(&Y);
+}
+
+
+void ImplMidpoint::solveAdjointODEBlock(Mat X, Mat Xbar, double Jbar_energy_penalty){
+
+  VecZeroEntries(redgrad);
+  mastereq->startGradientSeries();
+
+  /* Primal and adjoint states side by side, B = [X_n, Xbar_n] */
+  PetscInt nrows, nlocal, nb;
+  MatGetSize(X, &nrows, &nb);
+  MatGetLocalSize(X, &nlocal, NULL);
+  Mat B, Y;
+  MatCreateDense(PETSC_COMM_WORLD, nlocal, PETSC_DECIDE, nrows, 2*nb, NULL, &B);
+  copyDenseColumns(X, 0, B, 0, nb);
+  copyDenseColumns(Xbar, 0, B, nb, nb);
+  MatAssemblyBegin(B, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(B, MAT_FINAL_ASSEMBLY);
+  MatDuplicate(B, MAT_DO_NOT_COPY_VALUES, &Y);
+
+  for (int n = ntime; n > 0; n--) {
+    double tstop  = tgrid[n];
+    double tstart = tgrid[n-1];
+    double thalf = (tstart + tstop) / 2.0;
+
+    /* Derivative of energy penalty objective term */
+    if (gamma_penalty_energy > 1e-13) energyPenaltyIntegral_diff(tstop, dt, Jbar_energy_penalty, redgrad);
+
+    /* A is anti-symmetric for the Schroedinger equation, so (I - dt/2 A)^T = (I + dt/2 A). Hence one transposed solve with the factorization of the forward step gives both the backward step of the primal states and the adjoint stage: Y = (I + dt/2 A)^{-1} [X_n, Xbar_n] */
+    mastereq->assemble_RHS(thalf);
+    KSPMatSolveTranspose(getLUSolver(dt), B, Y);
+    linsolve_counter++;
+
+    /* Add to reduced gradient. The primal part of Y is the midpoint state (X_n-1 + X_n)/2, the adjoint stage is dt times the adjoint part of Y. */
+    Vec col;
+    for (int j = 0; j < nb; j++) {
+      MatDenseGetColumnVecRead(Y, j, &col);
+      VecCopy(col, xprimal);
+      MatDenseRestoreColumnVecRead(Y, j, &col);
+      MatDenseGetColumnVecRead(Y, nb + j, &col);
+      mastereq->computedRHSdp(thalf, xprimal, col, dt, redgrad);
+      MatDenseRestoreColumnVecRead(Y, nb + j, &col);
+    }
+
+    /* [X_n-1, Xbar_n-1] = 2 Y - [X_n, Xbar_n] */
+    MatScale(Y, 2.0);
+    MatAYPX(B, -1.0, Y, SAME_NONZERO_PATTERN);
+  }
+
+  /* Return the initial primal and adjoint states */
+  copyDenseColumns(B, 0, X, 0, nb);
+  copyDenseColumns(B, nb, Xbar, 0, nb);
+
+  MatDestroy(&B);
+  MatDestroy(&Y);
+
+  mastereq->finishGradientSeries(redgrad);
 }
 
 
@@ -821,6 +1502,19 @@ CompositionalImplMidpoint::~CompositionalImplMidpoint(){
 }
 
 
+void CompositionalImplMidpoint::getStageTimes(const double tstart, const double tstop, std::vector<double>& times) {
+
+  double dt = tstop - tstart;
+  double tcurr = tstart;
+
+  times.clear();
+  for (int istage = 0; istage < gamma.size(); istage++) {
+    double dt_stage = gamma[istage] * dt;
+    times.push_back((tcurr + (tcurr + dt_stage)) / 2.0);
+    tcurr = tcurr + dt_stage;
+  }
+}
+
 void CompositionalImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
 
   double dt = tstop - tstart;
@@ -864,3 +1558,479 @@ void CompositionalImplMidpoint::evolveBWD(const double tstop, const double tstar
   }
   assert(fabs(tcurr - tstart) < 1e-12);
 }
+
+
+int myMatMult_splitremainder(Mat R, Vec x, Vec y){
+
+  SplitCtx *ctx;
+  MatShellGetContext(R, (void**) &ctx);
+
+  /* y = A x */
+  MatMult(ctx->mastereq->getRHS(), x, y);
+
+  /* y -= D x, pointwise complex product */
+  PetscInt nlocal;
+  VecGetLocalSize(x, &nlocal);
+  const PetscScalar *xptr, *dptr;
+  PetscScalar* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(*ctx->drift, &dptr);
+  VecGetArray(y, &yptr);
+  for (int i = 0; i < nlocal/2; i++) {
+    double a = dptr[2*i];
+    double b = dptr[2*i+1];
+    yptr[2*i]   -= a * xptr[2*i] - b * xptr[2*i+1];
+    yptr[2*i+1] -= b * xptr[2*i] + a * xptr[2*i+1];
+  }
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArrayRead(*ctx->drift, &dptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+int myMatMultTranspose_splitremainder(Mat R, Vec x, Vec y){
+
+  SplitCtx *ctx;
+  MatShellGetContext(R, (void**) &ctx);
+
+  /* y = A^T x */
+  MatMultTranspose(ctx->mastereq->getRHS(), x, y);
+
+  /* y -= D^T x, i.e. pointwise product with the conjugate rates */
+  PetscInt nlocal;
+  VecGetLocalSize(x, &nlocal);
+  const PetscScalar *xptr, *dptr;
+  PetscScalar* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(*ctx->drift, &dptr);
+  VecGetArray(y, &yptr);
+  for (int i = 0; i < nlocal/2; i++) {
+    double a = dptr[2*i];
+    double b = dptr[2*i+1];
+    yptr[2*i]   -=   a * xptr[2*i] + b * xptr[2*i+1];
+    yptr[2*i+1] -= - b * xptr[2*i] + a * xptr[2*i+1];
+  }
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArrayRead(*ctx->drift, &dptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+StrangSplitting::StrangSplitting(MapParam config, MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_) : ImplMidpoint(config, mastereq_, ntime_, total_time_, linsolve_type_, linsolve_maxiter_, output_, storeFWD_) {
+
+  if (mpirank_world == 0) printf("Timestepper: Strang splitting, exact diagonal drift and Impl. Midpoint for the remainder\n");
+
+  /* Get the diagonal drift rates. Those are constant in time. */
+  MatCreateVecs(mastereq->getRHS(), &drift, NULL);
+  mastereq->getDriftDiagonal(drift);
+  VecDuplicate(drift, &x_mid);
+
+  /* Create the remainder MatShell and hand it to the midpoint step */
+  PetscInt nlocal;
+  VecGetLocalSize(drift, &nlocal);
+  splitctx.mastereq = mastereq;
+  splitctx.drift = &drift;
+  MatCreateShell(PETSC_COMM_WORLD, nlocal, nlocal, dim, dim, (void**) &splitctx, &R);
+  MatSetFromOptions(R); MatSetUp(R);
+  MatShellSetOperation(R, MATOP_MULT, (void(*)(void)) myMatMult_splitremainder);
+  MatShellSetOperation(R, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_splitremainder);
+  MatAssemblyBegin(R, MAT_FINAL_ASSEMBLY); MatAssemblyEnd(R, MAT_FINAL_ASSEMBLY);
+  setIMROperator(R);
+}
+
+StrangSplitting::~StrangSplitting(){
+  MatDestroy(&R);
+  VecDestroy(&drift);
+  VecDestroy(&x_mid);
+}
+
+void StrangSplitting::applyDrift(Vec x, double dt, bool transpose){
+
+  /* x_i <- exp(dt*(a_i + i b_i)) x_i. The transpose rotates by -b_i. */
+  double sign = transpose ? -1.0 : 1.0;
+
+  PetscInt nlocal;
+  VecGetLocalSize(x, &nlocal);
+  const PetscScalar* dptr;
+  PetscScalar* xptr;
+  VecGetArrayRead(drift, &dptr);
+  VecGetArray(x, &xptr);
+  for (int i = 0; i < nlocal/2; i++) {
+    double damp = exp(dt * dptr[2*i]);
+    double c = damp * cos(dt * dptr[2*i+1]);
+    double s = sign * damp * sin(dt * dptr[2*i+1]);
+    double u = xptr[2*i];
+    double v = xptr[2*i+1];
+    xptr[2*i]   = c * u - s * v;
+    xptr[2*i+1] = s * u + c * v;
+  }
+  VecRestoreArrayRead(drift, &dptr);
+  VecRestoreArray(x, &xptr);
+}
+
+void StrangSplitting::evolveFWD(const double tstart,const  double tstop, Vec x) {
+
+  double dt = tstop - tstart;
+
+  applyDrift(x, dt/2.0, false);
+  ImplMidpoint::evolveFWD(tstart, tstop, x);
+  applyDrift(x, dt/2.0, false);
+}
+
+void StrangSplitting::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
+
+  double dt = tstop - tstart;
+
+  /* Primal state at the start of the midpoint substep. The drift does not depend on the 
+   * control parameters, so only the midpoint substep contributes to the gradient. */
+  VecCopy(x, x_mid);
+  applyDrift(x_mid, dt/2.0, false);
+
+  applyDrift(x_adj, dt/2.0, true);
+  ImplMidpoint::evolveBWD(tstop, tstart, x_mid, x_adj, grad, compute_gradient);
+  applyDrift(x_adj, dt/2.0, true);
+}
+
+
+/* Create a state vector without storage, used as a view onto one stage of a block vector (see VecPlaceArray) */
+static void createStageView(int nlocal, int dim, Vec* view){
+  int mpisize_petsc;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+  if (mpisize_petsc == 1) VecCreateSeqWithArray(PETSC_COMM_WORLD, 1, nlocal, NULL, view);
+  else VecCreateMPIWithArray(PETSC_COMM_WORLD, 1, nlocal, dim, NULL, view);
+}
+
+
+int myMatMult_GLstages(Mat M, Vec k, Vec y){
+
+  GLStageCtx *ctx;
+  MatShellGetContext(M, (void**) &ctx);
+  int s = ctx->nstages;
+
+  const PetscScalar* kptr;
+  PetscScalar* yptr;
+  VecGetArrayRead(k, &kptr);
+  VecGetArray(y, &yptr);
+  for (int i=0; i<s; i++) {
+    VecPlaceArray(ctx->k_in[i], kptr + i*ctx->nlocal);
+    VecPlaceArray(ctx->k_out[i], yptr + i*ctx->nlocal);
+  }
+
+  for (int i=0; i<s; i++) {
+    /* aux = sum_j a_ij k_j */
+    VecZeroEntries(ctx->aux[i]);
+    VecMAXPY(ctx->aux[i], s, &(ctx->a[i*s]), ctx->k_in.data());
+
+    /* y_i = k_i - dt * A(t_i) aux */
+    ctx->mastereq->assemble_RHS(ctx->tstart + ctx->c[i] * ctx->dt);
+    MatMult(ctx->mastereq->getRHS(), ctx->aux[i], ctx->k_out[i]);
+    VecAYPX(ctx->k_out[i], -ctx->dt, ctx->k_in[i]);
+  }
+
+  for (int i=0; i<s; i++) {
+    VecResetArray(ctx->k_in[i]);
+    VecResetArray(ctx->k_out[i]);
+  }
+  VecRestoreArrayRead(k, &kptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+int myMatMultTranspose_GLstages(Mat M, Vec k, Vec y){
+
+  GLStageCtx *ctx;
+  MatShellGetContext(M, (void**) &ctx);
+  int s = ctx->nstages;
+
+  const PetscScalar* kptr;
+  PetscScalar* yptr;
+  VecGetArrayRead(k, &kptr);
+  VecGetArray(y, &yptr);
+  for (int i=0; i<s; i++) {
+    VecPlaceArray(ctx->k_in[i], kptr + i*ctx->nlocal);
+    VecPlaceArray(ctx->k_out[i], yptr + i*ctx->nlocal);
+  }
+
+  /* aux_i = A(t_i)^T k_i */
+  for (int i=0; i<s; i++) {
+    ctx->mastereq->assemble_RHS(ctx->tstart + ctx->c[i] * ctx->dt);
+    MatMultTranspose(ctx->mastereq->getRHS(), ctx->k_in[i], ctx->aux[i]);
+  }
+
+  /* y_j = k_j - dt * sum_i a_ij aux_i */
+  for (int j=0; j<s; j++) {
+    VecCopy(ctx->k_in[j], ctx->k_out[j]);
+    for (int i=0; i<s; i++) {
+      VecAXPY(ctx->k_out[j], -ctx->dt * ctx->a[i*s+j], ctx->aux[i]);
+    }
+  }
+
+  for (int i=0; i<s; i++) {
+    VecResetArray(ctx->k_in[i]);
+    VecResetArray(ctx->k_out[i]);
+  }
+  VecRestoreArrayRead(k, &kptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+GaussLegendre::GaussLegendre(MapParam config, int order_, MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_) : TimeStepper(config, mastereq_, ntime_, total_time_, output_, storeFWD_) {
+
+  order = order_;
+  nstages = order / 2;
+
+  /* Butcher tableau */
+  std::vector<double> a, c;
+  if (order == 4) {
+    double sq3 = sqrt(3.0);
+    c.push_back(0.5 - sq3/6.);
+    c.push_back(0.5 + sq3/6.);
+    b.push_back(0.5);
+    b.push_back(0.5);
+    a.push_back(0.25);          a.push_back(0.25 - sq3/6.);
+    a.push_back(0.25 + sq3/6.); a.push_back(0.25);
+  } else if (order == 6) {
+    double sq15 = sqrt(15.0);
+    c.push_back(0.5 - sq15/10.);
+    c.push_back(0.5);
+    c.push_back(0.5 + sq15/10.);
+    b.push_back(5./18.);
+    b.push_back(4./9.);
+    b.push_back(5./18.);
+    a.push_back(5./36.);            a.push_back(2./9. - sq15/15.); a.push_back(5./36. - sq15/30.);
+    a.push_back(5./36. + sq15/24.); a.push_back(2./9.);            a.push_back(5./36. - sq15/24.);
+    a.push_back(5./36. + sq15/30.); a.push_back(2./9. + sq15/15.); a.push_back(5./36.);
+  } else {
+    printf("ERROR: Gauss-Legendre time stepper is only available for order 4 or 6, not %d.\n", order);
+    exit(1);
+  }
+
+  if (mpirank_world == 0) printf("Timestepper: Gauss-Legendre IRK, order %d, %d stages\n", order, nstages);
+
+  /* Set up the stage system context */
+  int nlocal;
+  VecGetLocalSize(x, &nlocal);
+  stagectx.mastereq = mastereq;
+  stagectx.nstages = nstages;
+  stagectx.nlocal = nlocal;
+  stagectx.a = a;
+  stagectx.c = c;
+  stagectx.tstart = 0.0;
+  stagectx.dt = dt;
+  for (int i = 0; i < nstages; i++) {
+    Vec view;
+    createStageView(nlocal, dim, &view);
+    stagectx.k_in.push_back(view);
+    createStageView(nlocal, dim, &view);
+    stagectx.k_out.push_back(view);
+    Vec state;
+    VecDuplicate(x, &state);
+    stagectx.aux.push_back(state);
+  }
+  VecDuplicate(x, &aux);
+
+  /* Create the MatShell for the coupled stage system, stages are stored consecutively in the local block */
+  MatCreateShell(PETSC_COMM_WORLD, nstages*nlocal, nstages*nlocal, PETSC_DETERMINE, PETSC_DETERMINE, (void**) &stagectx, &M);
+  MatSetFromOptions(M); MatSetUp(M);
+  MatShellSetOperation(M, MATOP_MULT, (void(*)(void)) myMatMult_GLstages);
+  MatShellSetOperation(M, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_GLstages);
+  MatAssemblyBegin(M, MAT_FINAL_ASSEMBLY); MatAssemblyEnd(M, MAT_FINAL_ASSEMBLY);
+  MatCreateVecs(M, &K, NULL);
+  VecDuplicate(K, &K_adj);
+  VecDuplicate(K, &rhs_block);
+  VecZeroEntries(K);
+  VecZeroEntries(K_adj);
+  VecZeroEntries(rhs_block);
+
+  linsolve_type = linsolve_type_;
+  if (linsolve_type == LinearSolverType::LU) {
+    if (mpirank_world == 0) printf("# Warning: LU solver is not available for the Gauss-Legendre stage system. Using GMRES instead.\n");
+    linsolve_type = LinearSolverType::GMRES;
+  }
+  linsolve_maxiter = linsolve_maxiter_;
+  linsolve_reltol = 1.e-20;
+  linsolve_abstol = 1.e-10;
+
+  if (linsolve_type == LinearSolverType::GMRES) {
+    /* Create Petsc's linear solver */
+    KSPCreate(PETSC_COMM_WORLD, &ksp);
+    KSPGetPC(ksp, &preconditioner);
+    PCSetType(preconditioner, PCNONE);
+    KSPSetTolerances(ksp, linsolve_reltol, linsolve_abstol, PETSC_DEFAULT, linsolve_maxiter);
+    KSPSetType(ksp, KSPGMRES);
+    KSPSetOperators(ksp, M, M);
+    KSPSetFromOptions(ksp);
+  }
+  else {
+    /* For Neumann iterations, allocate temporary block vectors */
+    VecDuplicate(K, &tmp);
+    VecDuplicate(K, &err);
+  }
+}
+
+
+GaussLegendre::~GaussLegendre(){
+  if (linsolve_type == LinearSolverType::GMRES) {
+    KSPDestroy(&ksp);
+  } else {
+    VecDestroy(&tmp);
+    VecDestroy(&err);
+  }
+  for (int i = 0; i < nstages; i++) {
+    VecDestroy(&(stagectx.k_in[i]));
+    VecDestroy(&(stagectx.k_out[i]));
+    VecDestroy(&(stagectx.aux[i]));
+  }
+  VecDestroy(&aux);
+  VecDestroy(&K);
+  VecDestroy(&K_adj);
+  VecDestroy(&rhs_block);
+  MatDestroy(&M);
+}
+
+
+void GaussLegendre::setStageRHS(const Vec x){
+
+  PetscScalar* rhsptr;
+  VecGetArray(rhs_block, &rhsptr);
+  for (int i = 0; i < nstages; i++) {
+    VecPlaceArray(stagectx.k_out[i], rhsptr + i*stagectx.nlocal);
+    mastereq->assemble_RHS(stagectx.tstart + stagectx.c[i] * stagectx.dt);
+    MatMult(mastereq->getRHS(), x, stagectx.k_out[i]);
+    VecResetArray(stagectx.k_out[i]);
+  }
+  VecRestoreArray(rhs_block, &rhsptr);
+}
+
+
+void GaussLegendre::solveStages(Vec rhs, Vec y, bool transpose){
+
+  /* The constructor switches LU to GMRES */
+  assert(linsolve_type != LinearSolverType::LU);
+
+  switch (linsolve_type) {
+    case LinearSolverType::GMRES:
+      if (!transpose) KSPSolve(ksp, rhs, y);
+      else            KSPSolveTranspose(ksp, rhs, y);
+
+      /* Monitor error */
+      double rnorm;
+      KSPGetResidualNorm(ksp, &rnorm);
+      if (rnorm > 1e-3)  {
+        printf("WARNING: Linear solver residual norm: %1.5e\n", rnorm);
+      }
+      break;
+
+    case LinearSolverType::NEUMANN:
+      /* Fixed point iteration y = rhs + (I - M) y */
+      double errnorm, errnorm0;
+      VecCopy(rhs, y);
+      for (int iter = 0; iter < linsolve_maxiter; iter++) {
+        VecCopy(y, err);
+        if (!transpose) MatMult(M, y, tmp);
+        else            MatMultTranspose(M, y, tmp);
+        VecAXPBYPCZ(y, 1.0, -1.0, 1.0, rhs, tmp);
+
+        /* Error approximation and stopping criteria */
+        VecAXPY(err, -1.0, y);
+        VecNorm(err, NORM_2, &errnorm);
+        if (iter == 0) errnorm0 = errnorm;
+        if (errnorm < linsolve_abstol) break;
+        if (errnorm / errnorm0 < linsolve_reltol) break;
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+void GaussLegendre::getStageTimes(const double tstart, const double tstop, std::vector<double>& times) {
+  times.clear();
+  for (int i = 0; i < nstages; i++) times.push_back(tstart + stagectx.c[i] * (tstop - tstart));
+}
+
+void GaussLegendre::evolveFWD(const double tstart, const double tstop, Vec x) {
+
+  stagectx.tstart = tstart;
+  stagectx.dt = tstop - tstart;
+
+  /* Solve (I - dt (a \otimes A)) K = [A(t_i) x]_i for all stages */
+  setStageRHS(x);
+  solveStages(rhs_block, K, false);
+
+  /* --- Update state x += dt * sum_i b_i k_i --- */
+  const PetscScalar* kptr;
+  VecGetArrayRead(K, &kptr);
+  for (int i = 0; i < nstages; i++) {
+    VecPlaceArray(stagectx.k_in[i], kptr + i*stagectx.nlocal);
+    VecAXPY(x, stagectx.dt * b[i], stagectx.k_in[i]);
+    VecResetArray(stagectx.k_in[i]);
+  }
+  VecRestoreArrayRead(K, &kptr);
+}
+
+
+void GaussLegendre::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
+
+  stagectx.tstart = tstart;
+  stagectx.dt = tstop - tstart;
+
+  /* Recompute the primal stages from x_n, needed for the gradient */
+  if (compute_gradient) {
+    setStageRHS(x);
+    solveStages(rhs_block, K, false);
+  }
+
+  /* Solve for the adjoint stages (I - dt (a \otimes A))^T K_adj = [dt b_i x_adj]_i */
+  PetscScalar* rhsptr;
+  VecGetArray(rhs_block, &rhsptr);
+  for (int i = 0; i < nstages; i++) {
+    VecPlaceArray(stagectx.k_out[i], rhsptr + i*stagectx.nlocal);
+    VecCopy(x_adj, stagectx.k_out[i]);
+    VecScale(stagectx.k_out[i], stagectx.dt * b[i]);
+    VecResetArray(stagectx.k_out[i]);
+  }
+  VecRestoreArray(rhs_block, &rhsptr);
+  solveStages(rhs_block, K_adj, true);
+
+  const PetscScalar *kptr, *kadjptr;
+  VecGetArrayRead(K, &kptr);
+  VecGetArrayRead(K_adj, &kadjptr);
+  for (int i = 0; i < nstages; i++) {
+    VecPlaceArray(stagectx.k_in[i], kptr + i*stagectx.nlocal);
+    VecPlaceArray(stagectx.k_out[i], kadjptr + i*stagectx.nlocal);
+  }
+
+  for (int i = 0; i < nstages; i++) {
+    double ti = stagectx.tstart + stagectx.c[i] * stagectx.dt;
+
+    /* Add to reduced gradient, using the stage values Y_i = x + dt sum_j a_ij k_j */
+    if (compute_gradient) {
+      VecCopy(x, aux);
+      for (int j = 0; j < nstages; j++) {
+        VecAXPY(aux, stagectx.dt * stagectx.a[i*nstages+j], stagectx.k_in[j]);
+      }
+      mastereq->computedRHSdp(ti, aux, stagectx.k_out[i], 1.0, grad);
+    }
+
+    /* Update adjoint state x_adj += A(t_i)^T k_adj_i */
+    mastereq->assemble_RHS(ti);
+    MatMultTransposeAdd(mastereq->getRHS(), stagectx.k_out[i], x_adj, x_adj);
+  }
+
+  for (int i = 0; i < nstages; i++) {
+    VecResetArray(stagectx.k_in[i]);
+    VecResetArray(stagectx.k_out[i]);
+  }
+  VecRestoreArrayRead(K, &kptr);
+  VecRestoreArrayRead(K_adj, &kadjptr);
+}
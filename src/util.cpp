@@ -334,6 +334,90 @@ PetscErrorCode AkronB(const Mat A, const Mat B, const double alpha, Mat *Out, In
 }
 
 
+MPI_Win MatShareOnNode(Mat* A){
+
+  /* Distributed matrices differ between processors, keep them. */
+  int mpisize_petsc;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+  if (mpisize_petsc > 1) return MPI_WIN_NULL;
+
+  /* Processors on the same node */
+  MPI_Comm comm_node;
+  int mpirank_node, mpisize_node;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &comm_node);
+  MPI_Comm_rank(comm_node, &mpirank_node);
+  MPI_Comm_size(comm_node, &mpisize_node);
+  if (mpisize_node == 1) {
+    MPI_Comm_free(&comm_node);
+    return MPI_WIN_NULL;
+  }
+
+  PetscInt nrows, ncols;
+  MatGetSize(*A, &nrows, &ncols);
+
+  /* Count the nonzeros */
+  PetscInt ncols_row;
+  PetscInt nnz = 0;
+  if (mpirank_node == 0) {
+    for (PetscInt row = 0; row < nrows; row++) {
+      MatGetRow(*A, row, &ncols_row, NULL, NULL);
+      nnz += ncols_row;
+      MatRestoreRow(*A, row, &ncols_row, NULL, NULL);
+    }
+  }
+  MPI_Bcast(&nnz, 1, MPIU_INT, 0, comm_node);
+
+  /* Allocate the shared CSR storage: values, row pointers, column indices, and the (empty) row pointers of the off-diagonal block */
+  MPI_Aint nbytes = nnz * sizeof(PetscScalar) + (2*(nrows+1) + nnz) * sizeof(PetscInt);
+  MPI_Win win;
+  char* baseptr;
+  MPI_Win_allocate_shared(mpirank_node == 0 ? nbytes : 0, 1, MPI_INFO_NULL, comm_node, &baseptr, &win);
+  if (mpirank_node > 0) {
+    MPI_Aint size;
+    int dispunit;
+    MPI_Win_shared_query(win, 0, &size, &dispunit, &baseptr);
+  }
+  PetscScalar* vals = (PetscScalar*) baseptr;
+  PetscInt* rowptr = (PetscInt*) (vals + nnz);
+  PetscInt* colids = rowptr + nrows + 1;
+  PetscInt* rowptr_off = colids + nnz;
+
+  /* Copy the matrix on the first processor of the node */
+  MPI_Win_fence(0, win);
+  if (mpirank_node == 0) {
+    const PetscInt* cols;
+    const PetscScalar* rowvals;
+    rowptr[0] = 0;
+    for (PetscInt row = 0; row < nrows; row++) {
+      MatGetRow(*A, row, &ncols_row, &cols, &rowvals);
+      for (PetscInt j = 0; j < ncols_row; j++) {
+        colids[rowptr[row] + j] = cols[j];
+        vals[rowptr[row] + j] = rowvals[j];
+      }
+      rowptr[row+1] = rowptr[row] + ncols_row;
+      MatRestoreRow(*A, row, &ncols_row, &cols, &rowvals);
+    }
+    for (PetscInt row = 0; row <= nrows; row++) rowptr_off[row] = 0;
+  }
+  MPI_Win_fence(0, win);
+
+  /* Replace the own copy by a matrix of the same type on the shared arrays */
+  MatType type;
+  MatGetType(*A, &type);
+  Mat Ashared;
+  if (strcmp(type, MATMPIAIJ) == 0) {
+    MatCreateMPIAIJWithSplitArrays(PETSC_COMM_WORLD, nrows, ncols, nrows, ncols, rowptr, colids, vals, rowptr_off, colids, vals, &Ashared);
+  } else {
+    MatCreateSeqAIJWithArrays(PETSC_COMM_WORLD, nrows, ncols, rowptr, colids, vals, &Ashared);
+  }
+  MatDestroy(A);
+  *A = Ashared;
+
+  MPI_Comm_free(&comm_node);
+  return win;
+}
+
+
 PetscErrorCode MatIsAntiSymmetric(Mat A, PetscReal tol, PetscBool *flag) {
   
   int ierr; 
@@ -0,0 +1,12 @@
+NUM_PARALLEL_PROCESSORS=0
+# Same case as AxC_schroedinger_matfree, with the matrix-free kernels shared among 2 OpenMP threads (quandary built with WITH_OPENMP = true). The threaded gradient reduction sums in a different order, hence no bitwise comparison.
+TOLERANCE=1.0e-7
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/AxC_schroedinger_matfree_omp
+    OMP_NUM_THREADS=2 $QUANDARY AxC_schroedinger_matfree_omp.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,13 @@
+NUM_PARALLEL_PROCESSORS=0
+# Self-check: the reference data in base/ is computed by propagating each initial condition separately (cnot-schroedinger_batched_reference.cfg). The batched run uses the same factorizations and agrees up to round-off.
+TOLERANCE=1.0e-9
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out base
+    cd ${DIR}/cnot-schroedinger_batched
+    $QUANDARY cnot-schroedinger_batched_reference.cfg 
+    $QUANDARY cnot-schroedinger_batched.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,13 @@
+NUM_PARALLEL_PROCESSORS=0
+# Self-check: the reference run in base/ uses central instead of forward differences for the Hessian-vector products (cnot_BNLS_reference.cfg), and the comparison tolerance covers the finite-difference error.
+TOLERANCE=1.0e-3
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out base
+    cd ${DIR}/cnot_BNLS
+    $QUANDARY cnot_BNLS_reference.cfg 
+    $QUANDARY cnot_BNLS.cfg 
+    cd ${DIR}
+    ;;
+esac
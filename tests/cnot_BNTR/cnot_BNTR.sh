@@ -0,0 +1,13 @@
+NUM_PARALLEL_PROCESSORS=0
+# Self-check: the reference run in base/ uses central instead of forward differences for the Jacobian-vector products of the Gauss-Newton Hessian (cnot_BNTR_reference.cfg), and the comparison tolerance covers the finite-difference error.
+TOLERANCE=1.0e-3
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out base
+    cd ${DIR}/cnot_BNTR
+    $QUANDARY cnot_BNTR_reference.cfg 
+    $QUANDARY cnot_BNTR.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,13 @@
+NUM_PARALLEL_PROCESSORS=0
+# Self-check: the reference solution in base/ is computed with a high-order scheme (cnot_GL6_reference.cfg), and the comparison tolerance covers the time discretization error.
+TOLERANCE=1.0e-5
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out base
+    cd ${DIR}/cnot_GL6
+    $QUANDARY cnot_GL6_reference.cfg 
+    $QUANDARY cnot_GL6.cfg 
+    cd ${DIR}
+    ;;
+esac
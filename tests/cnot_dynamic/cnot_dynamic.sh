@@ -0,0 +1,10 @@
+NUM_PARALLEL_PROCESSORS=4
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_dynamic
+    $QUANDARY cnot_dynamic.cfg 
+    cd ${DIR}
+    ;;
+esac
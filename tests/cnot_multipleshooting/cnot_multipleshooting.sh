@@ -0,0 +1,13 @@
+NUM_PARALLEL_PROCESSORS=0
+# Starting from a continuous trajectory, objective function, fidelity, terminal cost and Tikhonov term must match the sequential cnot run. The gradient differs, since the window start states are design variables.
+COLUMNS=1,4,5,6
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_multipleshooting
+    QUANDARY="$COMMAND -n 2 ${DIR}/../quandary"
+    $QUANDARY cnot_multipleshooting.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,10 @@
+NUM_PARALLEL_PROCESSORS=2
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_parareal
+    $QUANDARY cnot_parareal.cfg 
+    cd ${DIR}
+    ;;
+esac
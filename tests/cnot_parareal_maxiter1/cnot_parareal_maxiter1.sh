@@ -0,0 +1,10 @@
+NUM_PARALLEL_PROCESSORS=3
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_parareal_maxiter1
+    $QUANDARY cnot_parareal_maxiter1.cfg 
+    cd ${DIR}
+    ;;
+esac
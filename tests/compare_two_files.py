@@ -1,7 +1,7 @@
 import sys
 import numpy as np
 
-def compare_two_files(basefile, currentfile, tolerance, isBitWiseStr):
+def compare_two_files(basefile, currentfile, tolerance, isBitWiseStr, columnsStr=""):
 
     def extract_data(filename):                                                        
         infile = open(filename, 'r')                                                   
@@ -26,10 +26,15 @@ def compare_two_files(basefile, currentfile, tolerance, isBitWiseStr):
     nrow2, ncol2, current_values = extract_data(currentfile)
     isBitWise = int(isBitWiseStr)
 
+    # Optionally compare only some columns, given as comma separated list of column indices (counting from 0)
+    columns = range(ncol)
+    if columnsStr != "":
+        columns = [int(c) for c in columnsStr.split(",")]
+
     if isBitWise:
         #compute relative difference bitwise 
         overall_error = 0.0
-        for j in range(ncol):
+        for j in columns:
             for i in range(nrow):
                 error = abs(base_values[i][j] - current_values[i][j])
                 if error > 0.0:
@@ -45,7 +50,7 @@ def compare_two_files(basefile, currentfile, tolerance, isBitWiseStr):
         difference = 0.0
         base = 0.0
         overall_error = 0.0
-        for j in range(ncol):
+        for j in columns:
             for i in range(nrow):
                 base = base + base_values[i][j]*base_values[i][j]
                 diff_comp = base_values[i][j] - current_values[i][j]
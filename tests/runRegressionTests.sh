@@ -164,10 +164,20 @@ do
 			subTestNum=0
 			parallel=false
 			NUM_PARALLEL_PROCESSORS=0
+			TOLERANCE=""
+			COLUMNS=""
 
 			# Get test names
 			. "$script"
 
+			# A test script may set its own comparison tolerance, e.g. if it checks against an independent reference solution, and restrict the comparison to some columns (COLUMNS, comma separated, counting from 0)
+			testTolerance=$tolerance
+			testBitWise=$isBitWise
+			if [[ -n "$TOLERANCE" ]]; then
+				testTolerance=$TOLERANCE
+				testBitWise=0
+			fi
+
 			while true;
 			do
 
@@ -266,6 +276,7 @@ do
 				if [[ "$dryRun" == "false" ]]; then
 
           if [[ "$rebase" == "true" ]]; then 
+            mkdir -p ${DIR}/${simulation}/base
             for baseOutput in ${DIR}/${simulation}/data_out/*
             do
               fileName="$(basename "$baseOutput")"
@@ -290,7 +301,7 @@ do
               if [[ "$fileName" == "grad.dat" ]] || [[ "$fileName" == "optim_history.dat" ]]; then
                 cd ${DIR}
                 echo "- comparing $fileName" 
-                python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" $tolerance $isBitWise
+                python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" $testTolerance $testBitWise "$COLUMNS"
                 if [[ $? -eq 1 ]]; then
                   echo "The $baseOutput files are different from the baseline." >> $simulationLogFile 2>&1
                   testFailed=true
@@ -301,7 +312,7 @@ do
                 if [[ "$fileName" == "rho"*".dat" ]] || [[ "$fileName" == "population"*".dat" ]]; then
                   cd ${DIR}
                   echo "- comparing $fileName" 
-                  python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" $tolerance $isBitWise
+                  python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" $testTolerance $testBitWise "$COLUMNS"
                   if [[ $? -eq 1 ]]; then
                     echo "The $baseOutput files are different from the baseline." >> $simulationLogFile 2>&1
                     testFailed=true
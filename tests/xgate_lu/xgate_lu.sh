@@ -0,0 +1,10 @@
+NUM_PARALLEL_PROCESSORS=0
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/xgate_lu
+    $QUANDARY xgate_lu.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,54 @@
+/*
+ * Micro-benchmark for evaluating the control basis functions.
+ * Measures the cost of one evaluation and one derivative of the quadratic B-spline controls over an increasing number of splines. The cost should be independent of the number of splines.
+ * Build with 'make bench_bspline', run with './bench_bspline [nevals]'.
+ */
+#include <chrono>
+#include "controlbasis.hpp"
+
+int main(int argc, char** argv) {
+
+  int neval = 1000000;
+  if (argc > 1) neval = atoi(argv[1]);
+  double T = 100.0;
+  std::vector<int> nsplines_list = {10, 100, 1000, 10000, 100000};
+
+  printf("# nsplines   evaluate [ns]   derivative [ns]\n");
+  for (int is = 0; is < nsplines_list.size(); is++) {
+    int nsplines = nsplines_list[is];
+    BSpline2nd spline(nsplines, 0.0, T, false);
+
+    std::vector<double> coeff(spline.getNparams());
+    for (int i = 0; i < coeff.size(); i++) coeff[i] = sin(0.1*i);
+
+    /* Evaluate */
+    double sum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < neval; n++) {
+      double t = T * n / neval;
+      double p, q;
+      spline.evaluate(t, coeff, 0, &p, &q);
+      sum += p + q;
+    }
+    auto stop = std::chrono::steady_clock::now();
+    double time_eval = std::chrono::duration<double, std::nano>(stop - start).count() / neval;
+
+    /* Derivative */
+    std::vector<int> ids;
+    std::vector<double> diff;
+    start = std::chrono::steady_clock::now();
+    for (int n = 0; n < neval; n++) {
+      double t = T * n / neval;
+      ids.clear();
+      diff.clear();
+      spline.derivative(t, coeff, ids, diff, 1.0, 1.0, 0);
+      sum += diff[0];
+    }
+    stop = std::chrono::steady_clock::now();
+    double time_diff = std::chrono::duration<double, std::nano>(stop - start).count() / neval;
+
+    printf("%10d   %13.2f   %15.2f   (checksum %1.4e)\n", nsplines, time_eval, time_diff, sum);
+  }
+
+  return 0;
+}